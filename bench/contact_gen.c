@@ -0,0 +1,153 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+#include "contact_gen.h"
+
+#include <stdio.h>
+
+#define ENTITY_KEY "com.apple.syncservices.RecordEntityName"
+
+/* a message with an empty records dict, the way the device frames a batch */
+static plist_t new_batch(plist_t *records)
+{
+	plist_t batch = plist_new_array();
+	plist_add_sub_string_el(batch, "SDMessageProcessChanges");
+	plist_add_sub_string_el(batch, "com.apple.Contacts");
+	*records = plist_new_dict();
+	plist_add_sub_node(batch, *records);
+	return batch;
+}
+
+static void add_attribute(plist_t records, char kind, int contact, int n, const char *entity, const char *type, const char *value)
+{
+	char id[32];
+	char contact_id[16];
+	plist_t record = plist_new_dict();
+	plist_t contact_array = plist_new_array();
+
+	snprintf(id, sizeof(id), "%c/%d/%d", kind, contact, n);
+	snprintf(contact_id, sizeof(contact_id), "%d", contact);
+
+	plist_add_sub_key_el(record, ENTITY_KEY);
+	plist_add_sub_string_el(record, entity);
+	plist_add_sub_key_el(record, "contact");
+	plist_add_sub_string_el(contact_array, contact_id);
+	plist_add_sub_node(record, contact_array);
+	if (type) {
+		plist_add_sub_key_el(record, "type");
+		plist_add_sub_string_el(record, type);
+	}
+	plist_add_sub_key_el(record, "value");
+	plist_add_sub_string_el(record, value);
+
+	plist_add_sub_key_el(records, id);
+	plist_add_sub_node(records, record);
+}
+
+static void add_contact(plist_t records, int contact)
+{
+	char buffer[64];
+	plist_t record = plist_new_dict();
+
+	plist_add_sub_key_el(record, ENTITY_KEY);
+	plist_add_sub_string_el(record, "com.apple.contacts.Contact");
+	snprintf(buffer, sizeof(buffer), "First%d", contact);
+	plist_add_sub_key_el(record, "first name");
+	plist_add_sub_string_el(record, buffer);
+	snprintf(buffer, sizeof(buffer), "Last%d", contact);
+	plist_add_sub_key_el(record, "last name");
+	plist_add_sub_string_el(record, buffer);
+
+	snprintf(buffer, sizeof(buffer), "%d", contact);
+	plist_add_sub_key_el(records, buffer);
+	plist_add_sub_node(records, record);
+}
+
+static void add_address(plist_t records, int contact)
+{
+	char id[32];
+	char buffer[64];
+	plist_t record = plist_new_dict();
+	plist_t contact_array = plist_new_array();
+
+	snprintf(id, sizeof(id), "5/%d/0", contact);
+	plist_add_sub_key_el(record, ENTITY_KEY);
+	plist_add_sub_string_el(record, "com.apple.contacts.Street Address");
+	plist_add_sub_key_el(record, "contact");
+	snprintf(buffer, sizeof(buffer), "%d", contact);
+	plist_add_sub_string_el(contact_array, buffer);
+	plist_add_sub_node(record, contact_array);
+	snprintf(buffer, sizeof(buffer), "%d Main Street", contact);
+	plist_add_sub_key_el(record, "street");
+	plist_add_sub_string_el(record, buffer);
+	snprintf(buffer, sizeof(buffer), "%05d", contact % 100000);
+	plist_add_sub_key_el(record, "postal code");
+	plist_add_sub_string_el(record, buffer);
+
+	plist_add_sub_key_el(records, id);
+	plist_add_sub_node(records, record);
+}
+
+int contact_gen_count(int contacts, int batch_size)
+{
+	return 4 * ((contacts + batch_size - 1) / batch_size);
+}
+
+plist_t contact_gen_batch(int contacts, int batch_size, int index)
+{
+	int per_entity = (contacts + batch_size - 1) / batch_size;
+	int entity = index / per_entity;
+	int first = (index % per_entity) * batch_size + 1;
+	int last = first + batch_size - 1;
+	plist_t records = NULL;
+	plist_t batch = new_batch(&records);
+	char value[64];
+	int i = 0;
+
+	if (last > contacts)
+		last = contacts;
+
+	for (i = first; i <= last; i++) {
+		switch (entity) {
+		case 0:
+			add_contact(records, i);
+			break;
+		case 1:
+			snprintf(value, sizeof(value), "+1555%07d", i);
+			add_attribute(records, '3', i, 0, "com.apple.contacts.Phone Number", "mobile", value);
+			snprintf(value, sizeof(value), "+1556%07d", i);
+			add_attribute(records, '3', i, 1, "com.apple.contacts.Phone Number", "work", value);
+			break;
+		case 2:
+			snprintf(value, sizeof(value), "contact%d@example.com", i);
+			add_attribute(records, '4', i, 0, "com.apple.contacts.Email Address", NULL, value);
+			break;
+		case 3:
+			add_address(records, i);
+			break;
+		}
+	}
+
+	//more records follow every batch but the last one
+	plist_add_sub_bool_el(batch, index + 1 < contact_gen_count(contacts, batch_size));
+	return batch;
+}
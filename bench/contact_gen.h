@@ -0,0 +1,46 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/**
+ * @file   contact_gen.h
+ *
+ * @brief  Synthetic MobileSync contact batches.
+ *
+ * Contacts are numbered from 1 and each has a mobile and a work phone,
+ * an email and an address. The device sends one entity after the other,
+ * so the batches are the contact records first, then the phone, email
+ * and address records, batch_size records of an entity at a time. Any
+ * batch can be built on its own, nothing has to be kept in between.
+ */
+
+#ifndef __CONTACT_GEN__
+#define __CONTACT_GEN__
+
+#include <plist/plist.h>
+
+/* how many batches make up the whole dump */
+int contact_gen_count(int contacts, int batch_size);
+
+/* builds batch index of the dump, to be freed by the caller */
+plist_t contact_gen_batch(int contacts, int batch_size, int index);
+
+#endif
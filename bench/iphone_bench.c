@@ -0,0 +1,549 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/*
+ * Conversion stage benchmark.
+ *
+ * Generates MobileSync contact batches in the shape the device sends
+ * them (see contact_gen.h) and times every stage the plugin puts them
+ * through, each on its own:
+ *
+ *   pcont_conv      native converter, feed and finish
+ *   pcont_raw       grouping the raw records of each contact, as raw_format reports them
+ *   pcont_commit    native serializer, each converted contact back to device records
+ *   plist_to_doc    whole dump as an XML tree, as process_plist_new_contact() builds it
+ *   xslt_transform  pcont2osync.xslt over that tree
+ *   split           serializing each <contact> for the parser
+ *   xmlformat_parse osync_xmlformat_parse() of each contact
+ *   xmlformat_sort  osync_xmlformat_sort()
+ *   data_new        osync_data_new() with xmlformat-contact
+ *
+ * Usage: iphone-sync-bench [-n count[,count...]] [-b batch] [-x xslt dir]
+ *                          [-s baseline] [-c baseline] [-t tolerance %]
+ *
+ * -s writes the measured throughput to a baseline file, -c compares
+ * against one and exits with 1 when a stage got slower than the
+ * tolerance allows.
+ */
+
+#include <opensync/opensync.h>
+#include <opensync/opensync-data.h>
+#include <opensync/opensync-format.h>
+#include <opensync/opensync-xmlformat.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <plist/plist.h>
+
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+
+#include "xslt_aux.h"
+#include "pcont_conv.h"
+#include "pcont_raw.h"
+#include "pcont_commit.h"
+#include "plist_aux.h"
+#include "contact_gen.h"
+
+#define DEFAULT_COUNTS "1000,10000,50000,200000"
+#define DEFAULT_BATCH 500
+#define DEFAULT_TOLERANCE 20
+
+#ifndef BENCH_XSLT_DIR
+#define BENCH_XSLT_DIR "."
+#endif
+
+/* every stage run_stages() times, in report order */
+static const char *stage_names[] = {
+	"pcont_conv",
+	"pcont_raw",
+	"pcont_commit",
+	"plist_to_doc",
+	"xslt_transform",
+	"split",
+	"xmlformat_parse",
+	"xmlformat_sort",
+	"data_new"
+};
+
+#define MAX_STAGES (sizeof(stage_names) / sizeof(stage_names[0]))
+
+typedef struct bench_stage {
+	const char *name;
+	double seconds;
+} bench_stage;
+
+typedef struct bench_run {
+	int contacts;
+	bench_stage stages[MAX_STAGES];
+	int count;
+	long peak_rss;
+} bench_run;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bench_stage *add_stage(bench_run *run, const char *name)
+{
+	bench_stage *stage = NULL;
+
+	//stages are added in the order of stage_names
+	assert((size_t) run->count < MAX_STAGES && !strcmp(stage_names[run->count], name));
+	stage = &run->stages[run->count++];
+	stage->name = name;
+	stage->seconds = 0;
+	return stage;
+}
+
+static long peak_rss(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+/* batches in the order the device sends them, see contact_gen.h */
+static plist_t *generate_batches(int contacts, int batch_size, int *nbatches)
+{
+	plist_t *batches = NULL;
+	int i = 0;
+
+	*nbatches = contact_gen_count(contacts, batch_size);
+	if (!(batches = calloc(*nbatches + 1, sizeof(plist_t))))
+		return NULL;
+	for (i = 0; i < *nbatches; i++)
+		batches[i] = contact_gen_batch(contacts, batch_size, i);
+	return batches;
+}
+
+static osync_bool count_contact(const char *uid, OSyncXMLFormat *xmlformat, void *userdata, OSyncError **error)
+{
+	(*(int *) userdata)++;
+	osync_xmlformat_unref(xmlformat);
+	return TRUE;
+}
+
+static osync_bool count_raw_contact(const char *uid, char *data, unsigned int size, void *userdata, OSyncError **error)
+{
+	(*(int *) userdata)++;
+	osync_free(data);
+	return TRUE;
+}
+
+/* only the serializer is timed, not the conversion feeding it */
+typedef struct commit_bench {
+	plist_t records;
+	double seconds;
+	int count;
+} commit_bench;
+
+static osync_bool serialize_contact(const char *uid, OSyncXMLFormat *xmlformat, void *userdata, OSyncError **error)
+{
+	commit_bench *bench = (commit_bench *) userdata;
+	double start = now();
+	osync_bool result = pcont_commit_append(bench->records, uid, xmlformat, error);
+
+	bench->seconds += now() - start;
+	bench->count++;
+	osync_xmlformat_unref(xmlformat);
+	return result;
+}
+
+/* takes ownership of the batches, the same wrapping dump_contact_feed() does */
+static plist_t build_dump(plist_t *batches, int nbatches)
+{
+	plist_t contacts = plist_new_array();
+	int i = 0;
+
+	for (i = 0; i < nbatches; i++) {
+		if (plist_find_node_by_string(batches[i], "com.apple.contacts.Contact")) {
+			plist_t contact_ref_dict = plist_new_dict();
+			plist_add_sub_key_el(contact_ref_dict, "contact-ref");
+			plist_add_sub_node(contact_ref_dict, batches[i]);
+			plist_add_sub_node(contacts, contact_ref_dict);
+		}
+		else
+			plist_add_sub_node(contacts, batches[i]);
+		batches[i] = NULL;
+	}
+	return contacts;
+}
+
+static osync_bool run_stages(bench_run *run, int batch_size, struct xslt_resources *xslt_ctx, OSyncObjFormat *format, OSyncError **error)
+{
+	bench_stage *native = add_stage(run, "pcont_conv");
+	bench_stage *grouped = add_stage(run, "pcont_raw");
+	bench_stage *serialize = add_stage(run, "pcont_commit");
+	commit_bench commit = { NULL, 0, 0 };
+	bench_stage *to_doc = add_stage(run, "plist_to_doc");
+	bench_stage *transform = add_stage(run, "xslt_transform");
+	bench_stage *split = add_stage(run, "split");
+	bench_stage *parse = add_stage(run, "xmlformat_parse");
+	bench_stage *sort = add_stage(run, "xmlformat_sort");
+	bench_stage *data_new = add_stage(run, "data_new");
+	plist_t *batches = NULL;
+	plist_t dump = NULL;
+	pcont_conv *conv = NULL;
+	pcont_raw *raw = NULL;
+	xmlDocPtr raw_doc = NULL;
+	xmlDocPtr doc = NULL;
+	xmlXPathCompExprPtr uid_expr = NULL;
+	xmlXPathContextPtr xpath_ctx = NULL;
+	xmlBufferPtr buffer = NULL;
+	xmlNodePtr node = NULL;
+	int nbatches = 0;
+	int converted = 0;
+	int i = 0;
+	double start = 0;
+	osync_bool result = FALSE;
+
+	if (!(batches = generate_batches(run->contacts, batch_size, &nbatches))) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to generate %d contacts", run->contacts);
+		goto exit;
+	}
+
+	start = now();
+	if (!(conv = pcont_conv_new(error)))
+		goto exit;
+	for (i = 0; i < nbatches; i++)
+		if (!pcont_conv_feed(conv, batches[i], error))
+			goto exit;
+	if (!pcont_conv_finish(conv, count_contact, &converted, error))
+		goto exit;
+	pcont_conv_free(conv);
+	conv = NULL;
+	native->seconds = now() - start;
+
+	if (converted != run->contacts) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Native converter reported %d contacts out of %d", converted, run->contacts);
+		goto exit;
+	}
+
+	converted = 0;
+	start = now();
+	if (!(raw = pcont_raw_new(error)))
+		goto exit;
+	for (i = 0; i < nbatches; i++)
+		if (!pcont_raw_feed(raw, batches[i], error))
+			goto exit;
+	if (!pcont_raw_finish(raw, count_raw_contact, &converted, error))
+		goto exit;
+	pcont_raw_free(raw);
+	raw = NULL;
+	grouped->seconds = now() - start;
+
+	if (converted != run->contacts) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Raw grouping reported %d contacts out of %d", converted, run->contacts);
+		goto exit;
+	}
+
+	commit.records = plist_new_dict();
+	if (!(conv = pcont_conv_new(error)))
+		goto exit;
+	for (i = 0; i < nbatches; i++)
+		if (!pcont_conv_feed(conv, batches[i], error))
+			goto exit;
+	if (!pcont_conv_finish(conv, serialize_contact, &commit, error))
+		goto exit;
+	pcont_conv_free(conv);
+	conv = NULL;
+	serialize->seconds = commit.seconds;
+
+	if (commit.count != run->contacts) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Serializer got %d contacts out of %d", commit.count, run->contacts);
+		goto exit;
+	}
+	plist_free(commit.records);
+	commit.records = NULL;
+
+	dump = build_dump(batches, nbatches);
+	start = now();
+	raw_doc = plist_to_xml_doc(dump);
+	to_doc->seconds = now() - start;
+	plist_free(dump);
+	dump = NULL;
+	if (!raw_doc) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to build the tree of %d contacts", run->contacts);
+		goto exit;
+	}
+
+	start = now();
+	doc = xslt_transform_tree(xslt_ctx, raw_doc);
+	transform->seconds = now() - start;
+	xmlFreeDoc(raw_doc);
+	raw_doc = NULL;
+	if (!doc || !xmlDocGetRootElement(doc)) {
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Stylesheet failed on %d contacts", run->contacts);
+		goto exit;
+	}
+
+	uid_expr = xmlXPathCompile(BAD_CAST "Uid/content");
+	xpath_ctx = xmlXPathNewContext(doc);
+	buffer = xmlBufferCreate();
+	if (!uid_expr || !xpath_ctx || !buffer) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate contact parser");
+		goto exit;
+	}
+
+	//the stylesheet makes one top level element per contact batch
+	converted = 0;
+	for (node = xslt_result_next(doc, NULL); node; node = xslt_result_next(doc, node)) {
+		OSyncXMLFormat *xmlformat = NULL;
+		OSyncData *odata = NULL;
+		xmlXPathObjectPtr xpath_obj = NULL;
+
+		//same work as convert_contact_node()
+		start = now();
+		xpath_ctx->node = node;
+		xpath_obj = xmlXPathCompiledEval(uid_expr, xpath_ctx);
+		xmlXPathFreeObject(xpath_obj);
+		xmlBufferEmpty(buffer);
+		xmlNodeDump(buffer, doc, node, 0, 0);
+		split->seconds += now() - start;
+
+		start = now();
+		xmlformat = osync_xmlformat_parse((const char *) xmlBufferContent(buffer), xmlBufferLength(buffer), error);
+		parse->seconds += now() - start;
+		if (!xmlformat)
+			goto exit;
+
+		start = now();
+		osync_xmlformat_sort(xmlformat);
+		sort->seconds += now() - start;
+
+		start = now();
+		odata = osync_data_new((char *) xmlformat, osync_xmlformat_size(), format, error);
+		data_new->seconds += now() - start;
+		if (!odata) {
+			osync_xmlformat_unref(xmlformat);
+			goto exit;
+		}
+		osync_data_unref(odata);
+		converted++;
+	}
+
+	if (converted != run->contacts) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Stylesheet produced %d contacts out of %d", converted, run->contacts);
+		goto exit;
+	}
+	result = TRUE;
+
+exit:
+	run->peak_rss = peak_rss();
+	for (i = 0; batches && i < nbatches; i++)
+		if (batches[i])
+			plist_free(batches[i]);
+	free(batches);
+	pcont_conv_free(conv);
+	pcont_raw_free(raw);
+	if (commit.records)
+		plist_free(commit.records);
+	if (dump)
+		plist_free(dump);
+	if (raw_doc)
+		xmlFreeDoc(raw_doc);
+	if (buffer)
+		xmlBufferFree(buffer);
+	if (xpath_ctx)
+		xmlXPathFreeContext(xpath_ctx);
+	if (uid_expr)
+		xmlXPathFreeCompExpr(uid_expr);
+	if (doc)
+		xmlFreeDoc(doc);
+	return result;
+}
+
+static double throughput(bench_run *run, bench_stage *stage)
+{
+	return stage->seconds > 0 ? run->contacts / stage->seconds : 0;
+}
+
+static void print_run(bench_run *run)
+{
+	int i = 0;
+
+	printf("%d contacts, peak RSS %ld kB\n", run->contacts, run->peak_rss);
+	for (i = 0; i < run->count; i++)
+		printf("  %-16s %10.3f ms %14.0f contacts/s\n", run->stages[i].name,
+		       run->stages[i].seconds * 1000, throughput(run, &run->stages[i]));
+}
+
+/* baseline lines are "<stage> <contacts> <contacts/s>" */
+static void save_baseline(FILE *file, bench_run *run)
+{
+	int i = 0;
+
+	for (i = 0; i < run->count; i++)
+		fprintf(file, "%s %d %.0f\n", run->stages[i].name, run->contacts, throughput(run, &run->stages[i]));
+}
+
+static int check_baseline(const char *path, bench_run *runs, int nruns, int tolerance)
+{
+	FILE *file = fopen(path, "r");
+	char name[64];
+	int contacts = 0;
+	double expected = 0;
+	int regressions = 0;
+	int i = 0;
+	int j = 0;
+
+	if (!file) {
+		fprintf(stderr, "Unable to read baseline %s\n", path);
+		return 1;
+	}
+
+	while (3 == fscanf(file, "%63s %d %lf", name, &contacts, &expected)) {
+		for (i = 0; i < nruns; i++) {
+			if (runs[i].contacts != contacts)
+				continue;
+			for (j = 0; j < runs[i].count; j++) {
+				double measured = throughput(&runs[i], &runs[i].stages[j]);
+				if (strcmp(runs[i].stages[j].name, name))
+					continue;
+				if (measured < expected * (100 - tolerance) / 100) {
+					printf("REGRESSION %s at %d contacts: %.0f contacts/s, baseline %.0f\n",
+					       name, contacts, measured, expected);
+					regressions++;
+				}
+			}
+		}
+	}
+	fclose(file);
+	return regressions ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *counts = DEFAULT_COUNTS;
+	const char *xslt_dir = BENCH_XSLT_DIR;
+	const char *save_path = NULL;
+	const char *check_path = NULL;
+	int batch_size = DEFAULT_BATCH;
+	int tolerance = DEFAULT_TOLERANCE;
+	bench_run *runs = NULL;
+	int nruns = 0;
+	struct xslt_resources *xslt_ctx = NULL;
+	OSyncFormatEnv *formatenv = NULL;
+	OSyncObjFormat *format = NULL;
+	OSyncError *error = NULL;
+	char path[512];
+	char *list = NULL;
+	char *count = NULL;
+	int result = 1;
+	int opt = 0;
+	int i = 0;
+
+	while (-1 != (opt = getopt(argc, argv, "n:b:x:s:c:t:"))) {
+		switch (opt) {
+		case 'n':
+			counts = optarg;
+			break;
+		case 'b':
+			batch_size = atoi(optarg);
+			break;
+		case 'x':
+			xslt_dir = optarg;
+			break;
+		case 's':
+			save_path = optarg;
+			break;
+		case 'c':
+			check_path = optarg;
+			break;
+		case 't':
+			tolerance = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n count[,count...]] [-b batch] [-x xslt dir] [-s baseline] [-c baseline] [-t tolerance %%]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (batch_size < 1)
+		batch_size = DEFAULT_BATCH;
+
+	if (!(formatenv = osync_format_env_new(&error)))
+		goto error;
+	if (!osync_format_env_load_plugins(formatenv, NULL, &error))
+		goto error;
+	if (!(format = osync_format_env_find_objformat(formatenv, "xmlformat-contact"))) {
+		osync_error_set(&error, OSYNC_ERROR_GENERIC, "Failed to find objformat xmlformat-contact");
+		goto error;
+	}
+
+	snprintf(path, sizeof(path), "%s/pcont2osync.xslt", xslt_dir);
+	if (!(xslt_ctx = xslt_new()) || xslt_initialize(xslt_ctx, path)) {
+		osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to load %s", path);
+		goto error;
+	}
+
+	if (!(list = strdup(counts)) || !(runs = calloc(strlen(counts) / 2 + 1, sizeof(bench_run)))) {
+		osync_error_set(&error, OSYNC_ERROR_GENERIC, "Out of memory");
+		goto error;
+	}
+
+	//smallest first, peak RSS only grows
+	for (count = strtok(list, ","); count; count = strtok(NULL, ",")) {
+		bench_run *run = &runs[nruns];
+		if ((run->contacts = atoi(count)) < 1)
+			continue;
+		if (!run_stages(run, batch_size, xslt_ctx, format, &error))
+			goto error;
+		print_run(run);
+		nruns++;
+	}
+
+	if (save_path) {
+		FILE *file = fopen(save_path, "w");
+		if (!file) {
+			osync_error_set(&error, OSYNC_ERROR_IO_ERROR, "Unable to write baseline %s", save_path);
+			goto error;
+		}
+		for (i = 0; i < nruns; i++)
+			save_baseline(file, &runs[i]);
+		fclose(file);
+	}
+
+	result = check_path ? check_baseline(check_path, runs, nruns, tolerance) : 0;
+	goto exit;
+
+error:
+	fprintf(stderr, "%s\n", osync_error_print(&error));
+	osync_error_unref(&error);
+exit:
+	free(runs);
+	free(list);
+	if (xslt_ctx)
+		xslt_delete(xslt_ctx);
+	if (formatenv)
+		osync_format_env_unref(formatenv);
+	return result;
+}
@@ -0,0 +1,401 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/*
+ * MobileSync device emulator.
+ *
+ * Serves the message sequence the plugin drives on a real device over a
+ * socket, framed the way msync_transport does it, so whole sessions can
+ * run and be profiled without a phone. Point the plugin at it with the
+ * "emulator" advanced option.
+ *
+ * com.apple.Contacts serves the synthetic address book of contact_gen.h,
+ * every other dataclass is empty. A session whose anchor matches the
+ * one of the last finished session of its dataclass is a fast sync
+ * without changes, anything else gets a slow sync. Changes sent by the computer are
+ * accepted and dropped.
+ *
+ * With -c every connection is served on its own thread as a separate,
+ * freshly plugged device, so several plugin instances can sync at once.
+ * Such devices do not remember anchors and always get a slow sync.
+ *
+ * Usage: iphone-sync-emulator [-a host:port|unix:path] [-n contacts]
+ *                             [-b batch] [-d delay ms] [-c] [-1]
+ */
+
+#include <opensync/opensync.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <plist/plist.h>
+
+#include "msync_transport.h"
+#include "contact_gen.h"
+
+#define DEFAULT_ADDRESS "127.0.0.1:3458"
+#define DEFAULT_CONTACTS 1000
+#define DEFAULT_BATCH 500
+#define EMPTY_PARAMETER_STRING "___EmptyParameterString___"
+#define MAX_DATACLASSES 8
+
+typedef struct dataclass_anchor {
+	char *dataclass;
+	/* anchor the computer sent for the last finished session */
+	char *anchor;
+} dataclass_anchor;
+
+typedef struct emulator {
+	int contacts;
+	int batch_size;
+	/* milliseconds before every answer */
+	int delay;
+	dataclass_anchor anchors[MAX_DATACLASSES];
+	/* current session */
+	char *dataclass;
+	char *next_anchor;
+	int next_batch;
+	int batches;
+} emulator;
+
+static int listen_on(const char *address)
+{
+	int fd = -1;
+	int on = 1;
+
+	if (!strncmp(address, "unix:", 5)) {
+		struct sockaddr_un addr;
+
+		if (strlen(address + 5) >= sizeof(addr.sun_path))
+			return -1;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, address + 5);
+		unlink(addr.sun_path);
+
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return -1;
+		if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, 1)) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	else {
+		struct addrinfo hints;
+		struct addrinfo *addrs = NULL;
+		char *host = strdup(address);
+		char *port = host ? strrchr(host, ':') : NULL;
+
+		if (!port) {
+			free(host);
+			return -1;
+		}
+		*port++ = '\0';
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		if (!getaddrinfo(*host ? host : NULL, port, &hints, &addrs)) {
+			if ((fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol)) >= 0) {
+				setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+				if (bind(fd, addrs->ai_addr, addrs->ai_addrlen) || listen(fd, 1)) {
+					close(fd);
+					fd = -1;
+				}
+			}
+			freeaddrinfo(addrs);
+		}
+		free(host);
+		return fd;
+	}
+}
+
+/* the nth string of a message, to be freed */
+static char *message_string(plist_t message, int n)
+{
+	plist_t node = NULL;
+	char *value = NULL;
+
+	for (node = plist_get_first_child(message); node; node = plist_get_next_sibling(node)) {
+		if (PLIST_STRING != plist_get_node_type(node))
+			continue;
+		if (!n--) {
+			plist_get_string_val(node, &value);
+			break;
+		}
+	}
+	return value;
+}
+
+static plist_t new_message(const char *name, const char *dataclass)
+{
+	plist_t array = plist_new_array();
+	plist_add_sub_string_el(array, name);
+	plist_add_sub_string_el(array, dataclass);
+	return array;
+}
+
+/* where the anchor of dataclass is kept, NULL once every slot is taken */
+static char **anchor_slot(emulator *emu, const char *dataclass)
+{
+	int i = 0;
+
+	for (i = 0; i < MAX_DATACLASSES && emu->anchors[i].dataclass; i++)
+		if (!strcmp(emu->anchors[i].dataclass, dataclass))
+			return &emu->anchors[i].anchor;
+	if (i == MAX_DATACLASSES || !(emu->anchors[i].dataclass = strdup(dataclass)))
+		return NULL;
+	return &emu->anchors[i].anchor;
+}
+
+static void free_emulator(emulator *emu)
+{
+	int i = 0;
+
+	for (i = 0; i < MAX_DATACLASSES; i++) {
+		free(emu->anchors[i].dataclass);
+		free(emu->anchors[i].anchor);
+	}
+	free(emu->next_anchor);
+	free(emu->dataclass);
+}
+
+static plist_t start_session(emulator *emu, plist_t message)
+{
+	char *old_anchor = message_string(message, 2);
+	char **anchor = NULL;
+	osync_bool fast = FALSE;
+	plist_t reply = NULL;
+
+	free(emu->dataclass);
+	free(emu->next_anchor);
+	emu->dataclass = message_string(message, 1);
+	emu->next_anchor = message_string(message, 3);
+	if (!emu->dataclass)
+		emu->dataclass = strdup("");
+
+	anchor = anchor_slot(emu, emu->dataclass);
+	fast = anchor && *anchor && old_anchor && !strcmp(*anchor, old_anchor);
+	printf("%s session for %s\n", fast ? "fast" : "slow", emu->dataclass);
+
+	reply = new_message("SDMessageSyncDataClassWithDevice", emu->dataclass);
+	plist_add_sub_string_el(reply, anchor && *anchor ? *anchor : "---");
+	plist_add_sub_string_el(reply, emu->next_anchor ? emu->next_anchor : "---");
+	plist_add_sub_string_el(reply, fast ? "SDSyncTypeFast" : "SDSyncTypeSlow");
+	plist_add_sub_uint_el(reply, 106);
+
+	emu->batches = 0;
+	if (!fast && !strcmp(emu->dataclass, "com.apple.Contacts"))
+		emu->batches = contact_gen_count(emu->contacts, emu->batch_size);
+
+	free(old_anchor);
+	return reply;
+}
+
+/* the next batch of the session, or the end of the records */
+static plist_t next_batch(emulator *emu)
+{
+	if (emu->next_batch < emu->batches)
+		return contact_gen_batch(emu->contacts, emu->batch_size, emu->next_batch++);
+	return new_message("SDMessageDeviceReadyToReceiveChanges", emu->dataclass);
+}
+
+static plist_t finish_session(emulator *emu)
+{
+	char **anchor = anchor_slot(emu, emu->dataclass ? emu->dataclass : "");
+
+	//only a finished session moves the anchor
+	if (anchor) {
+		free(*anchor);
+		*anchor = emu->next_anchor;
+		emu->next_anchor = NULL;
+	}
+	return new_message("SDMessageDeviceFinishedSession", emu->dataclass);
+}
+
+/* answers one message, NULL when it needs no answer */
+static plist_t answer(emulator *emu, plist_t message, osync_bool *disconnect)
+{
+	char *name = message_string(message, 0);
+	plist_t reply = NULL;
+
+	if (!name)
+		return NULL;
+
+	if (!strcmp(name, "SDMessageSyncDataClassWithDevice"))
+		reply = start_session(emu, message);
+	else if (!strcmp(name, "SDMessageGetAllRecordsFromDevice") || !strcmp(name, "SDMessageGetChangesFromDevice")) {
+		emu->next_batch = 0;
+		reply = next_batch(emu);
+	}
+	else if (!strcmp(name, "SDMessageAcknowledgeChangesFromDevice"))
+		reply = next_batch(emu);
+	else if (!strcmp(name, "SDMessageProcessChanges")) {
+		reply = new_message("SDMessageRemapRecordIdentifiers", emu->dataclass);
+		plist_add_sub_node(reply, plist_new_dict());
+	}
+	else if (!strcmp(name, "SDMessageFinishSessionOnDevice"))
+		reply = finish_session(emu);
+	else if (!strcmp(name, "DLMessageDisconnect"))
+		*disconnect = TRUE;
+	else if (strcmp(name, "DLMessagePing"))
+		printf("ignoring %s\n", name);
+
+	free(name);
+	return reply;
+}
+
+static void serve(emulator *emu, int fd)
+{
+	plist_t message = NULL;
+	osync_bool disconnect = FALSE;
+
+	while (!disconnect && msync_frame_read(fd, NULL, &message)) {
+		plist_t reply = answer(emu, message, &disconnect);
+		plist_free(message);
+		message = NULL;
+
+		if (!reply)
+			continue;
+		if (emu->delay)
+			usleep(emu->delay * 1000);
+		if (!msync_frame_write(fd, 0, reply))
+			disconnect = TRUE;
+		plist_free(reply);
+	}
+}
+
+typedef struct connection {
+	emulator emu;
+	int fd;
+} connection;
+
+static void *serve_device(void *userdata)
+{
+	connection *conn = (connection *) userdata;
+
+	serve(&conn->emu, conn->fd);
+	close(conn->fd);
+	free_emulator(&conn->emu);
+	free(conn);
+	return NULL;
+}
+
+/* a new device per connection, template only gives the address book size and delay */
+static void serve_concurrently(const emulator *template, int fd)
+{
+	pthread_t thread;
+	connection *conn = calloc(1, sizeof(connection));
+
+	if (!conn) {
+		close(fd);
+		return;
+	}
+	conn->emu.contacts = template->contacts;
+	conn->emu.batch_size = template->batch_size;
+	conn->emu.delay = template->delay;
+	conn->fd = fd;
+
+	if (pthread_create(&thread, NULL, serve_device, conn)) {
+		close(fd);
+		free(conn);
+		return;
+	}
+	pthread_detach(thread);
+}
+
+int main(int argc, char **argv)
+{
+	emulator emu;
+	const char *address = DEFAULT_ADDRESS;
+	osync_bool concurrent = FALSE;
+	osync_bool once = FALSE;
+	int listen_fd = -1;
+	int opt = 0;
+
+	memset(&emu, 0, sizeof(emu));
+	emu.contacts = DEFAULT_CONTACTS;
+	emu.batch_size = DEFAULT_BATCH;
+
+	while (-1 != (opt = getopt(argc, argv, "a:n:b:d:c1"))) {
+		switch (opt) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'n':
+			emu.contacts = atoi(optarg);
+			break;
+		case 'b':
+			emu.batch_size = atoi(optarg);
+			break;
+		case 'd':
+			emu.delay = atoi(optarg);
+			break;
+		case 'c':
+			concurrent = TRUE;
+			break;
+		case '1':
+			once = TRUE;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-a host:port|unix:path] [-n contacts] [-b batch] [-d delay ms] [-c] [-1]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (emu.contacts < 0)
+		emu.contacts = 0;
+	if (emu.batch_size < 1)
+		emu.batch_size = DEFAULT_BATCH;
+
+	if ((listen_fd = listen_on(address)) < 0) {
+		fprintf(stderr, "Unable to listen on %s\n", address);
+		return 1;
+	}
+	printf("serving %d contacts on %s\n", emu.contacts, address);
+	fflush(stdout);
+
+	do {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		if (concurrent && !once) {
+			serve_concurrently(&emu, fd);
+			continue;
+		}
+		serve(&emu, fd);
+		close(fd);
+		fflush(stdout);
+	} while (!once);
+
+	close(listen_fd);
+	free_emulator(&emu);
+	return 0;
+}
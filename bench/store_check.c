@@ -0,0 +1,298 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/*
+ * Record store check.
+ *
+ * Writes a generated dump (see contact_gen.h) to a record store the way a
+ * slow session does, then applies the changes of a fast session that
+ * touch several contacts, each in another way, and checks the contacts
+ * rebuilt from the store:
+ *
+ *   2  renamed, and a new email arrives in a later batch
+ *   3  removed, its attribute records must go as well
+ *   5  only a phone changed, the contact record does not come
+ *   7  only a phone removed
+ *
+ * Usage: iphone-store-check [-n contacts] [-b batch]
+ *
+ * Exits with 1 when a contact is missing, wrong or reported twice.
+ */
+
+#include <opensync/opensync.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <plist/plist.h>
+
+#include "contact_cache.h"
+#include "record_store.h"
+#include "plist_aux.h"
+#include "contact_gen.h"
+
+#define DEFAULT_CONTACTS 1200
+#define DEFAULT_BATCH 500
+#define STORE_VERSION 1
+
+#define ENTITY_KEY "com.apple.syncservices.RecordEntityName"
+#define REMOVED "___EmptyParameterString___"
+
+/* the rebuilt contacts the fast session must give, in any order */
+static const struct expected_contact {
+	const char *uid;
+	int records;
+	const char *phone;
+	const char *phone_value;
+} expected[] = {
+	{ "2", 6, "3/2/0", "+15550000002" },
+	{ "5", 5, "3/5/1", "+15559990005" },
+	{ "7", 4, "3/7/1", "+15560000007" }
+};
+
+#define EXPECTED_COUNT (sizeof(expected) / sizeof(expected[0]))
+
+typedef struct check_state {
+	int seen[EXPECTED_COUNT];
+	int failed;
+} check_state;
+
+static plist_t new_batch(plist_t *records)
+{
+	plist_t batch = plist_new_array();
+	plist_add_sub_string_el(batch, "SDMessageProcessChanges");
+	plist_add_sub_string_el(batch, "com.apple.Contacts");
+	*records = plist_new_dict();
+	plist_add_sub_node(batch, *records);
+	return batch;
+}
+
+static void add_record(plist_t records, const char *id, const char *entity, const char *contact, const char *key, const char *value)
+{
+	plist_t record = plist_new_dict();
+
+	plist_add_sub_key_el(record, ENTITY_KEY);
+	plist_add_sub_string_el(record, entity);
+	if (contact) {
+		plist_t contact_array = plist_new_array();
+		plist_add_sub_key_el(record, "contact");
+		plist_add_sub_string_el(contact_array, contact);
+		plist_add_sub_node(record, contact_array);
+	}
+	plist_add_sub_key_el(record, key);
+	plist_add_sub_string_el(record, value);
+
+	plist_add_sub_key_el(records, id);
+	plist_add_sub_node(records, record);
+}
+
+static void add_removal(plist_t records, const char *id)
+{
+	plist_add_sub_key_el(records, id);
+	plist_add_sub_string_el(records, REMOVED);
+}
+
+/* the fast session, one batch per entity as the device sends them */
+static osync_bool apply_changes(contact_cache *store, record_changes *changes, OSyncError **error)
+{
+	plist_t batches[3];
+	plist_t records = NULL;
+	osync_bool result = TRUE;
+	int i = 0;
+
+	batches[0] = new_batch(&records);
+	add_record(records, "2", "com.apple.contacts.Contact", NULL, "first name", "Renamed2");
+	add_removal(records, "3");
+
+	batches[1] = new_batch(&records);
+	add_record(records, "3/5/1", "com.apple.contacts.Phone Number", "5", "value", "+15559990005");
+	add_removal(records, "3/7/0");
+
+	batches[2] = new_batch(&records);
+	add_record(records, "4/2/1", "com.apple.contacts.Email Address", "2", "value", "second2@example.com");
+
+	for (i = 0; i < 3; i++) {
+		if (result)
+			result = record_store_batch(store, batches[i], changes, error);
+		plist_free(batches[i]);
+	}
+	return result;
+}
+
+static int count_records(plist_t records)
+{
+	plist_t node = NULL;
+	int count = 0;
+
+	for (node = records ? plist_get_first_child(records) : NULL; node; node = plist_get_next_sibling(node))
+		if (PLIST_KEY == plist_get_node_type(node))
+			count++;
+	return count;
+}
+
+static osync_bool check_contact(const char *uid, char *data, unsigned int size, void *userdata, OSyncError **error)
+{
+	check_state *state = (check_state *) userdata;
+	plist_t root = NULL;
+	plist_t message = NULL;
+	plist_t phone = NULL;
+	char *value = NULL;
+	size_t i = 0;
+	int records = 0;
+
+	plist_from_bin(data, size, &root);
+	osync_free(data);
+
+	for (i = 0; i < EXPECTED_COUNT && strcmp(expected[i].uid, uid); i++)
+		;
+	if (i == EXPECTED_COUNT || state->seen[i]++) {
+		fprintf(stderr, "contact %s not expected\n", uid);
+		state->failed = 1;
+		goto exit;
+	}
+
+	for (message = root ? plist_get_first_child(root) : NULL; message; message = plist_get_next_sibling(message)) {
+		records += count_records(message_get_records(message));
+		if (!phone)
+			phone = dict_get_value(message_get_records(message), expected[i].phone);
+	}
+	if (phone)
+		value = dict_get_string(phone, "value");
+
+	if (records != expected[i].records || !value || strcmp(value, expected[i].phone_value)) {
+		fprintf(stderr, "contact %s: %d records, phone %s, expected %d records, phone %s\n",
+		        uid, records, value ? value : "missing", expected[i].records, expected[i].phone_value);
+		state->failed = 1;
+	}
+
+exit:
+	free(value);
+	if (root)
+		plist_free(root);
+	return TRUE;
+}
+
+static osync_bool check_removed(contact_cache *store, const char *id)
+{
+	const char *hash = NULL;
+	const char *blob = NULL;
+	unsigned int size = 0;
+
+	if (!contact_cache_lookup(store, id, 0, &hash, &blob, &size))
+		return TRUE;
+	fprintf(stderr, "record %s still stored\n", id);
+	return FALSE;
+}
+
+int main(int argc, char **argv)
+{
+	int contacts = DEFAULT_CONTACTS;
+	int batch_size = DEFAULT_BATCH;
+	char path[] = "/tmp/iphone-store-check.XXXXXX";
+	contact_cache *store = NULL;
+	record_changes *changes = NULL;
+	check_state state;
+	OSyncError *error = NULL;
+	size_t i = 0;
+	int n = 0;
+	int result = 1;
+	int opt = 0;
+	int fd = -1;
+
+	while (-1 != (opt = getopt(argc, argv, "n:b:"))) {
+		switch (opt) {
+		case 'n':
+			contacts = atoi(optarg);
+			break;
+		case 'b':
+			batch_size = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n contacts] [-b batch]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (batch_size < 1)
+		batch_size = DEFAULT_BATCH;
+	//the changed contacts have to be in the dump
+	if (contacts < 7)
+		contacts = 7;
+
+	//only the name is needed, the store writes the file itself
+	if (-1 == (fd = mkstemp(path))) {
+		perror("mkstemp");
+		return 1;
+	}
+	close(fd);
+	unlink(path);
+	memset(&state, 0, sizeof(state));
+
+	//slow session, batch by batch
+	if (!(store = contact_cache_open(path, STORE_VERSION, &error)))
+		goto error;
+	for (n = 0; n < contact_gen_count(contacts, batch_size); n++) {
+		plist_t batch = contact_gen_batch(contacts, batch_size, n);
+		osync_bool stored = record_store_batch(store, batch, NULL, &error);
+		plist_free(batch);
+		if (!stored)
+			goto error;
+	}
+	contact_cache_close(store);
+
+	//fast session against what the slow one left on disk
+	if (!(store = contact_cache_open(path, STORE_VERSION, &error)))
+		goto error;
+	if (!contact_cache_valid(store)) {
+		fprintf(stderr, "store %s not valid after the slow session\n", path);
+		goto exit;
+	}
+	if (!(changes = record_changes_new(&error))
+	    || !apply_changes(store, changes, &error)
+	    || !record_store_rebuild(store, changes, check_contact, &state, &error))
+		goto error;
+
+	for (i = 0; i < EXPECTED_COUNT; i++) {
+		if (!state.seen[i]) {
+			fprintf(stderr, "contact %s not rebuilt\n", expected[i].uid);
+			state.failed = 1;
+		}
+	}
+	if (!check_removed(store, "3") || !check_removed(store, "3/3/0") || !check_removed(store, "5/3/0") || !check_removed(store, "3/7/0"))
+		state.failed = 1;
+
+	if (!state.failed) {
+		printf("%d contacts, %d changed, store ok\n", contacts, (int) EXPECTED_COUNT + 1);
+		result = 0;
+	}
+	goto exit;
+
+error:
+	fprintf(stderr, "%s\n", osync_error_print(&error));
+	osync_error_unref(&error);
+exit:
+	record_changes_free(changes);
+	contact_cache_close(store);
+	unlink(path);
+	return result;
+}
@@ -0,0 +1,145 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_CHUNK_SIZE (64 * 1024)
+#define ALIGNMENT 16
+
+typedef struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	/* keeps data aligned */
+	long double align;
+} arena_chunk;
+
+struct arena {
+	size_t chunk_size;
+	/* current chunk first */
+	arena_chunk *chunks;
+};
+
+static char *chunk_data(arena_chunk *chunk)
+{
+	return (char *) &chunk->align;
+}
+
+static arena_chunk *add_chunk(arena *arena, size_t size)
+{
+	arena_chunk *chunk = malloc(offsetof(arena_chunk, align) + size);
+	if (!chunk)
+		return NULL;
+
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	return chunk;
+}
+
+arena *arena_new(size_t chunk_size, OSyncError **error)
+{
+	arena *arena = osync_try_malloc0(sizeof(struct arena), error);
+	if (!arena)
+		return NULL;
+
+	arena->chunk_size = chunk_size ? chunk_size : DEFAULT_CHUNK_SIZE;
+	return arena;
+}
+
+void arena_reset(arena *arena)
+{
+	arena_chunk *chunk = NULL;
+
+	if (!arena || !arena->chunks)
+		return;
+
+	//the oldest chunk has the default size, keep that one
+	while ((chunk = arena->chunks)->next) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	if (chunk->size != arena->chunk_size) {
+		free(chunk);
+		arena->chunks = NULL;
+	}
+	else
+		chunk->used = 0;
+}
+
+void arena_free(arena *arena)
+{
+	arena_chunk *chunk = NULL;
+
+	if (!arena)
+		return;
+
+	while ((chunk = arena->chunks)) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	osync_free(arena);
+}
+
+void *arena_alloc(arena *arena, size_t size)
+{
+	arena_chunk *chunk = arena->chunks;
+	void *data = NULL;
+
+	size = (size + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		//big objects get a chunk of their own, behind the current one
+		if (size > arena->chunk_size / 4 && chunk) {
+			arena_chunk *big = malloc(offsetof(arena_chunk, align) + size);
+			if (!big)
+				return NULL;
+			big->size = size;
+			big->used = size;
+			big->next = chunk->next;
+			chunk->next = big;
+			memset(chunk_data(big), 0, size);
+			return chunk_data(big);
+		}
+		if (!(chunk = add_chunk(arena, size > arena->chunk_size ? size : arena->chunk_size)))
+			return NULL;
+	}
+
+	data = chunk_data(chunk) + chunk->used;
+	chunk->used += size;
+	memset(data, 0, size);
+	return data;
+}
+
+char *arena_strdup(arena *arena, const char *str)
+{
+	size_t size = strlen(str) + 1;
+	char *copy = arena_alloc(arena, size);
+
+	if (copy)
+		memcpy(copy, str, size);
+	return copy;
+}
@@ -0,0 +1,54 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/**
+ * @file   arena.h
+ *
+ * @brief  Bump allocator for objects that all die at the same time.
+ *
+ * Memory comes from large chunks and is only given back all at once,
+ * by arena_reset() or arena_free(). Not thread safe.
+ */
+
+#ifndef __ARENA__
+#define __ARENA__
+
+#include <opensync/opensync.h>
+
+#include <stddef.h>
+
+typedef struct arena arena;
+
+/* chunk_size 0 picks the default */
+arena *arena_new(size_t chunk_size, OSyncError **error);
+
+/* releases every allocation, keeps the first chunk for reuse */
+void arena_reset(arena *arena);
+
+void arena_free(arena *arena);
+
+/* zeroed, aligned for any type, NULL when out of memory */
+void *arena_alloc(arena *arena, size_t size);
+
+char *arena_strdup(arena *arena, const char *str);
+
+#endif
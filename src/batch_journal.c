@@ -0,0 +1,227 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+#include "batch_journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libxml/hash.h>
+
+#define JOURNAL_MAGIC "IPBJ"
+#define JOURNAL_FORMAT 1
+
+typedef struct journal_header {
+	char magic[4];
+	uint32_t format;
+	uint64_t version;
+} journal_header;
+
+/* on disk: header, then every batch output behind its record, padded to 8 bytes */
+typedef struct journal_record {
+	uint64_t digest;
+	uint32_t size;
+	uint32_t reserved;
+} journal_record;
+
+typedef struct journal_entry {
+	const char *data;
+	unsigned int size;
+} journal_entry;
+
+struct batch_journal {
+	char *path;
+	FILE *file;
+	/* read-only mapping of what the interrupted session left */
+	char *map;
+	size_t map_size;
+	/* hex digest to entry in the mapping */
+	xmlHashTablePtr entries;
+};
+
+#define PAD8(n) (((n) + 7) & ~((size_t) 7))
+
+static void digest_key(uint64_t digest, char key[17])
+{
+	snprintf(key, 17, "%016" PRIx64, digest);
+}
+
+static void entry_free(void *payload, xmlChar *name)
+{
+	free(payload);
+}
+
+/* indexes the complete records, returns where the last one ends or 0 for an unusable journal */
+static size_t journal_load(batch_journal *journal, uint64_t version)
+{
+	const journal_header *header = (const journal_header *) journal->map;
+	size_t offset = sizeof(journal_header);
+
+	if (journal->map_size < sizeof(journal_header) || memcmp(header->magic, JOURNAL_MAGIC, 4)
+	    || JOURNAL_FORMAT != header->format || version != header->version) {
+		osync_trace(TRACE_INTERNAL, "ignoring outdated journal %s\n", journal->path);
+		return 0;
+	}
+
+	while (offset + sizeof(journal_record) <= journal->map_size) {
+		const journal_record *record = (const journal_record *) (journal->map + offset);
+		size_t size = PAD8(sizeof(journal_record) + record->size);
+		journal_entry *entry = NULL;
+		char key[17];
+
+		//a record cut short by the interruption ends the journal
+		if (offset + size > journal->map_size || !(entry = malloc(sizeof(journal_entry))))
+			break;
+		entry->data = journal->map + offset + sizeof(journal_record);
+		entry->size = record->size;
+
+		digest_key(record->digest, key);
+		xmlHashUpdateEntry(journal->entries, BAD_CAST key, entry, (xmlHashDeallocator) entry_free);
+		offset += size;
+	}
+
+	osync_trace(TRACE_INTERNAL, "resuming %d batches from %s\n", xmlHashSize(journal->entries), journal->path);
+	return offset;
+}
+
+batch_journal *batch_journal_open(const char *path, uint64_t version, OSyncError **error)
+{
+	struct stat st;
+	journal_header header;
+	size_t end = 0;
+	int fd = -1;
+	batch_journal *journal = osync_try_malloc0(sizeof(batch_journal), error);
+	if (!journal)
+		return NULL;
+
+	journal->path = strdup(path);
+	journal->entries = xmlHashCreate(0);
+	if (!journal->path || !journal->entries) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate journal");
+		goto error;
+	}
+
+	if ((fd = open(path, O_RDONLY)) >= 0) {
+		if (!fstat(fd, &st) && st.st_size > 0) {
+			journal->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (MAP_FAILED == journal->map)
+				journal->map = NULL;
+			else {
+				journal->map_size = st.st_size;
+				end = journal_load(journal, version);
+			}
+		}
+		close(fd);
+	}
+
+	//append after the last complete record, or start over
+	if (end) {
+		if (truncate(path, end) || !(journal->file = fopen(path, "ab"))) {
+			osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to reopen journal %s: %s", path, strerror(errno));
+			goto error;
+		}
+		return journal;
+	}
+
+	if (!(journal->file = fopen(path, "wb"))) {
+		osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to create journal %s: %s", path, strerror(errno));
+		goto error;
+	}
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, JOURNAL_MAGIC, 4);
+	header.format = JOURNAL_FORMAT;
+	header.version = version;
+	if (1 != fwrite(&header, sizeof(header), 1, journal->file) || fflush(journal->file)) {
+		osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to write journal %s: %s", path, strerror(errno));
+		goto error;
+	}
+	return journal;
+
+error:
+	batch_journal_close(journal);
+	return NULL;
+}
+
+void batch_journal_close(batch_journal *journal)
+{
+	if (!journal)
+		return;
+
+	if (journal->file)
+		fclose(journal->file);
+	if (journal->entries)
+		xmlHashFree(journal->entries, (xmlHashDeallocator) entry_free);
+	if (journal->map)
+		munmap(journal->map, journal->map_size);
+	free(journal->path);
+	osync_free(journal);
+}
+
+const char *batch_journal_lookup(batch_journal *journal, uint64_t digest, unsigned int *size)
+{
+	journal_entry *entry = NULL;
+	char key[17];
+
+	digest_key(digest, key);
+	if (!(entry = xmlHashLookup(journal->entries, BAD_CAST key)))
+		return NULL;
+	*size = entry->size;
+	return entry->data;
+}
+
+osync_bool batch_journal_append(batch_journal *journal, uint64_t digest, const char *data, unsigned int size, OSyncError **error)
+{
+	static const char padding[8];
+	journal_record record;
+	size_t pad = PAD8(sizeof(record) + size) - sizeof(record) - size;
+
+	memset(&record, 0, sizeof(record));
+	record.digest = digest;
+	record.size = size;
+
+	//flushed right away, the next batch may never come
+	if (1 != fwrite(&record, sizeof(record), 1, journal->file)
+	    || (size && 1 != fwrite(data, size, 1, journal->file))
+	    || (pad && 1 != fwrite(padding, pad, 1, journal->file))
+	    || fflush(journal->file)) {
+		osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to write journal %s: %s", journal->path, strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void batch_journal_discard(batch_journal *journal)
+{
+	if (!journal)
+		return;
+
+	if (unlink(journal->path))
+		osync_trace(TRACE_INTERNAL, "unable to remove journal %s: %s\n", journal->path, strerror(errno));
+	batch_journal_close(journal);
+}
@@ -0,0 +1,58 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/**
+ * @file   batch_journal.h
+ *
+ * @brief  Write-ahead journal of converted batches.
+ *
+ * Every received batch that went through the stylesheet is appended
+ * with the digest of its raw records, and flushed before the next one
+ * is converted. When a session breaks off, the journal stays behind and
+ * the next session takes the output of any batch it receives again from
+ * it instead of converting the batch once more. A successful session
+ * discards the journal. A journal written for another converter version
+ * is ignored.
+ */
+
+#ifndef __BATCH_JOURNAL__
+#define __BATCH_JOURNAL__
+
+#include <opensync/opensync.h>
+
+#include <stdint.h>
+
+typedef struct batch_journal batch_journal;
+
+/* keeps the batches of an interrupted session, new ones are appended */
+batch_journal *batch_journal_open(const char *path, uint64_t version, OSyncError **error);
+void batch_journal_close(batch_journal *journal);
+
+/* converted output of an earlier session, valid until the journal is closed */
+const char *batch_journal_lookup(batch_journal *journal, uint64_t digest, unsigned int *size);
+
+osync_bool batch_journal_append(batch_journal *journal, uint64_t digest, const char *data, unsigned int size, OSyncError **error);
+
+/* the session went through, closes the journal and removes its file */
+void batch_journal_discard(batch_journal *journal);
+
+#endif
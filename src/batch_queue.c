@@ -0,0 +1,127 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+#include "batch_queue.h"
+
+#include <pthread.h>
+
+struct batch_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	/* ring of 'capacity' slots */
+	plist_t *batches;
+	unsigned int capacity;
+	unsigned int head;
+	unsigned int count;
+	osync_bool closed;
+	osync_bool aborted;
+};
+
+batch_queue *batch_queue_new(unsigned int capacity, OSyncError **error)
+{
+	batch_queue *queue = osync_try_malloc0(sizeof(batch_queue), error);
+	if (!queue)
+		return NULL;
+
+	if (!capacity)
+		capacity = 1;
+	if (!(queue->batches = osync_try_malloc0(capacity * sizeof(plist_t), error))) {
+		osync_free(queue);
+		return NULL;
+	}
+	queue->capacity = capacity;
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+	return queue;
+}
+
+void batch_queue_free(batch_queue *queue)
+{
+	if (!queue)
+		return;
+
+	for (; queue->count; queue->count--) {
+		plist_free(queue->batches[queue->head]);
+		queue->head = (queue->head + 1) % queue->capacity;
+	}
+
+	pthread_cond_destroy(&queue->not_full);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_mutex_destroy(&queue->lock);
+	osync_free(queue->batches);
+	osync_free(queue);
+}
+
+osync_bool batch_queue_push(batch_queue *queue, plist_t batch)
+{
+	osync_bool result = FALSE;
+
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == queue->capacity && !queue->aborted)
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+
+	if (!queue->aborted) {
+		queue->batches[(queue->head + queue->count) % queue->capacity] = batch;
+		queue->count++;
+		pthread_cond_signal(&queue->not_empty);
+		result = TRUE;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return result;
+}
+
+plist_t batch_queue_pop(batch_queue *queue)
+{
+	plist_t batch = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	while (!queue->count && !queue->closed && !queue->aborted)
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+	if (queue->count && !queue->aborted) {
+		batch = queue->batches[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return batch;
+}
+
+void batch_queue_close(batch_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->closed = TRUE;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void batch_queue_abort(batch_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->aborted = TRUE;
+	pthread_cond_broadcast(&queue->not_full);
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
@@ -0,0 +1,61 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+/**
+ * @file   batch_queue.h
+ *
+ * @brief  Bounded queue handing received plist batches from the
+ * MobileSync receive thread to the converting thread.
+ *
+ * One producer, one consumer. The producer blocks while the queue is
+ * full, so a slow conversion throttles how far ahead of it the device
+ * link runs.
+ */
+
+#ifndef __BATCH_QUEUE__
+#define __BATCH_QUEUE__
+
+#include <opensync/opensync.h>
+
+#include <plist/plist.h>
+
+typedef struct batch_queue batch_queue;
+
+batch_queue *batch_queue_new(unsigned int capacity, OSyncError **error);
+
+/* frees any batch still queued */
+void batch_queue_free(batch_queue *queue);
+
+/* waits for room, takes ownership of batch unless FALSE is returned
+ * because the consumer aborted
+ */
+osync_bool batch_queue_push(batch_queue *queue, plist_t batch);
+
+/* waits for a batch, NULL once the queue is closed and drained or aborted */
+plist_t batch_queue_pop(batch_queue *queue);
+
+/* producer side: no more batches will come */
+void batch_queue_close(batch_queue *queue);
+
+/* consumer side: stop accepting batches and wake up the producer */
+void batch_queue_abort(batch_queue *queue);
+
+#endif
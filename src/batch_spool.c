@@ -0,0 +1,142 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+#include "batch_spool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+struct batch_spool {
+	FILE *file;
+	char *path;
+};
+
+batch_spool *batch_spool_new(const char *path, OSyncError **error)
+{
+	batch_spool *spool = osync_try_malloc0(sizeof(batch_spool), error);
+	if (!spool)
+		return NULL;
+
+	if (!(spool->path = osync_strdup(path))) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate spool path");
+		goto error;
+	}
+	if (!(spool->file = fopen(path, "w+b"))) {
+		osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to create spool %s: %s", path, strerror(errno));
+		goto error;
+	}
+	return spool;
+
+error:
+	osync_free(spool->path);
+	osync_free(spool);
+	return NULL;
+}
+
+void batch_spool_free(batch_spool *spool)
+{
+	if (!spool)
+		return;
+
+	if (spool->file) {
+		fclose(spool->file);
+		unlink(spool->path);
+	}
+	osync_free(spool->path);
+	osync_free(spool);
+}
+
+osync_bool batch_spool_write(batch_spool *spool, plist_t batch, OSyncError **error)
+{
+	char *bin = NULL;
+	uint32_t length = 0;
+	unsigned char header[4];
+	osync_bool result = FALSE;
+
+	plist_to_bin(batch, &bin, &length);
+	if (!bin) {
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Unable to serialize batch for the spool");
+		return FALSE;
+	}
+
+	header[0] = length >> 24;
+	header[1] = length >> 16;
+	header[2] = length >> 8;
+	header[3] = length;
+
+	if (1 != fwrite(header, sizeof(header), 1, spool->file) || 1 != fwrite(bin, length, 1, spool->file))
+		osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to write spool %s: %s", spool->path, strerror(errno));
+	else
+		result = TRUE;
+
+	free(bin);
+	return result;
+}
+
+osync_bool batch_spool_rewind(batch_spool *spool, OSyncError **error)
+{
+	if (fflush(spool->file) || fseek(spool->file, 0, SEEK_SET)) {
+		osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to rewind spool %s: %s", spool->path, strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+osync_bool batch_spool_read(batch_spool *spool, plist_t *batch, OSyncError **error)
+{
+	unsigned char header[4];
+	uint32_t length = 0;
+	char *bin = NULL;
+
+	*batch = NULL;
+	if (1 != fread(header, sizeof(header), 1, spool->file)) {
+		if (feof(spool->file))
+			return TRUE;
+		goto error;
+	}
+
+	length = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+	if (!(bin = malloc(length))) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to read a %u bytes batch from the spool", length);
+		return FALSE;
+	}
+	if (1 != fread(bin, length, 1, spool->file)) {
+		free(bin);
+		goto error;
+	}
+
+	plist_from_bin(bin, length, batch);
+	free(bin);
+	if (!*batch) {
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Corrupted batch in spool %s", spool->path);
+		return FALSE;
+	}
+	return TRUE;
+
+error:
+	osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to read spool %s", spool->path);
+	return FALSE;
+}
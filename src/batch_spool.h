@@ -0,0 +1,55 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/**
+ * @file   batch_spool.h
+ *
+ * @brief  Received batches parked on disk.
+ *
+ * Batches are appended as binary plists, each behind a 4 byte big
+ * endian length, then read back in the same order. The file is removed
+ * when the spool is freed.
+ */
+
+#ifndef __BATCH_SPOOL__
+#define __BATCH_SPOOL__
+
+#include <opensync/opensync.h>
+
+#include <plist/plist.h>
+
+typedef struct batch_spool batch_spool;
+
+/* creates or truncates the spool file */
+batch_spool *batch_spool_new(const char *path, OSyncError **error);
+void batch_spool_free(batch_spool *spool);
+
+/* appends batch, which stays owned by the caller */
+osync_bool batch_spool_write(batch_spool *spool, plist_t batch, OSyncError **error);
+
+/* done writing, the next read starts with the first batch */
+osync_bool batch_spool_rewind(batch_spool *spool, OSyncError **error);
+
+/* next batch for the caller to free, *batch is NULL once all were read */
+osync_bool batch_spool_read(batch_spool *spool, plist_t *batch, OSyncError **error);
+
+#endif
@@ -0,0 +1,529 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+#include "contact_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libxml/hash.h>
+
+#define CACHE_MAGIC "IPCC"
+#define CACHE_FORMAT 1
+
+typedef struct cache_header {
+	char magic[4];
+	uint32_t format;
+	uint64_t version;
+} cache_header;
+
+/* on disk: header, then id, hash and blob with their terminating NULs,
+ * padded to 8 bytes. A zero hash_len removes the id.
+ */
+typedef struct cache_record {
+	uint32_t id_len;
+	uint32_t hash_len;
+	uint32_t blob_len;
+	uint32_t reserved;
+	uint64_t digest;
+} cache_record;
+
+typedef struct cache_entry {
+	uint64_t digest;
+	const char *hash;
+	const char *blob;
+	unsigned int size;
+	/* entries not written yet own their strings */
+	char *data;
+	osync_bool removed;
+} cache_entry;
+
+/* records appended by contact_cache_flush(), mapped on their own */
+typedef struct cache_region {
+	char *map;
+	size_t size;
+	struct cache_region *next;
+} cache_region;
+
+struct contact_cache {
+	char *path;
+	uint64_t version;
+	/* read-only mapping of the file as it was opened */
+	char *map;
+	size_t map_size;
+	cache_region *regions;
+	/* bytes of the file the entries were loaded from, and those still referenced by live entries */
+	size_t file_size;
+	size_t live_size;
+	osync_bool valid;
+	xmlHashTablePtr entries;
+	/* ids changed since the file was mapped */
+	xmlHashTablePtr dirty;
+};
+
+#define PAD8(n) (((n) + 7) & ~((size_t) 7))
+
+uint64_t contact_cache_digest(const void *data, size_t size, uint64_t seed)
+{
+	const unsigned char *bytes = (const unsigned char *) data;
+	size_t i = 0;
+
+	for (i = 0; i < size; i++) {
+		seed ^= bytes[i];
+		seed *= 1099511628211ULL;
+	}
+	return seed;
+}
+
+static size_t record_size(const cache_record *record)
+{
+	return PAD8(sizeof(cache_record) + record->id_len + record->hash_len + record->blob_len);
+}
+
+static void entry_free(void *payload, xmlChar *name)
+{
+	cache_entry *entry = (cache_entry *) payload;
+	if (!entry)
+		return;
+	free(entry->data);
+	free(entry);
+}
+
+/* a replaced or removed id no longer keeps its mapped record alive */
+static void forget_mapped(contact_cache *cache, const char *id)
+{
+	cache_entry *old = xmlHashLookup(cache->entries, BAD_CAST id);
+	if (old && !old->data && !old->removed)
+		cache->live_size -= PAD8(sizeof(cache_record) + strlen(id) + 1
+					 + strlen(old->hash) + 1 + old->size + 1);
+}
+
+/* the first NUL of a string is its last byte, as write_record() leaves it */
+static osync_bool ends_string(const char *str, uint32_t len)
+{
+	return memchr(str, '\0', len) == str + len - 1;
+}
+
+/* the lookups and the size accounting of forget_mapped() rely on the strings of a record */
+static osync_bool record_sane(const cache_record *record, const char *id)
+{
+	const char *hash = id + record->id_len;
+
+	if (!ends_string(id, record->id_len))
+		return FALSE;
+	//removals carry neither hash nor blob
+	if (!record->hash_len)
+		return !record->blob_len;
+	return record->blob_len && ends_string(hash, record->hash_len) && !hash[record->hash_len + record->blob_len - 1];
+}
+
+/*
+ * Takes the records of data, found at start in the file, up to the first
+ * truncated or corrupt one. Returns how many bytes of data they span.
+ */
+static size_t load_records(contact_cache *cache, const char *data, size_t start, size_t size)
+{
+	size_t offset = 0;
+
+	while (offset + sizeof(cache_record) <= size) {
+		const cache_record *record = (const cache_record *) (data + offset);
+		const char *id = data + offset + sizeof(cache_record);
+		cache_entry *entry = NULL;
+
+		if (!record->id_len || offset + record_size(record) > size)
+			break;
+		if (!record_sane(record, id)) {
+			osync_trace(TRACE_INTERNAL, "corrupt record at %zu in contact cache %s\n", start + offset, cache->path);
+			break;
+		}
+
+		forget_mapped(cache, id);
+		if (!record->hash_len) {
+			xmlHashRemoveEntry(cache->entries, BAD_CAST id, (xmlHashDeallocator) entry_free);
+			offset += record_size(record);
+			continue;
+		}
+
+		if (!(entry = calloc(1, sizeof(cache_entry))))
+			break;
+		entry->digest = record->digest;
+		entry->hash = id + record->id_len;
+		entry->blob = entry->hash + record->hash_len;
+		entry->size = record->blob_len - 1;
+		xmlHashUpdateEntry(cache->entries, BAD_CAST id, entry, (xmlHashDeallocator) entry_free);
+
+		cache->live_size += record_size(record);
+		offset += record_size(record);
+	}
+	return offset;
+}
+
+/*
+ * A cache that does not end cleanly is not valid: it is rewritten on save
+ * rather than appended to, and the record store does not trust it for a
+ * fast sync.
+ */
+static void cache_load(contact_cache *cache)
+{
+	const cache_header *header = (const cache_header *) cache->map;
+	size_t size = cache->map_size - sizeof(cache_header);
+
+	cache->file_size = cache->map_size;
+	if (cache->map_size < sizeof(cache_header) || memcmp(header->magic, CACHE_MAGIC, 4)
+	    || CACHE_FORMAT != header->format || cache->version != header->version) {
+		osync_trace(TRACE_INTERNAL, "ignoring outdated contact cache %s\n", cache->path);
+		return;
+	}
+	cache->valid = size == load_records(cache, cache->map + sizeof(cache_header), sizeof(cache_header), size);
+}
+
+static void cache_map(contact_cache *cache)
+{
+	struct stat st;
+	int fd = -1;
+
+	if ((fd = open(cache->path, O_RDONLY)) < 0)
+		return;
+
+	if (!fstat(fd, &st) && st.st_size > 0) {
+		cache->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (MAP_FAILED == cache->map)
+			cache->map = NULL;
+		else {
+			cache->map_size = st.st_size;
+			cache_load(cache);
+		}
+	}
+	close(fd);
+}
+
+static void cache_unmap(contact_cache *cache)
+{
+	cache_region *region = NULL;
+
+	while ((region = cache->regions)) {
+		cache->regions = region->next;
+		munmap(region->map, region->size);
+		free(region);
+	}
+	if (cache->map)
+		munmap(cache->map, cache->map_size);
+	cache->map = NULL;
+	cache->map_size = 0;
+	cache->file_size = 0;
+	cache->live_size = 0;
+}
+
+contact_cache *contact_cache_open(const char *path, uint64_t version, OSyncError **error)
+{
+	contact_cache *cache = osync_try_malloc0(sizeof(contact_cache), error);
+	if (!cache)
+		return NULL;
+
+	cache->version = version;
+	cache->path = strdup(path);
+	cache->entries = xmlHashCreate(0);
+	cache->dirty = xmlHashCreate(0);
+	if (!cache->path || !cache->entries || !cache->dirty) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate contact cache");
+		contact_cache_close(cache);
+		return NULL;
+	}
+
+	cache_map(cache);
+	return cache;
+}
+
+void contact_cache_close(contact_cache *cache)
+{
+	if (!cache)
+		return;
+
+	if (cache->dirty)
+		xmlHashFree(cache->dirty, NULL);
+	if (cache->entries)
+		xmlHashFree(cache->entries, (xmlHashDeallocator) entry_free);
+	cache_unmap(cache);
+	free(cache->path);
+	osync_free(cache);
+}
+
+osync_bool contact_cache_valid(contact_cache *cache)
+{
+	return cache->valid;
+}
+
+osync_bool contact_cache_lookup(contact_cache *cache, const char *id, uint64_t digest, const char **hash, const char **blob, unsigned int *size)
+{
+	cache_entry *entry = xmlHashLookup(cache->entries, BAD_CAST id);
+	if (!entry || entry->removed || entry->digest != digest)
+		return FALSE;
+
+	*hash = entry->hash;
+	*blob = entry->blob;
+	*size = entry->size;
+	return TRUE;
+}
+
+static osync_bool cache_add(contact_cache *cache, const char *id, uint64_t digest, const char *hash, const char *blob, unsigned int size, OSyncError **error)
+{
+	size_t hash_len = hash ? strlen(hash) + 1 : 0;
+	cache_entry *entry = NULL;
+
+	if (!(entry = osync_try_malloc0(sizeof(cache_entry), error)))
+		return FALSE;
+
+	if (hash) {
+		if (!(entry->data = malloc(hash_len + size + 1))) {
+			osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to store contact %s", id);
+			free(entry);
+			return FALSE;
+		}
+		memcpy(entry->data, hash, hash_len);
+		memcpy(entry->data + hash_len, blob, size);
+		entry->data[hash_len + size] = '\0';
+		entry->hash = entry->data;
+		entry->blob = entry->data + hash_len;
+	}
+	else
+		entry->removed = TRUE;
+	entry->digest = digest;
+	entry->size = size;
+
+	forget_mapped(cache, id);
+	if (xmlHashUpdateEntry(cache->entries, BAD_CAST id, entry, (xmlHashDeallocator) entry_free)
+	    || xmlHashUpdateEntry(cache->dirty, BAD_CAST id, cache, NULL)) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to store contact %s", id);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+osync_bool contact_cache_store(contact_cache *cache, const char *id, uint64_t digest, const char *hash, const char *blob, unsigned int size, OSyncError **error)
+{
+	return cache_add(cache, id, digest, hash, blob, size, error);
+}
+
+void contact_cache_remove(contact_cache *cache, const char *id)
+{
+	if (xmlHashLookup(cache->entries, BAD_CAST id))
+		cache_add(cache, id, 0, NULL, NULL, 0, NULL);
+}
+
+static osync_bool write_record(FILE *file, const char *id, cache_entry *entry)
+{
+	static const char padding[8];
+	cache_record record;
+
+	memset(&record, 0, sizeof(cache_record));
+	record.id_len = strlen(id) + 1;
+	record.digest = entry->digest;
+	if (!entry->removed) {
+		record.hash_len = strlen(entry->hash) + 1;
+		record.blob_len = entry->size + 1;
+	}
+
+	if (1 != fwrite(&record, sizeof(cache_record), 1, file)
+	    || 1 != fwrite(id, record.id_len, 1, file))
+		return FALSE;
+	if (!entry->removed
+	    && (1 != fwrite(entry->hash, record.hash_len, 1, file)
+		|| 1 != fwrite(entry->blob, record.blob_len, 1, file)))
+		return FALSE;
+
+	size_t pad = record_size(&record) - (sizeof(cache_record) + record.id_len + record.hash_len + record.blob_len);
+	return !pad || 1 == fwrite(padding, pad, 1, file);
+}
+
+typedef struct save_state {
+	contact_cache *cache;
+	FILE *file;
+	osync_bool failed;
+} save_state;
+
+/* compaction: every live entry */
+static void save_entry(void *payload, void *data, xmlChar *name)
+{
+	cache_entry *entry = (cache_entry *) payload;
+	save_state *state = (save_state *) data;
+
+	if (!state->failed && !entry->removed)
+		state->failed = !write_record(state->file, (const char *) name, entry);
+}
+
+/* append: the latest state of every changed id, removals included */
+static void save_dirty(void *payload, void *data, xmlChar *name)
+{
+	save_state *state = (save_state *) data;
+	cache_entry *entry = xmlHashLookup(state->cache->entries, name);
+
+	if (!state->failed && entry)
+		state->failed = !write_record(state->file, (const char *) name, entry);
+}
+
+/* compact tells whether the file was rewritten rather than appended to */
+static osync_bool cache_write(contact_cache *cache, osync_bool *compact, OSyncError **error)
+{
+	cache_header header;
+	save_state state = { cache, NULL, FALSE };
+	char *tmp_path = NULL;
+
+	*compact = !cache->valid || cache->live_size * 2 < cache->file_size;
+	if (!xmlHashSize(cache->dirty) && !*compact)
+		return TRUE;
+
+	if (*compact) {
+		//written next to the old file, which stays mapped until closed
+		if (!(tmp_path = osync_strdup_printf("%s.tmp", cache->path)))
+			goto error;
+		if (!(state.file = fopen(tmp_path, "wb")))
+			goto error;
+
+		memset(&header, 0, sizeof(cache_header));
+		memcpy(header.magic, CACHE_MAGIC, 4);
+		header.format = CACHE_FORMAT;
+		header.version = cache->version;
+		if (1 != fwrite(&header, sizeof(cache_header), 1, state.file))
+			goto error;
+		xmlHashScan(cache->entries, (xmlHashScanner) save_entry, &state);
+	}
+	else {
+		if (!(state.file = fopen(cache->path, "ab")))
+			goto error;
+		xmlHashScan(cache->dirty, (xmlHashScanner) save_dirty, &state);
+	}
+
+	if (fclose(state.file) || state.failed) {
+		state.file = NULL;
+		goto error;
+	}
+	state.file = NULL;
+
+	if (tmp_path && rename(tmp_path, cache->path))
+		goto error;
+	osync_free(tmp_path);
+
+	xmlHashFree(cache->dirty, NULL);
+	cache->dirty = xmlHashCreate(0);
+	cache->valid = TRUE;
+	return TRUE;
+
+error:
+	osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to write contact cache %s: %s", cache->path, strerror(errno));
+	if (state.file)
+		fclose(state.file);
+	if (tmp_path) {
+		unlink(tmp_path);
+		osync_free(tmp_path);
+	}
+	return FALSE;
+}
+
+osync_bool contact_cache_save(contact_cache *cache, OSyncError **error)
+{
+	osync_bool compact = FALSE;
+
+	return cache_write(cache, &compact, error);
+}
+
+/* maps what was appended past start, the entries written there then point into it */
+static void map_region(contact_cache *cache, size_t start)
+{
+	size_t base = start - start % sysconf(_SC_PAGESIZE);
+	cache_region *region = NULL;
+	struct stat st;
+	int fd = -1;
+
+	if ((fd = open(cache->path, O_RDONLY)) < 0 || fstat(fd, &st) || (size_t) st.st_size <= start)
+		goto exit;
+
+	//entries that can not be mapped keep their own copy
+	if (!(region = calloc(1, sizeof(cache_region)))
+	    || MAP_FAILED == (region->map = mmap(NULL, st.st_size - base, PROT_READ, MAP_PRIVATE, fd, base))) {
+		osync_trace(TRACE_INTERNAL, "unable to map %s past %zu\n", cache->path, start);
+		free(region);
+		cache->file_size = st.st_size;
+		goto exit;
+	}
+	region->size = st.st_size - base;
+	region->next = cache->regions;
+	cache->regions = region;
+
+	if (load_records(cache, region->map + start - base, start, st.st_size - start) != (size_t) st.st_size - start)
+		cache->valid = FALSE;
+	cache->file_size = st.st_size;
+
+exit:
+	if (fd >= 0)
+		close(fd);
+}
+
+osync_bool contact_cache_flush(contact_cache *cache, OSyncError **error)
+{
+	size_t start = cache->file_size;
+	osync_bool compact = FALSE;
+
+	if (!cache_write(cache, &compact, error))
+		return FALSE;
+
+	if (!compact) {
+		map_region(cache, start);
+		return TRUE;
+	}
+
+	//a rewritten file is loaded over
+	xmlHashFree(cache->entries, (xmlHashDeallocator) entry_free);
+	cache_unmap(cache);
+	if (!(cache->entries = xmlHashCreate(0))) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate contact cache");
+		return FALSE;
+	}
+	cache->valid = FALSE;
+	cache_map(cache);
+	return TRUE;
+}
+
+typedef struct scan_state {
+	contact_cache_scan_func func;
+	void *userdata;
+} scan_state;
+
+static void scan_entry(void *payload, void *data, xmlChar *name)
+{
+	cache_entry *entry = (cache_entry *) payload;
+	scan_state *state = (scan_state *) data;
+
+	if (!entry->removed)
+		state->func((const char *) name, entry->hash, entry->blob, entry->size, state->userdata);
+}
+
+void contact_cache_scan(contact_cache *cache, contact_cache_scan_func func, void *userdata)
+{
+	scan_state state = { func, userdata };
+
+	xmlHashScan(cache->entries, (xmlHashScanner) scan_entry, &state);
+}
@@ -0,0 +1,79 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+/**
+ * @file   contact_cache.h
+ *
+ * @brief  Persistent cache of converted contacts.
+ *
+ * Maps a device record id and the digest of the raw records the contact
+ * was built from to its sorted xmlformat and hash, so an unchanged
+ * contact does not go through the stylesheet again. The file is mapped
+ * read-only when opened, new entries are appended when saved and the
+ * file is rewritten once most of it is stale. A cache written for
+ * another converter version is ignored.
+ *
+ * The record store of fast sessions uses the same file, keyed by device
+ * record id, and flushes as it goes so it never holds the records of a
+ * whole address book in memory.
+ */
+
+#ifndef __CONTACT_CACHE__
+#define __CONTACT_CACHE__
+
+#include <opensync/opensync.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct contact_cache contact_cache;
+
+#define CONTACT_CACHE_SEED 14695981039346656037ULL
+
+/* FNV-1a, chain calls by passing the previous result as seed */
+uint64_t contact_cache_digest(const void *data, size_t size, uint64_t seed);
+
+/* a missing, damaged or outdated file gives an empty cache */
+contact_cache *contact_cache_open(const char *path, uint64_t version, OSyncError **error);
+void contact_cache_close(contact_cache *cache);
+
+/* whether the file held a current cache when opened */
+osync_bool contact_cache_valid(contact_cache *cache);
+
+/* pointers stay valid until the cache is flushed, saved or closed */
+osync_bool contact_cache_lookup(contact_cache *cache, const char *id, uint64_t digest, const char **hash, const char **blob, unsigned int *size);
+
+osync_bool contact_cache_store(contact_cache *cache, const char *id, uint64_t digest, const char *hash, const char *blob, unsigned int size, OSyncError **error);
+void contact_cache_remove(contact_cache *cache, const char *id);
+
+/* writes pending entries, compacting the file when needed */
+osync_bool contact_cache_save(contact_cache *cache, OSyncError **error);
+
+/* saves, then maps what was written so the entries no longer own a copy */
+osync_bool contact_cache_flush(contact_cache *cache, OSyncError **error);
+
+/* called once per entry, the pointers are those of contact_cache_lookup() */
+typedef void (*contact_cache_scan_func)(const char *id, const char *hash, const char *blob, unsigned int size, void *userdata);
+
+/* the entries must not be changed until it returns */
+void contact_cache_scan(contact_cache *cache, contact_cache_scan_func func, void *userdata);
+
+#endif
@@ -0,0 +1,217 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+#include "device_link.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* port of the MobileSync device link */
+#define MSYNC_DEVICE_PORT 3458
+
+typedef struct held_link {
+	device_link *link;
+	struct held_link *next;
+} held_link;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static held_link *pool = NULL;
+static int pool_refs = 0;
+
+/* With several devices attached, a link must say which one it is for */
+static osync_bool check_single_device(OSyncError **error)
+{
+	char **devices = NULL;
+	int count = 0;
+	int i = 0;
+
+	if (IPHONE_E_SUCCESS != iphone_get_device_list(&devices, &count) || !devices)
+		return TRUE;
+
+	if (count > 1) {
+		osync_error_set(error, OSYNC_ERROR_NO_CONNECTION, "%d devices attached, set device_uuid to one of them", count);
+		for (i = 0; i < count; i++)
+			osync_trace(TRACE_INTERNAL, "attached device %s\n", devices[i]);
+	}
+	iphone_device_list_free(devices);
+	return count <= 1;
+}
+
+osync_bool device_link_start_service(device_link *link, iphone_msync_client_t *msync, OSyncError **error)
+{
+	int port = 0;
+
+	*msync = NULL;
+	if (IPHONE_E_SUCCESS != iphone_lckd_start_service(link->lckd, "com.apple.mobilesync", &port) || !port
+	    || IPHONE_E_SUCCESS != iphone_msync_new_client(link->device, MSYNC_DEVICE_PORT, port, msync) || !*msync) {
+		osync_error_set(error, OSYNC_ERROR_NO_CONNECTION, "Failed to start MobileSync service");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+device_link *device_link_open(const char *uuid, OSyncError **error)
+{
+	char *uid = NULL;
+	device_link *link = NULL;
+
+	if (!uuid && !check_single_device(error))
+		return NULL;
+	if (!(link = osync_try_malloc0(sizeof(device_link), error)))
+		return NULL;
+
+	if (uuid) {
+		if (IPHONE_E_SUCCESS != iphone_get_device_by_uuid(&link->device, uuid) || !link->device)
+			goto error;
+	}
+	else if (IPHONE_E_SUCCESS != iphone_get_device(&link->device) || !link->device)
+		goto error;
+	if (IPHONE_E_SUCCESS != iphone_lckd_new_client(link->device, &link->lckd) || !link->lckd)
+		goto error;
+	if (!device_link_start_service(link, &link->msync, error)) {
+		device_link_close(link);
+		return NULL;
+	}
+
+	//only used to find the link again, a device without one is never held
+	if (IPHONE_E_SUCCESS == iphone_lckd_get_device_uid(link->lckd, &uid) && uid) {
+		link->uuid = osync_strdup(uid);
+		free(uid);
+	}
+	osync_trace(TRACE_INTERNAL, "connected to device %s\n", link->uuid ? link->uuid : "(unknown)");
+	return link;
+
+error:
+	osync_error_set(error, OSYNC_ERROR_NO_CONNECTION, "Failed to start MobileSync service");
+	device_link_close(link);
+	return NULL;
+}
+
+void device_link_close(device_link *link)
+{
+	if (!link)
+		return;
+
+	if (link->msync)
+		iphone_msync_free_client(link->msync);
+	if (link->lckd)
+		iphone_lckd_free_client(link->lckd);
+	if (link->device)
+		iphone_free_device(link->device);
+	osync_free(link->uuid);
+	osync_free(link);
+}
+
+osync_bool device_link_alive(device_link *link)
+{
+	char *uuid = NULL;
+	osync_bool alive = FALSE;
+
+	if (IPHONE_E_SUCCESS == iphone_lckd_get_device_uid(link->lckd, &uuid) && uuid)
+		alive = link->uuid && !strcmp(uuid, link->uuid);
+	free(uuid);
+	return alive;
+}
+
+void device_link_pool_ref(void)
+{
+	pthread_mutex_lock(&pool_lock);
+	pool_refs++;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void device_link_pool_unref(void)
+{
+	held_link *held = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if (--pool_refs <= 0) {
+		pool_refs = 0;
+		held = pool;
+		pool = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	while (held) {
+		held_link *next = held->next;
+		device_link_close(held->link);
+		osync_free(held);
+		held = next;
+	}
+}
+
+void device_link_hold(device_link *link)
+{
+	held_link *held = NULL;
+	device_link *replaced = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if (!link->uuid || !pool_refs)
+		goto close;
+
+	for (held = pool; held; held = held->next)
+		if (!strcmp(held->link->uuid, link->uuid))
+			break;
+
+	if (held) {
+		replaced = held->link;
+		held->link = link;
+	}
+	else if ((held = osync_try_malloc0(sizeof(held_link), NULL))) {
+		held->link = link;
+		held->next = pool;
+		pool = held;
+	}
+	else
+		goto close;
+	pthread_mutex_unlock(&pool_lock);
+
+	device_link_close(replaced);
+	return;
+
+close:
+	pthread_mutex_unlock(&pool_lock);
+	device_link_close(link);
+}
+
+device_link *device_link_take(const char *uuid)
+{
+	held_link **prev = NULL;
+	held_link *held = NULL;
+	device_link *link = NULL;
+
+	if (!uuid)
+		return NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	for (prev = &pool; (held = *prev); prev = &held->next) {
+		if (!strcmp(held->link->uuid, uuid)) {
+			*prev = held->next;
+			link = held->link;
+			osync_free(held);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return link;
+}
@@ -0,0 +1,72 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/**
+ * @file   device_link.h
+ *
+ * @brief  Lockdown and MobileSync connection to a device.
+ *
+ * Opening a link costs the whole lockdown handshake, its TLS session
+ * and the start of the MobileSync service. In keep-alive mode a link is
+ * held once the sync is over and taken back by the next sync of the
+ * same device, keyed by the device UUID. Held links are shared by every
+ * plugin instance of the process.
+ *
+ * The link starts one MobileSync service connection of its own, more
+ * can be started over its lockdown session.
+ */
+
+#ifndef __DEVICE_LINK__
+#define __DEVICE_LINK__
+
+#include <opensync/opensync.h>
+
+#include <libiphone/libiphone.h>
+
+typedef struct device_link {
+	char *uuid;
+	iphone_device_t device;
+	iphone_lckd_client_t lckd;
+	iphone_msync_client_t msync;
+} device_link;
+
+/* connects to the device with that uuid, or to the only one attached if NULL, and starts MobileSync on it */
+device_link *device_link_open(const char *uuid, OSyncError **error);
+void device_link_close(device_link *link);
+
+/* one more MobileSync service connection over the link, for the caller to free */
+osync_bool device_link_start_service(device_link *link, iphone_msync_client_t *msync, OSyncError **error);
+
+/* lockdown round trip, fails once the device went away or was swapped */
+osync_bool device_link_alive(device_link *link);
+
+/* held links live while at least one reference to the pool is kept */
+void device_link_pool_ref(void);
+void device_link_pool_unref(void);
+
+/* keeps link for a later sync of the same device, a link already held for it is closed */
+void device_link_hold(device_link *link);
+
+/* the link held for uuid, or NULL. It is no longer held. */
+device_link *device_link_take(const char *uuid);
+
+#endif
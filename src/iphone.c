@@ -29,32 +29,148 @@
 #include <opensync/opensync-version.h>
 #include <opensync/opensync-time.h>
 
+#include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include <libiphone/libiphone.h>
 #include <plist/plist.h>
 
 #include <libxml/tree.h>
 #include <libxml/xpath.h>
+#include <libxml/hash.h>
 
 #include "xslt_aux.h"
+#include "pcont_conv.h"
+#include "pcont_raw.h"
+#include "pcont_commit.h"
+#include "pcal_conv.h"
+#include "plist_aux.h"
+#include "batch_queue.h"
+#include "contact_cache.h"
+#include "record_store.h"
+#include "msync_transport.h"
+#include "sync_stats.h"
+#include "arena.h"
+#include "batch_spool.h"
+#include "batch_journal.h"
+#include "device_link.h"
+
+/* received batches the receive thread may get ahead of conversion */
+#define RECEIVE_QUEUE_SIZE 4
+
+/* upper bound for the "workers" option */
+#define MAX_WORKERS 64
+
+/* changes sent per SDMessageProcessChanges unless "commit_batch" says otherwise */
+#define DEFAULT_COMMIT_BATCH 500
+
+/* bump whenever the C side of the contact conversion changes its output */
+#define CONTACT_CACHE_CONVERTER "pcont2osync-2"
+#define RECORD_STORE_VERSION 2
+
+#define EMPTY_PARAMETER_STRING "___EmptyParameterString___"
+
+/* a committed change waiting to be sent to the device */
+typedef struct contact_commit {
+	OSyncChange *change;
+	OSyncContext *ctx;
+	struct contact_commit *next;
+} contact_commit;
+
+/* a MobileSync connection and the dataclass session running on it */
+typedef struct msync_channel {
+	msync_transport *transport;
+	/* the device link's service connection, or one started for this channel alone */
+	iphone_msync_client_t msync;
+	osync_bool own_msync;
+	/* msync was held since the last sync */
+	osync_bool reused;
+	/* device session left open for write back */
+	osync_bool session_open;
+	const char *session_dataclass;
+	/* anchors of the session, stored by sync_done() */
+	char *next_anchor;
+	/* get_changes() running on its own thread */
+	pthread_t worker;
+	osync_bool worker_started;
+} msync_channel;
 
 typedef struct iphone_env {
-	/* device and service link */
-	iphone_device_t device;
-	iphone_lckd_client_t lckd;
-	iphone_msync_client_t msync;
+	/* device link, shared by the sinks connected */
+	device_link *link;
+	int connected_sinks;
+	/* device the plugin is bound to, the only one attached when unset */
+	char *device_uuid;
+	/* keep the link between syncs, link_uuid tells which one to take back */
+	osync_bool keep_alive;
+	char *link_uuid;
+	osync_bool link_reused;
+	osync_bool link_idle;
+	osync_bool sync_completed;
+	/* one channel per sink, both dataclasses may run at once */
+	msync_channel contact_channel;
+	msync_channel calendar_channel;
+	osync_bool parallel;
+	/* held around every call into the hashtables and the engine's contexts, which are not thread safe */
+	pthread_mutex_t report_lock;
+	/* what messages go through: the device, an emulator or a replay */
+	char *emulator;
+	char *replay_path;
+	char *capture_path;
+	int link_latency;
 	/* calendar sink/format */
 	OSyncObjTypeSink *calendar_sink;
 	OSyncObjFormat *calendar_format;
 	/* contact sink/format */
 	OSyncObjTypeSink *contact_sink;
 	OSyncObjFormat *contact_format;
-	/* xslt helper*/
+	/* contacts reported as received, converted by the engine when needed */
+	OSyncObjFormat *raw_format;
+	/* xslt helper, native converter and serializer when unset */
 	char *xslt_path;
 	struct xslt_resources *xslt_ctx_pcal;
 	struct xslt_resources *xslt_ctx_pcont;
+	struct xslt_resources *xslt_ctx_pcont_commit;
+	/* convert each received batch instead of the whole dump */
+	osync_bool streaming;
+	/* receive batches on a separate thread while converting */
+	osync_bool receive_thread;
+	/* threads converting transformed contacts */
+	int workers;
+	/* committed changes, sent commit_batch at a time */
+	contact_commit *commits_first;
+	contact_commit *commits_last;
+	int commit_batch;
+	/* the whole dump spills to spool_path past memory_limit bytes, 0 for no limit */
+	size_t memory_limit;
+	char *spool_path;
+	/* batches converted by a slow sync, kept until it completes */
+	char *journal_path;
+	batch_journal *contact_journal;
+	/* contacts that fail to convert are set aside there instead of failing the sink */
+	char *quarantine_path;
+	FILE *quarantine;
+	/* raw records of the device as of the last sync, fast sessions are applied to them */
+	char *store_path;
+	/* where a slow session writes its store, moved to store_path by sync_done() */
+	char *store_new_path;
+	osync_bool store_is_new;
+	contact_cache *record_store;
+	/* converted contacts kept across syncs */
+	osync_bool record_cache;
+	char *cache_path;
+	uint64_t cache_version;
+	contact_cache *contact_cache;
+	/* counters and timings, written to stats_path after each sync */
+	sync_stats *stats;
+	char *stats_path;
+	osync_bool stats_written;
+	/* small objects of one sync, released at sync_done() or disconnect() */
+	arena *arena;
 } iphone_env;
 
 typedef enum {
@@ -62,6 +178,28 @@ typedef enum {
 	FAST_SYNC,
 } session_type;
 
+/* contacts converted batch by batch, waiting for their attribute records */
+typedef struct contact_stream {
+	xmlDocPtr doc;
+	xmlHashTablePtr pending;
+} contact_stream;
+
+/* the commit itself lives in the session arena */
+static void contact_commit_release(contact_commit *commit)
+{
+	osync_change_unref(commit->change);
+	osync_context_unref(commit->ctx);
+}
+
+static void close_quarantine(iphone_env *env)
+{
+	if (!env->quarantine)
+		return;
+	fputs("</quarantine>\n", env->quarantine);
+	fclose(env->quarantine);
+	env->quarantine = NULL;
+}
+
 static void free_env(iphone_env *env)
 {
 	if (env) {
@@ -69,66 +207,258 @@ static void free_env(iphone_env *env)
 			osync_objtype_sink_unref(env->contact_sink);
 		if (env->contact_format)
 			osync_objformat_unref(env->contact_format);
+		if (env->raw_format)
+			osync_objformat_unref(env->raw_format);
 		if (env->calendar_sink)
 			osync_objtype_sink_unref(env->calendar_sink);
 		if (env->calendar_format)
 			osync_objformat_unref(env->calendar_format);
 		if (env->xslt_path)
 			free(env->xslt_path);
+		if (env->cache_path)
+			osync_free(env->cache_path);
+		if (env->store_path)
+			osync_free(env->store_path);
+		if (env->store_new_path)
+			osync_free(env->store_new_path);
+		if (env->spool_path)
+			osync_free(env->spool_path);
+		if (env->journal_path)
+			osync_free(env->journal_path);
+		if (env->quarantine_path)
+			osync_free(env->quarantine_path);
+		close_quarantine(env);
+		if (env->device_uuid)
+			osync_free(env->device_uuid);
+		if (env->link_uuid)
+			osync_free(env->link_uuid);
+		if (env->keep_alive)
+			device_link_pool_unref();
+		if (env->emulator)
+			osync_free(env->emulator);
+		if (env->replay_path)
+			osync_free(env->replay_path);
+		if (env->capture_path)
+			osync_free(env->capture_path);
+		if (env->stats_path)
+			osync_free(env->stats_path);
+		sync_stats_free(env->stats);
+		contact_cache_close(env->contact_cache);
+		contact_cache_close(env->record_store);
+		batch_journal_close(env->contact_journal);
 		if (env->xslt_ctx_pcal)
 			xslt_delete(env->xslt_ctx_pcal);
 		if (env->xslt_ctx_pcont)
 			xslt_delete(env->xslt_ctx_pcont);
+		if (env->xslt_ctx_pcont_commit)
+			xslt_delete(env->xslt_ctx_pcont_commit);
+		while (env->commits_first) {
+			contact_commit *next = env->commits_first->next;
+			contact_commit_release(env->commits_first);
+			env->commits_first = next;
+		}
+		arena_free(env->arena);
+		pthread_mutex_destroy(&env->report_lock);
 
 		osync_free(env);
 	}
 }
 
+static uint64_t digest_file(const char *path, uint64_t digest)
+{
+	char buffer[4096];
+	size_t size = 0;
+	FILE *file = fopen(path, "rb");
+
+	if (!file)
+		return digest;
+	while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		digest = contact_cache_digest(buffer, size, digest);
+	fclose(file);
+	return digest;
+}
+
+/* Takes back the link held since the last sync if the device still answers, or connects anew */
+static osync_bool open_device_link(iphone_env *env, OSyncError **error)
+{
+	env->link_reused = FALSE;
+	if (env->keep_alive && (env->link = device_link_take(env->link_uuid))) {
+		if (device_link_alive(env->link)) {
+			osync_trace(TRACE_INTERNAL, "reusing link to device %s\n", env->link_uuid);
+			env->link_reused = TRUE;
+			return TRUE;
+		}
+		osync_trace(TRACE_INTERNAL, "held link to device %s is gone, reconnecting\n", env->link_uuid);
+		device_link_close(env->link);
+	}
+
+	if (!(env->link = device_link_open(env->device_uuid, error)))
+		return FALSE;
+	if (env->link->uuid) {
+		osync_free(env->link_uuid);
+		env->link_uuid = osync_strdup(env->link->uuid);
+	}
+	return TRUE;
+}
+
+static msync_channel *sink_channel(iphone_env *env, OSyncPluginInfo *info)
+{
+	if (env->calendar_sink && osync_plugin_info_get_sink(info) == env->calendar_sink)
+		return &env->calendar_channel;
+	return &env->contact_channel;
+}
+
+/* the calendar channel captures to and replays from its own file next to the contact one */
+static char *channel_file(iphone_env *env, msync_channel *channel, const char *path)
+{
+	if (!path)
+		return NULL;
+	if (channel == &env->calendar_channel)
+		return osync_strdup_printf("%s.calendar", path);
+	return osync_strdup(path);
+}
+
+/* The first channel gets the service connection of the device link, the other one starts its own */
+static osync_bool open_channel_msync(iphone_env *env, msync_channel *channel, OSyncError **error)
+{
+	msync_channel *other = channel == &env->contact_channel ? &env->calendar_channel : &env->contact_channel;
+
+	if (!env->link && !open_device_link(env, error))
+		return FALSE;
+
+	if (other->msync != env->link->msync) {
+		channel->msync = env->link->msync;
+		channel->reused = env->link_reused;
+		return TRUE;
+	}
+	if (!device_link_start_service(env->link, &channel->msync, error))
+		return FALSE;
+	channel->own_msync = TRUE;
+	channel->reused = FALSE;
+	return TRUE;
+}
+
+/* Sets up the channel transport to whatever stands for the device */
+static osync_bool open_channel(iphone_env *env, msync_channel *channel, OSyncError **error)
+{
+	char *replay = channel_file(env, channel, env->replay_path);
+	char *capture = channel_file(env, channel, env->capture_path);
+	osync_bool result = FALSE;
+
+	if (replay)
+		channel->transport = msync_transport_new_replay(replay, error);
+	else if (env->emulator)
+		channel->transport = msync_transport_new_socket(env->emulator, error);
+	else if (open_channel_msync(env, channel, error))
+		channel->transport = msync_transport_new_device(channel->msync, error);
+	if (!channel->transport)
+		goto exit;
+
+	if (capture)
+		if (!(channel->transport = msync_transport_new_capture(channel->transport, capture, error)))
+			goto exit;
+	msync_transport_set_latency(channel->transport, env->link_latency);
+	result = TRUE;
+
+exit:
+	osync_free(replay);
+	osync_free(capture);
+	return result;
+}
+
+static void close_channel(msync_channel *channel)
+{
+	msync_transport_free(channel->transport);
+	channel->transport = NULL;
+	if (channel->own_msync)
+		iphone_msync_free_client(channel->msync);
+	channel->msync = NULL;
+	channel->own_msync = FALSE;
+	channel->reused = FALSE;
+	osync_free(channel->next_anchor);
+	channel->next_anchor = NULL;
+}
+
+/*
+ * A held link that passed the health check can still have lost its
+ * MobileSync connection, a new one is started over the same lockdown
+ * session.
+ */
+static osync_bool reconnect_channel(iphone_env *env, msync_channel *channel, OSyncError **error)
+{
+	osync_trace(TRACE_INTERNAL, "held link to device %s failed, restarting MobileSync\n", env->link_uuid);
+	msync_transport_free(channel->transport);
+	channel->transport = NULL;
+	if (!channel->own_msync) {
+		iphone_msync_free_client(env->link->msync);
+		env->link->msync = NULL;
+		channel->msync = NULL;
+		if (!device_link_start_service(env->link, &env->link->msync, error))
+			return FALSE;
+	}
+	close_channel(channel);
+	//the new connection is not a held one, a failure on it is final
+	env->link_reused = FALSE;
+	return open_channel(env, channel, error);
+}
+
+/* waits for a get_changes() still running on the channel */
+static void join_channel_worker(msync_channel *channel)
+{
+	if (channel->worker_started) {
+		pthread_join(channel->worker, NULL);
+		channel->worker_started = FALSE;
+	}
+}
+
 static void connect(void *userdata, OSyncPluginInfo *info, OSyncContext *ctx)
 {
 	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p)", __func__, userdata, info, ctx);
 	iphone_env *env = (iphone_env *)userdata;
+	msync_channel *channel = sink_channel(env, info);
+	OSyncError *error = NULL;
+	uint64_t start = 0;
 
 	/*
 	 * Now connect to iphone
 	 */
-	if (env->device || env->lckd || env->msync)
+	if (channel->transport)
 		goto already_connected; //service already started
 
-	int res = 0;
-	if ( IPHONE_E_SUCCESS == iphone_get_device( &(env->device) ) && env->device ) {
-		if (IPHONE_E_SUCCESS == iphone_lckd_new_client( env->device, &(env->lckd)) && env->lckd ) {
-
-			int port = 0;
-			if (IPHONE_E_SUCCESS == iphone_lckd_start_service ( env->lckd, "com.apple.mobilesync", &port ) && port != 0 ) {
-				if (IPHONE_E_SUCCESS == iphone_msync_new_client ( env->device, 3458, port, &(env->msync)) && env->msync )
-					res = 1;
-			}
-		}
+	//a new sync starts with the first sink, the others share its device link
+	if (!env->connected_sinks) {
+		sync_stats_reset(env->stats);
+		env->stats_written = FALSE;
+		env->sync_completed = FALSE;
+		env->link_idle = TRUE;
 	}
-	if (!res)
-		goto error;
+	start = sync_stats_now(env->stats);
+
+	if (!open_channel(env, channel, &error))
+		goto error_transport;
+	env->connected_sinks++;
+
+	if (env->xslt_path && channel == &env->contact_channel) {
+		char buffer[512];
+		int result = 0;
+		snprintf(buffer, sizeof(buffer) - 1, "%s/pcont2osync.xslt",
+				env->xslt_path);
+		if ((result = xslt_initialize(env->xslt_ctx_pcont, buffer)))
+			goto error;
+		osync_trace(TRACE_INTERNAL, "\ndone contact: %s\n", buffer);
 
-/*
-	//you can also use the anchor system to detect a device reset
-	//or some parameter change here. Check the docs to see how it works
-	char *lanchor = NULL;
-	//Now you get the last stored anchor from the device
-	char *anchorpath = osync_strdup_printf("%s/anchor.db", osync_plugin_info_get_configdir(info));
-
-	if (!osync_anchor_compare(anchorpath, "lanchor", lanchor))
-		osync_objtype_sink_set_slowsync(sink, TRUE);
-
-	osync_free(anchorpath);
-*/
-	char buffer[512];
-	int result = 0;
-	snprintf(buffer, sizeof(buffer) - 1, "%s/pcont2osync.xslt",
-			env->xslt_path);
-	if ((result = xslt_initialize(env->xslt_ctx_pcont, buffer)))
-		goto error;
-	osync_trace(TRACE_INTERNAL, "\ndone contact: %s\n", buffer);
+		//a changed stylesheet invalidates every cached contact
+		env->cache_version = digest_file(buffer,
+				contact_cache_digest(CONTACT_CACHE_CONVERTER, strlen(CONTACT_CACHE_CONVERTER), CONTACT_CACHE_SEED));
 
+		snprintf(buffer, sizeof(buffer) - 1, "%s/osync2pcont.xslt",
+				env->xslt_path);
+		if ((result = xslt_initialize(env->xslt_ctx_pcont_commit, buffer)))
+			goto error;
+		osync_trace(TRACE_INTERNAL, "\ndone contact commit: %s\n", buffer);
+	}
+
+	sync_stats_time(env->stats, STATS_CONNECT, start);
 	osync_context_report_success(ctx);
 	osync_trace(TRACE_EXIT, "%s", __func__);
 	return;
@@ -137,54 +467,68 @@ already_connected :
 	osync_context_report_error(ctx, OSYNC_ERROR_LOCKED, "MobileSync client is already runing");
 	return;
 
+error_transport:
+	osync_context_report_osyncerror(ctx, error);
+	osync_error_unref(&error);
+	goto cleanup;
+
 error:
 	osync_context_report_error(ctx, OSYNC_ERROR_NO_CONNECTION, "Failed to start MobileSync service");
 
-	iphone_msync_free_client(env->msync);
-	env->msync = NULL;
-	iphone_lckd_free_client(env->lckd);
-	env->lckd = NULL;
-	iphone_free_device(env->device);
-	env->device = NULL;
+cleanup:
+	if (channel->transport)
+		env->connected_sinks--;
+	close_channel(channel);
+	if (!env->connected_sinks) {
+		device_link_close(env->link);
+		env->link = NULL;
+	}
 	return;
 }
 
-plist_t build_contact_hello_msg(iphone_env *env)
+/* last_anchor is NULL when the device has to send everything */
+plist_t build_hello_msg(const char *dataclass, const char *last_anchor, const char *next_anchor)
 {
 	plist_t array = NULL;
 
 	array = plist_new_array();
 	plist_add_sub_string_el(array, "SDMessageSyncDataClassWithDevice");
-	plist_add_sub_string_el(array, "com.apple.Contacts");
-
-	//get last anchor and send new one
-	OSyncError *anchor_error;
-	char *timestamp = NULL;
-	timestamp = osync_anchor_retrieve(osync_objtype_sink_get_anchor(env->contact_sink),
-					  &anchor_error);
+	plist_add_sub_string_el(array, dataclass);
 
-	if (timestamp && strlen(timestamp) > 0)
-		osync_trace(TRACE_INTERNAL, "timestamp is: %s\n", timestamp);
-	else {
-		if (timestamp)
-			free(timestamp);
-		timestamp = strdup("---");
+	if (last_anchor)
+		osync_trace(TRACE_INTERNAL, "timestamp is: %s\n", last_anchor);
+	else
 		osync_trace(TRACE_INTERNAL, "first sync!\n");
-	};
 
-	time_t t = time(NULL);
-
-	char* new_timestamp = osync_time_unix2vtime(&t);
-
-	plist_add_sub_string_el(array, timestamp);
-	plist_add_sub_string_el(array, new_timestamp);
+	plist_add_sub_string_el(array, last_anchor ? last_anchor : "---");
+	plist_add_sub_string_el(array, next_anchor);
 
 	plist_add_sub_uint_el(array, 106);
-	plist_add_sub_string_el(array, "___EmptyParameterString___");
+	plist_add_sub_string_el(array, EMPTY_PARAMETER_STRING);
 
 	return array;
 }
 
+/*
+ * A sink anchor holds the computer anchor sent for the last successful
+ * session and the anchor the device answered with, one per line.
+ */
+static void split_anchor(char *stored, char **computer, char **device)
+{
+	char *separator = stored ? strchr(stored, '\n') : NULL;
+
+	*computer = NULL;
+	*device = NULL;
+	if (!stored || !*stored)
+		return;
+
+	*computer = stored;
+	if (separator) {
+		*separator = '\0';
+		*device = separator + 1;
+	}
+}
+
 void get_session_type_and_timestamp (plist_t array, char* sink, char** old_timestamp, char** new_timestamp, session_type* sync)
 {
 	if (array) {
@@ -201,284 +545,2473 @@ void get_session_type_and_timestamp (plist_t array, char* sink, char** old_times
 		plist_get_string_val(type, &s_type);
 		plist_get_uint_val(snum, &snumber);
 
-		if (!strcmp(s_type, "SDSyncTypeFast"))
+		if (s_type && !strcmp(s_type, "SDSyncTypeFast"))
 			*sync = FAST_SYNC;
 		else
 			*sync = SLOW_SYNC;
+		free(s_type);
+
+	}
+}
+
+static xmlNodePtr get_child_element(xmlNodePtr node, const char *name)
+{
+	xmlNodePtr child = NULL;
+	for (child = node->children; child; child = child->next)
+		if (XML_ELEMENT_NODE == child->type && xmlStrEqual(child->name, BAD_CAST name))
+			break;
+	return child;
+}
+
+/* everything needed to report a converted record to the engine */
+typedef struct sync_report {
+	iphone_env *env;
+	session_type type;
+	OSyncContext *ctx;
+	/* converted contacts kept across syncs, and the raw record digests to cache them by uid */
+	contact_cache *cache;
+	xmlHashTablePtr digests;
+	/* dataclass on the device and the sink it is reported to */
+	const char *dataclass;
+	OSyncObjTypeSink *sink;
+	OSyncObjFormat *format;
+	/* connection the records come from */
+	msync_channel *channel;
+	/* raw whole dump while its contacts are converted, for quarantined records */
+	xmlDocPtr raw_doc;
+	/* ids of every record a slow sync received, none of them is reported deleted */
+	xmlHashTablePtr received;
+	/* records left out of the sync, the user is told how many */
+	int skipped;
+} sync_report;
+
+/* FNV-1a over the sorted xmlformat, so the same contact always hashes the same */
+static char *hash_xmlformat(OSyncXMLFormat *xmlformat, OSyncError **error)
+{
+	char *buffer = NULL;
+	unsigned int size = 0;
+	uint64_t hash = 0;
+
+	if (!osync_xmlformat_assemble(xmlformat, &buffer, &size, error))
+		return NULL;
+
+	hash = contact_cache_digest(buffer, size, CONTACT_CACHE_SEED);
+	osync_free(buffer);
+
+	return osync_strdup_printf("%016llx", (unsigned long long) hash);
+}
+
+/* Builds the change for a converted record, takes ownership of xmlformat.
+ * Does not touch the context, so it is safe to call from a worker.
+ */
+static OSyncChange *build_change(const char *uid, OSyncXMLFormat *xmlformat, sync_report *report, OSyncError **error)
+{
+	sync_stats *stats = report->env->stats;
+	uint64_t start = sync_stats_now(stats);
+	OSyncData *odata = NULL;
+	OSyncChange *chg = NULL;
+	char *hash = NULL;
+
+	osync_xmlformat_sort(xmlformat);
+
+	odata = osync_data_new((char *) xmlformat,
+				osync_xmlformat_size(),
+				report->format, error);
+	if (!odata) {
+		osync_xmlformat_unref(xmlformat);
+		return NULL;
+	}
+
+	if (!(chg = osync_change_new(error))) {
+		osync_data_unref(odata);
+		return NULL;
+	}
+	osync_data_set_objtype(odata, osync_objtype_sink_get_name(report->sink));
+	osync_change_set_data(chg, odata);
+	osync_data_unref(odata);
+
+	osync_change_set_uid(chg, uid);
+
+	if (!(hash = hash_xmlformat(xmlformat, error))) {
+		osync_change_unref(chg);
+		return NULL;
+	}
+	osync_change_set_hash(chg, hash);
+	osync_free(hash);
+
+	sync_stats_count(stats, STATS_RECORDS_CONVERTED, 1);
+	sync_stats_time(stats, STATS_CONVERT, start);
+	return chg;
+}
+
+/* keeps the converted contact for the next sync, failures only cost a conversion later */
+static void cache_contact(sync_report *report, OSyncChange *chg)
+{
+	const char *uid = osync_change_get_uid(chg);
+	uint64_t *digest = xmlHashLookup(report->digests, BAD_CAST uid);
+	char *data = NULL;
+	unsigned int size = 0;
+	char *buffer = NULL;
+
+	if (!digest)
+		return;
+
+	osync_data_get_data(osync_change_get_data(chg), &data, &size);
+	if (!osync_xmlformat_assemble((OSyncXMLFormat *) data, &buffer, &size, NULL))
+		return;
+
+	if (!contact_cache_store(report->cache, uid, *digest, osync_change_get_hash(chg), buffer, size, NULL))
+		osync_trace(TRACE_INTERNAL, "unable to cache contact %s\n", uid);
+	osync_free(buffer);
+}
+
+/*
+ * Sets the change type and reports a change, takes ownership of chg.
+ * The hashtable keeps the content hash of every record reported so far,
+ * so only new or changed records reach the engine, even when the device
+ * sends its whole address book or calendar. Safe to call from the thread
+ * of a dataclass, the calls into the engine are made under the report lock.
+ */
+static void report_change(sync_report *report, OSyncChange *chg)
+{
+	OSyncHashTable *table = osync_objtype_sink_get_hashtable(report->sink);
+	OSyncChangeType changetype = osync_change_get_changetype(chg);
+	uint64_t start = sync_stats_now(report->env->stats);
+
+	pthread_mutex_lock(&report->env->report_lock);
+	if (OSYNC_CHANGE_TYPE_DELETED != changetype)
+		changetype = osync_hashtable_get_changetype(table, chg);
+
+	osync_change_set_changetype(chg, changetype);
+	osync_hashtable_update_change(table, chg);
+
+	if (OSYNC_CHANGE_TYPE_DELETED == changetype && report->cache)
+		contact_cache_remove(report->cache, osync_change_get_uid(chg));
+	else if (report->digests)
+		cache_contact(report, chg);
+
+	if (OSYNC_CHANGE_TYPE_UNMODIFIED != changetype) {
+		osync_context_report_change(report->ctx, chg);
+		sync_stats_count(report->env->stats, STATS_CHANGES_REPORTED, 1);
+	}
+	pthread_mutex_unlock(&report->env->report_lock);
+	osync_change_unref(chg);
+	sync_stats_time(report->env->stats, STATS_REPORT, start);
+}
+
+static xmlNodePtr first_element(xmlNodePtr node, const char *name)
+{
+	for (; node; node = node->next)
+		if (XML_ELEMENT_NODE == node->type && xmlStrEqual(node->name, BAD_CAST name))
+			break;
+	return node;
+}
+
+/* the records dict of a message, the first dict it holds */
+static xmlNodePtr get_records_dict(xmlNodePtr message)
+{
+	return message ? first_element(message->children, "dict") : NULL;
+}
+
+/* the raw record a converted contact came from */
+static xmlNodePtr find_raw_record(xmlDocPtr doc, const xmlChar *id)
+{
+	xmlNodePtr root = doc ? xmlDocGetRootElement(doc) : NULL;
+	xmlNodePtr node = NULL;
+
+	if (!root || !id || !(root = first_element(root->children, "array")))
+		return NULL;
+
+	for (node = first_element(root->children, "dict"); node; node = first_element(node->next, "dict")) {
+		xmlNodePtr records = get_records_dict(first_element(node->children, "array"));
+		xmlNodePtr key = NULL;
+
+		for (key = records ? first_element(records->children, "key") : NULL; key; key = first_element(key->next, "key")) {
+			xmlChar *content = xmlNodeGetContent(key);
+			osync_bool found = xmlStrEqual(content, id);
+			xmlFree(content);
+			if (found)
+				return first_element(key->next, "dict");
+		}
+	}
+	return NULL;
+}
+
+static void write_quarantine_node(FILE *file, xmlNodePtr node)
+{
+	xmlBufferPtr buffer = xmlBufferCreate();
+
+	if (buffer && xmlNodeDump(buffer, node->doc, node, 1, 1) >= 0) {
+		fwrite(xmlBufferContent(buffer), 1, xmlBufferLength(buffer), file);
+		fputc('\n', file);
+	}
+	if (buffer)
+		xmlBufferFree(buffer);
+}
+
+/*
+ * A record that could not be converted this time is still on the device,
+ * it keeps its last hash so a slow sync does not report it as deleted.
+ */
+static void keep_unconverted_record(sync_report *report, const char *uid)
+{
+	OSyncHashTable *table = osync_objtype_sink_get_hashtable(report->sink);
+	const char *hash = NULL;
+	OSyncChange *chg = NULL;
+
+	pthread_mutex_lock(&report->env->report_lock);
+	if ((hash = osync_hashtable_get_hash(table, uid)) && (chg = osync_change_new(NULL))) {
+		osync_change_set_uid(chg, uid);
+		osync_change_set_hash(chg, hash);
+		osync_change_set_changetype(chg, OSYNC_CHANGE_TYPE_UNMODIFIED);
+		osync_hashtable_update_change(table, chg);
+		osync_change_unref(chg);
+	}
+	pthread_mutex_unlock(&report->env->report_lock);
+}
+
+/*
+ * Sets aside a contact that failed to convert, with its converted node
+ * and, while the whole dump is at hand, the raw record it came from.
+ * Returns FALSE when bad records are not skipped, leaving the error to
+ * the caller, otherwise the error is consumed and the sink goes on.
+ */
+static osync_bool quarantine_contact(sync_report *report, const char *uid, xmlNodePtr node, OSyncError **error)
+{
+	iphone_env *env = report->env;
+	xmlChar *id = NULL;
+	xmlNodePtr uid_node = NULL;
+	xmlNodePtr raw = NULL;
+
+	if (!env->quarantine_path)
+		return FALSE;
+
+	if (uid)
+		id = xmlStrdup(BAD_CAST uid);
+	else if (node && (uid_node = get_child_element(node, "Uid")) && (uid_node = get_child_element(uid_node, "content")))
+		id = xmlNodeGetContent(uid_node);
+	osync_trace(TRACE_INTERNAL, "quarantining contact %s: %s\n", id ? (char *) id : "without Uid", osync_error_print(error));
+
+	//only the records of the last sync that had bad ones are kept
+	if (!env->quarantine && (env->quarantine = fopen(env->quarantine_path, "w")))
+		fputs("<?xml version=\"1.0\"?>\n<quarantine>\n", env->quarantine);
+
+	if (!env->quarantine)
+		osync_trace(TRACE_INTERNAL, "unable to write %s: %s\n", env->quarantine_path, strerror(errno));
+	else {
+		xmlChar *message = xmlEncodeSpecialChars(NULL, BAD_CAST osync_error_print(error));
+		xmlChar *escaped = id ? xmlEncodeSpecialChars(NULL, id) : NULL;
+
+		fprintf(env->quarantine, "<record uid=\"%s\" error=\"%s\">\n",
+			escaped ? (char *) escaped : "", message ? (char *) message : "");
+		if (node)
+			write_quarantine_node(env->quarantine, node);
+		if ((raw = find_raw_record(report->raw_doc, id)))
+			write_quarantine_node(env->quarantine, raw);
+		fputs("</record>\n", env->quarantine);
+		fflush(env->quarantine);
+		xmlFree(message);
+		xmlFree(escaped);
+	}
+
+	if (id)
+		keep_unconverted_record(report, (const char *) id);
+	sync_stats_count(env->stats, STATS_RECORDS_QUARANTINED, 1);
+	osync_error_unref(error);
+	xmlFree(id);
+	return TRUE;
+}
+
+/* takes ownership of xmlformat */
+static osync_bool report_xmlformat(const char *uid, OSyncXMLFormat *xmlformat, void *userdata, OSyncError **error)
+{
+	sync_report *report = (sync_report *) userdata;
+	uint64_t start = sync_stats_now(report->env->stats);
+	OSyncChange *chg = build_change(uid, xmlformat, report, error);
+	if (!chg) {
+		sync_stats_count(report->env->stats, STATS_RECORDS_FAILED, 1);
+		return report->env->contact_sink == report->sink && quarantine_contact(report, uid, NULL, error);
+	}
+	sync_stats_record(report->env->stats, start);
+
+	report_change(report, chg);
+	return TRUE;
+}
+
+/* a record removed on the device */
+static osync_bool report_deleted_record(sync_report *report, const char *uid, OSyncError **error)
+{
+	OSyncData *odata = NULL;
+	OSyncChange *chg = NULL;
+
+	if (!(chg = osync_change_new(error)))
+		return FALSE;
+
+	if (!(odata = osync_data_new(NULL, 0, report->format, error))) {
+		osync_change_unref(chg);
+		return FALSE;
+	}
+	osync_data_set_objtype(odata, osync_objtype_sink_get_name(report->sink));
+	osync_change_set_data(chg, odata);
+	osync_data_unref(odata);
+
+	osync_change_set_uid(chg, uid);
+	osync_change_set_changetype(chg, OSYNC_CHANGE_TYPE_DELETED);
+
+	report_change(report, chg);
+	return TRUE;
+}
+
+/*
+ * After a full dump, records in the hashtable the device did not send are
+ * gone. Only called once every batch went through the converter: a record
+ * that was sent but never reported (quarantined without a Uid, skipped,
+ * dropped by the stylesheet) is still on the device and keeps its hash.
+ */
+static osync_bool report_missing_records(sync_report *report, OSyncError **error)
+{
+	OSyncHashTable *table = osync_objtype_sink_get_hashtable(report->sink);
+	OSyncList *deleted = NULL;
+	OSyncList *item = NULL;
+	osync_bool result = TRUE;
+
+	pthread_mutex_lock(&report->env->report_lock);
+	deleted = osync_hashtable_get_deleted(table);
+	pthread_mutex_unlock(&report->env->report_lock);
+
+	for (item = deleted; result && item; item = item->next) {
+		const char *uid = (const char *) item->data;
+
+		if (report->received && xmlHashLookup(report->received, BAD_CAST uid)) {
+			osync_trace(TRACE_INTERNAL, "record %s was sent but not reported, keeping it\n", uid);
+			keep_unconverted_record(report, uid);
+			continue;
+		}
+		result = report_deleted_record(report, uid, error);
+	}
+
+	osync_list_free(deleted);
+	return result;
+}
+
+/*
+ * What it takes to turn one <contact> of a transformed document into a
+ * change: one compiled XPath expression and context give the Uid, and
+ * one buffer is reused to serialize each contact for osync_xmlformat_parse().
+ * Every worker has its own.
+ */
+typedef struct contact_parser {
+	xmlXPathCompExprPtr uid_expr;
+	xmlXPathContext *xpath_ctx;
+	xmlBufferPtr buffer;
+} contact_parser;
+
+static void contact_parser_clear(contact_parser *parser)
+{
+	if (parser->xpath_ctx)
+		xmlXPathFreeContext(parser->xpath_ctx);
+	if (parser->uid_expr)
+		xmlXPathFreeCompExpr(parser->uid_expr);
+	if (parser->buffer)
+		xmlBufferFree(parser->buffer);
+	memset(parser, 0, sizeof(contact_parser));
+}
+
+static osync_bool contact_parser_init(contact_parser *parser, xmlDocPtr doc, OSyncError **error)
+{
+	parser->uid_expr = xmlXPathCompile(BAD_CAST "Uid/content");
+	parser->xpath_ctx = xmlXPathNewContext(doc);
+	parser->buffer = xmlBufferCreate();
+	if (!parser->uid_expr || !parser->xpath_ctx || !parser->buffer) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate contact parser");
+		contact_parser_clear(parser);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static OSyncChange *convert_contact_node(contact_parser *parser, sync_report *report, xmlNodePtr node, OSyncError **error)
+{
+	sync_stats *stats = report->env->stats;
+	uint64_t start = sync_stats_now(stats);
+	uint64_t parse_start = 0;
+	OSyncXMLFormat *xmlformat = NULL;
+	xmlXPathObject *xpathObj = NULL;
+	OSyncChange *chg = NULL;
+	char *uid = NULL;
+
+	//compute uid
+	parser->xpath_ctx->node = node;
+	xpathObj = xmlXPathCompiledEval(parser->uid_expr, parser->xpath_ctx);
+
+	//check that there is only one field
+	if (!xpathObj || !xpathObj->nodesetval || 1 != xpathObj->nodesetval->nodeNr) {
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Contact without a unique Uid");
+		goto exit;
+	}
+	uid = (char *) xmlNodeGetContent(xpathObj->nodesetval->nodeTab[0]);
+
+	xmlBufferEmpty(parser->buffer);
+	if (xmlNodeDump(parser->buffer, node->doc, node, 0, 0) < 0) {
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Unable to serialize contact %s", uid);
+		goto exit;
+	}
+
+	parse_start = sync_stats_now(stats);
+	xmlformat = osync_xmlformat_parse((const char *) xmlBufferContent(parser->buffer),
+					  xmlBufferLength(parser->buffer), error);
+	sync_stats_time(stats, STATS_PARSE, parse_start);
+	if (!xmlformat)
+		goto exit;
+
+	chg = build_change(uid, xmlformat, report, error);
+
+exit:
+	if (xpathObj)
+		xmlXPathFreeObject(xpathObj);
+	if (uid)
+		xmlFree(uid);
+	if (chg)
+		sync_stats_record(stats, start);
+	else
+		sync_stats_count(stats, STATS_RECORDS_FAILED, 1);
+	return chg;
+}
+
+/* one <contact>, converted by whichever worker picks it first */
+typedef struct contact_job {
+	xmlNodePtr node;
+	OSyncChange *change;
+	OSyncError *error;
+	osync_bool done;
+} contact_job;
+
+typedef struct contact_pool {
+	sync_report *report;
+	contact_job *jobs;
+	int count;
+	/* first job no worker has picked yet */
+	int next;
+	osync_bool aborted;
+	pthread_mutex_t lock;
+	pthread_cond_t job_done;
+} contact_pool;
+
+typedef struct contact_worker {
+	contact_pool *pool;
+	contact_parser parser;
+	pthread_t thread;
+} contact_worker;
+
+static void *contact_worker_run(void *userdata)
+{
+	contact_worker *worker = (contact_worker *) userdata;
+	contact_pool *pool = worker->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->aborted && pool->next < pool->count) {
+		contact_job *job = &pool->jobs[pool->next++];
+		OSyncError *error = NULL;
+		OSyncChange *chg = NULL;
+
+		pthread_mutex_unlock(&pool->lock);
+		chg = convert_contact_node(&worker->parser, pool->report, job->node, &error);
+		pthread_mutex_lock(&pool->lock);
+
+		job->change = chg;
+		job->error = error;
+		job->done = TRUE;
+		pthread_cond_broadcast(&pool->job_done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/*
+ * Converts the contacts on env->workers threads. This thread only waits
+ * for each job in document order and reports it, so it stays the only
+ * one touching the context and hashtable, and the order is the same as
+ * with a single worker.
+ */
+static osync_bool report_contact_jobs(sync_report *report, xmlDocPtr doc, contact_job *jobs, int count, OSyncError **error)
+{
+	contact_pool pool;
+	contact_worker *workers = NULL;
+	int nworkers = report->env->workers;
+	int started = 0;
+	int i = 0;
+	osync_bool result = FALSE;
+
+	memset(&pool, 0, sizeof(contact_pool));
+	pool.report = report;
+	pool.jobs = jobs;
+	pool.count = count;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.job_done, NULL);
+
+	if (nworkers > count)
+		nworkers = count;
+	if (!(workers = osync_try_malloc0(nworkers * sizeof(contact_worker), error)))
+		goto exit;
+
+	for (i = 0; i < nworkers; i++) {
+		workers[i].pool = &pool;
+		if (!contact_parser_init(&workers[i].parser, doc, error))
+			goto exit;
+	}
+
+	for (started = 0; started < nworkers; started++)
+		if (pthread_create(&workers[started].thread, NULL, contact_worker_run, &workers[started]))
+			break;
+	if (!started) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to start contact workers");
+		goto exit;
+	}
+
+	for (i = 0; i < count; i++) {
+		pthread_mutex_lock(&pool.lock);
+		while (!jobs[i].done)
+			pthread_cond_wait(&pool.job_done, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+
+		if (!jobs[i].change) {
+			if (quarantine_contact(report, NULL, jobs[i].node, &jobs[i].error))
+				continue;
+			*error = jobs[i].error;
+			jobs[i].error = NULL;
+			goto exit;
+		}
+		report_change(report, jobs[i].change);
+		jobs[i].change = NULL;
+	}
+	result = TRUE;
+
+exit:
+	pthread_mutex_lock(&pool.lock);
+	pool.aborted = TRUE;
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+	for (i = 0; workers && i < nworkers; i++)
+		contact_parser_clear(&workers[i].parser);
+	osync_free(workers);
+
+	//changes of a failed run that were never reported
+	for (i = 0; i < count; i++) {
+		if (jobs[i].change)
+			osync_change_unref(jobs[i].change);
+		if (jobs[i].error)
+			osync_error_unref(&jobs[i].error);
+	}
+
+	pthread_cond_destroy(&pool.job_done);
+	pthread_mutex_destroy(&pool.lock);
+	return result;
+}
+
+/*
+ * Reports every <contact> of a transformed document, using the tree in
+ * place. Without workers each contact is freed once it is reported.
+ */
+static osync_bool report_contact_doc(sync_report *report, xmlDocPtr doc, OSyncError **error)
+{
+	contact_parser parser;
+	contact_job *jobs = NULL;
+	OSyncChange *chg = NULL;
+	xmlNodePtr node = NULL;
+	xmlNodePtr next = NULL;
+	int count = 0;
+	osync_bool result = FALSE;
+
+	memset(&parser, 0, sizeof(contact_parser));
+
+	//one top level element per contact batch of the dump
+	if (!xmlDocGetRootElement(doc)) {
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Empty contact document");
+		goto exit;
+	}
+
+	if (report->env->workers > 1) {
+		for (node = xslt_result_next(doc, NULL); node; node = xslt_result_next(doc, node))
+			count++;
+		if (!count) {
+			result = TRUE;
+			goto exit;
+		}
+
+		if (!(jobs = osync_try_malloc0(count * sizeof(contact_job), error)))
+			goto exit;
+		count = 0;
+		for (node = xslt_result_next(doc, NULL); node; node = xslt_result_next(doc, node))
+			jobs[count++].node = node;
+
+		result = report_contact_jobs(report, doc, jobs, count, error);
+		goto exit;
+	}
+
+	if (!contact_parser_init(&parser, doc, error))
+		goto exit;
+
+	for (node = xslt_result_next(doc, NULL); node; node = next) {
+		next = xslt_result_next(doc, node);
+		if ((chg = convert_contact_node(&parser, report, node, error)))
+			report_change(report, chg);
+		else if (!quarantine_contact(report, NULL, node, error))
+			goto exit;
+
+		//the change has its own copy, the tree shrinks as it is reported
+		xmlUnlinkNode(node);
+		xmlFreeNode(node);
+	}
+	result = TRUE;
+
+exit:
+	contact_parser_clear(&parser);
+	osync_free(jobs);
+	return result;
+}
+
+/* digest of everything under a raw record, keys and values alike */
+static uint64_t digest_record(xmlNodePtr node, uint64_t digest)
+{
+	xmlNodePtr child = NULL;
+
+	digest = contact_cache_digest(node->name, xmlStrlen(node->name), digest);
+	if (node->content)
+		digest = contact_cache_digest(node->content, xmlStrlen(node->content), digest);
+	for (child = node->children; child; child = child->next)
+		digest = digest_record(child, digest);
+	return digest;
+}
+
+/* the sums live in the session arena, the table never frees them */
+static void add_contact_digest(xmlHashTablePtr digests, arena *arena, const xmlChar *id, uint64_t digest)
+{
+	uint64_t *sum = xmlHashLookup(digests, id);
+
+	if (!sum) {
+		if (!(sum = arena_alloc(arena, sizeof(uint64_t))))
+			return;
+		if (xmlHashAddEntry(digests, id, sum))
+			return;
+	}
+	*sum += digest;
+}
+
+/*
+ * Digests the raw records every contact of a whole dump is built from:
+ * its contact record plus the attribute records pointing at it. The
+ * digests are summed, so the order records arrive in does not matter.
+ */
+static xmlHashTablePtr digest_contacts(xmlDocPtr doc, arena *arena)
+{
+	xmlHashTablePtr digests = xmlHashCreate(0);
+	xmlNodePtr root = xmlDocGetRootElement(doc);
+	xmlNodePtr node = NULL;
+
+	if (!digests || !root || !(root = first_element(root->children, "array")))
+		return digests;
+
+	for (node = root->children; node; node = node->next) {
+		xmlNodePtr records = NULL;
+		xmlNodePtr key = NULL;
+		osync_bool is_contact = FALSE;
+
+		if (XML_ELEMENT_NODE != node->type)
+			continue;
+
+		//contact records are wrapped in a contact-ref dict
+		if ((is_contact = xmlStrEqual(node->name, BAD_CAST "dict")))
+			records = get_records_dict(first_element(node->children, "array"));
+		else
+			records = get_records_dict(node);
+		if (!records)
+			continue;
+
+		for (key = first_element(records->children, "key"); key; key = first_element(key->next, "key")) {
+			xmlNodePtr record = first_element(key->next, "dict");
+			xmlNodePtr field = NULL;
+			xmlChar *id = NULL;
+
+			if (!record)
+				break;
+
+			if (is_contact)
+				id = xmlNodeGetContent(key);
+			else {
+				//attribute records name their contact in a 'contact' array
+				for (field = first_element(record->children, "key"); field; field = first_element(field->next, "key"))
+					if (xmlStrEqual(field->children ? field->children->content : NULL, BAD_CAST "contact"))
+						break;
+				if (field && (field = first_element(field->next, "array")) && (field = first_element(field->children, "string")))
+					id = xmlNodeGetContent(field);
+			}
+
+			if (id)
+				add_contact_digest(digests, arena, id, digest_record(record, CONTACT_CACHE_SEED));
+			xmlFree(id);
+			key = record;
+		}
+	}
+	return digests;
+}
+
+/* Reports a contact straight from the cache, only parsing it when the hashtable says it changed */
+static osync_bool report_cached_contact(sync_report *report, const char *uid, const char *hash, const char *blob, unsigned int size, OSyncError **error)
+{
+	OSyncHashTable *table = osync_objtype_sink_get_hashtable(report->sink);
+	OSyncXMLFormat *xmlformat = NULL;
+	OSyncData *odata = NULL;
+	OSyncChange *chg = NULL;
+
+	if (!(chg = osync_change_new(error)))
+		return FALSE;
+	osync_change_set_uid(chg, uid);
+	osync_change_set_hash(chg, hash);
+
+	sync_stats_count(report->env->stats, STATS_RECORDS_CACHED, 1);
+	pthread_mutex_lock(&report->env->report_lock);
+	OSyncChangeType changetype = osync_hashtable_get_changetype(table, chg);
+	if (OSYNC_CHANGE_TYPE_UNMODIFIED == changetype) {
+		osync_change_set_changetype(chg, changetype);
+		osync_hashtable_update_change(table, chg);
+		pthread_mutex_unlock(&report->env->report_lock);
+		osync_change_unref(chg);
+		return TRUE;
+	}
+	pthread_mutex_unlock(&report->env->report_lock);
+
+	//cached already sorted
+	uint64_t start = sync_stats_now(report->env->stats);
+	xmlformat = osync_xmlformat_parse(blob, size, error);
+	sync_stats_time(report->env->stats, STATS_PARSE, start);
+	if (!xmlformat)
+		goto error;
+	if (!(odata = osync_data_new((char *) xmlformat, osync_xmlformat_size(), report->format, error))) {
+		osync_xmlformat_unref(xmlformat);
+		goto error;
+	}
+	osync_data_set_objtype(odata, osync_objtype_sink_get_name(report->sink));
+	osync_change_set_data(chg, odata);
+	osync_data_unref(odata);
+
+	osync_change_set_changetype(chg, changetype);
+	pthread_mutex_lock(&report->env->report_lock);
+	osync_hashtable_update_change(table, chg);
+	osync_context_report_change(report->ctx, chg);
+	pthread_mutex_unlock(&report->env->report_lock);
+	sync_stats_count(report->env->stats, STATS_CHANGES_REPORTED, 1);
+	osync_change_unref(chg);
+	return TRUE;
+
+error:
+	osync_change_unref(chg);
+	return FALSE;
+}
+
+/*
+ * Reports the contacts of a whole dump whose raw records did not change
+ * since they were cached, and takes them out of the document so the
+ * stylesheet only sees the others. Returns how many are left.
+ */
+static int report_cached_contacts(sync_report *report, xmlDocPtr doc, OSyncError **error)
+{
+	contact_cache *cache = report->cache;
+	xmlNodePtr root = xmlDocGetRootElement(doc);
+	xmlNodePtr node = NULL;
+	int remaining = 0;
+
+	if (!root || !(root = first_element(root->children, "array")))
+		return 0;
+
+	for (node = first_element(root->children, "dict"); node; node = first_element(node->next, "dict")) {
+		xmlNodePtr records = get_records_dict(first_element(node->children, "array"));
+		xmlNodePtr key = NULL;
+		xmlNodePtr next = NULL;
+
+		if (!records)
+			continue;
+
+		for (key = first_element(records->children, "key"); key; key = next) {
+			xmlNodePtr record = first_element(key->next, "dict");
+			xmlChar *id = NULL;
+			uint64_t *digest = NULL;
+			const char *hash = NULL;
+			const char *blob = NULL;
+			unsigned int size = 0;
+
+			if (!record)
+				break;
+			next = first_element(record->next, "key");
+
+			id = xmlNodeGetContent(key);
+			if (!id || !(digest = xmlHashLookup(report->digests, id))
+			    || !contact_cache_lookup(cache, (const char *) id, *digest, &hash, &blob, &size)) {
+				remaining++;
+				xmlFree(id);
+				continue;
+			}
+
+			if (!report_cached_contact(report, (const char *) id, hash, blob, size, error)) {
+				xmlFree(id);
+				return -1;
+			}
+			//nothing to store again for it
+			xmlHashRemoveEntry(report->digests, id, NULL);
+			xmlFree(id);
+
+			xmlUnlinkNode(key);
+			xmlFreeNode(key);
+			xmlUnlinkNode(record);
+			xmlFreeNode(record);
+		}
+	}
+	return remaining;
+}
+
+static osync_bool process_plist_new_contact(sync_report *report, plist_t contacts, OSyncError **error)
+{
+	iphone_env *env = report->env;
+	xmlDocPtr raw_doc = NULL;
+	xmlDocPtr plist_doc = NULL;
+	int remaining = 0;
+	uint64_t start = sync_stats_now(env->stats);
+	osync_bool result = FALSE;
+
+	//the stylesheet input is built from the received nodes, never as text
+	raw_doc = plist_to_xml_doc(contacts);
+	sync_stats_time(env->stats, STATS_PLIST_XML, start);
+	if (!raw_doc) {
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Error processing contact plist");
+		goto exit;
+	}
+
+	if (report->cache) {
+		if (!(report->digests = digest_contacts(raw_doc, env->arena))) {
+			osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate contact digests");
+			goto exit;
+		}
+		if ((remaining = report_cached_contacts(report, raw_doc, error)) < 0)
+			goto exit;
+		if (!remaining) {
+			result = TRUE;
+			goto exit;
+		}
+		osync_trace(TRACE_INTERNAL, "%d contacts not in cache\n", remaining);
+	}
+
+	start = sync_stats_now(env->stats);
+	plist_doc = xslt_transform_tree(env->xslt_ctx_pcont, raw_doc);
+	sync_stats_time(env->stats, STATS_XSLT, start);
+
+	//now loop over contacts
+	if (!plist_doc) {
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Error processing contact plist");
+		goto exit;
+	}
+
+	report->raw_doc = raw_doc;
+	result = report_contact_doc(report, plist_doc, error);
+	report->raw_doc = NULL;
+
+exit:
+	if (report->digests)
+		xmlHashFree(report->digests, NULL);
+	report->digests = NULL;
+	if (raw_doc)
+		xmlFreeDoc(raw_doc);
+	if (plist_doc)
+		xmlFreeDoc(plist_doc);
+	return result;
+}
+
+static contact_stream *contact_stream_new(OSyncError **error)
+{
+	contact_stream *stream = osync_try_malloc0(sizeof(contact_stream), error);
+	if (!stream)
+		return NULL;
+
+	stream->doc = xmlNewDoc(BAD_CAST "1.0");
+	if (stream->doc)
+		xmlDocSetRootElement(stream->doc, xmlNewNode(NULL, BAD_CAST "contacts"));
+	stream->pending = xmlHashCreate(0);
+
+	if (!stream->doc || !xmlDocGetRootElement(stream->doc) || !stream->pending) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate contact stream");
+		if (stream->pending)
+			xmlHashFree(stream->pending, NULL);
+		if (stream->doc)
+			xmlFreeDoc(stream->doc);
+		osync_free(stream);
+		return NULL;
+	}
+	return stream;
+}
+
+static void contact_stream_free(contact_stream *stream)
+{
+	if (!stream)
+		return;
+	//entries point into doc, nothing to deallocate
+	xmlHashFree(stream->pending, NULL);
+	xmlFreeDoc(stream->doc);
+	osync_free(stream);
+}
+
+/* returns the node collecting everything received so far for a contact id */
+static xmlNodePtr contact_stream_get_node(contact_stream *stream, const xmlChar *id)
+{
+	xmlNodePtr node = xmlHashLookup(stream->pending, id);
+	if (node)
+		return node;
+
+	node = xmlNewChild(xmlDocGetRootElement(stream->doc), NULL, BAD_CAST "contact", NULL);
+	if (node && xmlHashAddEntry(stream->pending, id, node)) {
+		xmlUnlinkNode(node);
+		xmlFreeNode(node);
+		node = NULL;
+	}
+	return node;
+}
+
+/*
+ * Converts one received batch and merges it into the pending contacts.
+ * The device sends every contact record of a dump before the first of
+ * their phones, emails and addresses, which reference the contact by id.
+ * No contact is complete before the last batch, so they are reported by
+ * contact_stream_finish(); what is kept meanwhile is the converted nodes,
+ * not the raw batches. The batch is owned and freed here.
+ */
+static osync_bool contact_stream_feed(iphone_env *env, contact_stream *stream, plist_t batch, OSyncError **error)
+{
+	plist_t wrapper = NULL;
+	xmlDocPtr raw_doc = NULL;
+	xmlDocPtr batch_doc = NULL;
+	xmlNodePtr node = NULL;
+	xmlNodePtr dest = NULL;
+	xmlNodePtr child = NULL;
+	xmlChar *id = NULL;
+	xmlChar *output = NULL;
+	const char *journaled = NULL;
+	unsigned int size = 0;
+	uint64_t digest = 0;
+	uint64_t start = 0;
+	osync_bool result = FALSE;
+
+	//same layout the stylesheet gets for a whole dump, with a single batch
+	wrapper = plist_new_array();
+	if (plist_find_node_by_string(batch, "com.apple.contacts.Contact")) {
+		plist_t contact_ref_dict = plist_new_dict();
+		plist_add_sub_key_el(contact_ref_dict, "contact-ref");
+		plist_add_sub_node(contact_ref_dict, batch);
+		plist_add_sub_node(wrapper, contact_ref_dict);
+	}
+	else
+		plist_add_sub_node(wrapper, batch);
+
+	start = sync_stats_now(env->stats);
+	raw_doc = plist_to_xml_doc(wrapper);
+	plist_free(wrapper);
+	sync_stats_time(env->stats, STATS_PLIST_XML, start);
+
+	//a batch the interrupted session already converted is taken back as is
+	if (raw_doc && env->contact_journal) {
+		digest = digest_record(xmlDocGetRootElement(raw_doc), CONTACT_CACHE_SEED);
+		if ((journaled = batch_journal_lookup(env->contact_journal, digest, &size))) {
+			batch_doc = xmlReadMemory(journaled, size, NULL, NULL, XML_PARSE_NONET);
+			sync_stats_count(env->stats, STATS_BATCHES_RESUMED, 1);
+		}
+	}
+
+	start = sync_stats_now(env->stats);
+	if (raw_doc && !batch_doc)
+		batch_doc = xslt_transform_tree(env->xslt_ctx_pcont, raw_doc);
+	sync_stats_time(env->stats, STATS_XSLT, start);
+	if (!batch_doc) {
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Error processing contact plist");
+		goto exit;
+	}
+
+	if (env->contact_journal && !journaled) {
+		int length = 0;
+		xmlDocDumpMemory(batch_doc, &output, &length);
+		if (!output) {
+			osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to serialize contact batch");
+			goto exit;
+		}
+		if (!batch_journal_append(env->contact_journal, digest, (const char *) output, length, error))
+			goto exit;
+	}
+
+	//nothing we know how to convert in a batch of groups and the like
+	if (!xslt_result_next(batch_doc, NULL))
+		osync_trace(TRACE_INTERNAL, "skipping batch without contact data\n");
+
+	for (node = xslt_result_next(batch_doc, NULL); node; node = xslt_result_next(batch_doc, node)) {
+		if (xmlStrEqual(node->name, BAD_CAST "contact")) {
+			xmlNodePtr uid_node = get_child_element(node, "Uid");
+			if (uid_node && (uid_node = get_child_element(uid_node, "content")))
+				id = xmlNodeGetContent(uid_node);
+		}
+		else if (xmlStrEqual(node->name, BAD_CAST "attribute"))
+			id = xmlGetProp(node, BAD_CAST "contact");
+
+		if (!id)
+			continue;
+
+		if (!(dest = contact_stream_get_node(stream, id))) {
+			osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to store contact %s", (char *) id);
+			goto exit;
+		}
+		xmlFree(id);
+		id = NULL;
+
+		for (child = node->children; child; child = child->next)
+			if (XML_ELEMENT_NODE == child->type)
+				xmlAddChild(dest, xmlDocCopyNode(child, stream->doc, 1));
+	}
+	result = TRUE;
+
+exit:
+	if (id)
+		xmlFree(id);
+	if (output)
+		xmlFree(output);
+	if (batch_doc)
+		xmlFreeDoc(batch_doc);
+	if (raw_doc)
+		xmlFreeDoc(raw_doc);
+	return result;
+}
+
+/* reports the pending contacts once the device is done sending */
+static osync_bool contact_stream_finish(sync_report *report, contact_stream *stream, OSyncError **error)
+{
+	xmlNodePtr node = NULL;
+	xmlNodePtr next = NULL;
+
+	//attributes whose contact never showed up can not be reported
+	for (node = xmlDocGetRootElement(stream->doc)->children; node; node = next) {
+		next = node->next;
+		if (!get_child_element(node, "Uid")) {
+			osync_trace(TRACE_INTERNAL, "dropping attributes of unknown contact\n");
+			xmlUnlinkNode(node);
+			xmlFreeNode(node);
+		}
+	}
+
+	return report_contact_doc(report, stream->doc, error);
+}
+
+static iphone_error_t send_message(iphone_env *env, msync_channel *channel, plist_t plist)
+{
+	sync_stats_count(env->stats, STATS_MESSAGES_SENT, 1);
+	return msync_transport_send(channel->transport, plist);
+}
+
+/* the time spent here is the device (or the link) keeping us waiting */
+static iphone_error_t recv_message(iphone_env *env, msync_channel *channel, plist_t *plist)
+{
+	uint64_t start = sync_stats_now(env->stats);
+	uint64_t received = env->stats ? msync_transport_get_received(channel->transport) : 0;
+	iphone_error_t ret = msync_transport_recv(channel->transport, plist);
+
+	sync_stats_time(env->stats, STATS_DEVICE_WAIT, start);
+	if (IPHONE_E_SUCCESS == ret && env->stats) {
+		sync_stats_count(env->stats, STATS_MESSAGES_RECEIVED, 1);
+		sync_stats_count(env->stats, STATS_BYTES_RECEIVED, msync_transport_get_received(channel->transport) - received);
+	}
+	return ret;
+}
+
+/* Ends the MobileSync session left open by receive_records() */
+static osync_bool finish_session(iphone_env *env, msync_channel *channel)
+{
+	plist_t array = NULL;
+	osync_bool result = FALSE;
+
+	channel->session_open = FALSE;
+
+	array = plist_new_array();
+	plist_add_sub_string_el(array, "SDMessageFinishSessionOnDevice");
+	plist_add_sub_string_el(array, channel->session_dataclass);
+
+	send_message(env, channel, array);
+	plist_free(array);
+	array = NULL;
+
+	if (IPHONE_E_SUCCESS == recv_message(env, channel, &array) && array)
+		result = NULL != plist_find_node_by_string(array, "SDMessageDeviceFinishedSession");
+
+	if (array)
+		plist_free(array);
+	return result;
+}
+
+/* the acknowledgement never changes during a session, it is built once and sent for every batch */
+static plist_t build_ack_msg(const char *dataclass)
+{
+	plist_t array = plist_new_array();
+	plist_add_sub_string_el(array, "SDMessageAcknowledgeChangesFromDevice");
+	plist_add_sub_string_el(array, dataclass);
+	return array;
+}
+
+/* Acknowledges the last batch and waits for the next message */
+static plist_t receive_next_batch(iphone_env *env, msync_channel *channel, plist_t ack)
+{
+	plist_t array = NULL;
+	iphone_error_t ret = IPHONE_E_UNKNOWN_ERROR;
+
+	ret = send_message(env, channel, ack);
+
+	ret = recv_message(env, channel, &array);
+	if (IPHONE_E_SUCCESS != ret && array) {
+		plist_free(array);
+		array = NULL;
+	}
+	return array;
+}
+
+/*
+ * Fast sync batches carry removed records without their dict. Only the
+ * batches of the entity the sink reports are looked at: an attribute
+ * record ("<kind>/<contact>/<n>") or an alarm going away only changes
+ * the record it belongs to.
+ */
+static void collect_deleted_records(plist_t batch, const char *entity, plist_t deleted)
+{
+	plist_t records = NULL;
+	plist_t key = NULL;
+	plist_t value = NULL;
+
+	if (!plist_find_node_by_string(batch, entity) || !(records = message_get_records(batch)))
+		return;
+
+	for (key = plist_get_first_child(records); key; key = plist_get_next_sibling(value)) {
+		char *id = NULL;
+
+		if (!(value = plist_get_next_sibling(key)))
+			break;
+		if (PLIST_KEY != plist_get_node_type(key) || PLIST_DICT == plist_get_node_type(value))
+			continue;
+
+		plist_get_key_val(key, &id);
+		if (id && !strchr(id, '/')) {
+			osync_trace(TRACE_INTERNAL, "record %s deleted on device\n", id);
+			plist_add_sub_string_el(deleted, id);
+		}
+		free(id);
+	}
+}
+
+/*
+ * Remembers the ids of the records a slow sync batch of the reported
+ * entity carries, whatever becomes of them in the converter.
+ */
+static void collect_received_records(plist_t batch, const char *entity, xmlHashTablePtr received)
+{
+	plist_t records = NULL;
+	plist_t key = NULL;
+	plist_t value = NULL;
+
+	if (!plist_find_node_by_string(batch, entity) || !(records = message_get_records(batch)))
+		return;
+
+	for (key = plist_get_first_child(records); key; key = plist_get_next_sibling(value)) {
+		char *id = NULL;
+
+		if (!(value = plist_get_next_sibling(key)))
+			break;
+		if (PLIST_KEY != plist_get_node_type(key) || PLIST_DICT != plist_get_node_type(value))
+			continue;
+
+		plist_get_key_val(key, &id);
+		//the table only tells whether an id was seen
+		if (id && !strchr(id, '/'))
+			xmlHashAddEntry(received, BAD_CAST id, received);
+		free(id);
+	}
+}
+
+/*
+ * How the batches of one dataclass are turned into changes: feed gets
+ * every received batch and takes ownership of it, finish reports what
+ * could only be reported once the device was done sending.
+ */
+typedef struct record_converter {
+	osync_bool (*feed)(sync_report *report, void *state, plist_t batch, OSyncError **error);
+	osync_bool (*finish)(sync_report *report, void *state, OSyncError **error);
+	void *state;
+	/* entity whose removed records are reported as deletions */
+	const char *entity;
+} record_converter;
+
+static osync_bool native_contact_feed(sync_report *report, void *state, plist_t batch, OSyncError **error)
+{
+	uint64_t start = sync_stats_now(report->env->stats);
+	osync_bool result = pcont_conv_feed((pcont_conv *) state, batch, error);
+	sync_stats_time(report->env->stats, STATS_CONVERT, start);
+	plist_free(batch);
+	return result;
+}
+
+static osync_bool native_contact_finish(sync_report *report, void *state, OSyncError **error)
+{
+	return pcont_conv_finish((pcont_conv *) state, report_xmlformat, report, error);
+}
+
+static osync_bool raw_contact_feed(sync_report *report, void *state, plist_t batch, OSyncError **error)
+{
+	osync_bool result = pcont_raw_feed((pcont_raw *) state, batch, error);
+	plist_free(batch);
+	return result;
+}
+
+/* takes ownership of data, hashed as is */
+static osync_bool report_raw_contact(const char *uid, char *data, unsigned int size, void *userdata, OSyncError **error)
+{
+	sync_report *report = (sync_report *) userdata;
+	OSyncData *odata = NULL;
+	OSyncChange *chg = NULL;
+	char *hash = NULL;
+
+	if (!(odata = osync_data_new(data, size, report->format, error))) {
+		osync_free(data);
+		return FALSE;
+	}
+	if (!(chg = osync_change_new(error))) {
+		osync_data_unref(odata);
+		return FALSE;
+	}
+	osync_data_set_objtype(odata, osync_objtype_sink_get_name(report->sink));
+	osync_change_set_data(chg, odata);
+	osync_data_unref(odata);
+
+	osync_change_set_uid(chg, uid);
+	hash = osync_strdup_printf("%016llx", (unsigned long long) contact_cache_digest(data, size, CONTACT_CACHE_SEED));
+	osync_change_set_hash(chg, hash);
+	osync_free(hash);
+
+	report_change(report, chg);
+	return TRUE;
+}
+
+static osync_bool raw_contact_finish(sync_report *report, void *state, OSyncError **error)
+{
+	return pcont_raw_finish((pcont_raw *) state, report_raw_contact, report, error);
+}
+
+static osync_bool stream_contact_feed(sync_report *report, void *state, plist_t batch, OSyncError **error)
+{
+	return contact_stream_feed(report->env, (contact_stream *) state, batch, error);
+}
+
+static osync_bool stream_contact_finish(sync_report *report, void *state, OSyncError **error)
+{
+	return contact_stream_finish(report, (contact_stream *) state, error);
+}
+
+/*
+ * The whole dump is held three times while it is transformed: as plist
+ * batches, as the XML tree built from them and as the stylesheet output.
+ * The XML text size of the batches stands in for each of them, estimated
+ * from their binary size.
+ */
+#define DUMP_FOOTPRINT 3
+#define XML_PER_BINARY 4
+
+/* batches collected for the whole dump stylesheet */
+typedef struct contact_dump {
+	plist_t contacts;
+	/* estimated XML size of the collected batches, only tracked under a memory limit */
+	size_t size;
+	/* set once the limit was passed, batches then wait on disk */
+	batch_spool *spool;
+} contact_dump;
+
+static contact_dump *contact_dump_new(OSyncError **error)
+{
+	contact_dump *dump = osync_try_malloc0(sizeof(contact_dump), error);
+	if (dump)
+		dump->contacts = plist_new_array();
+	return dump;
+}
+
+static void contact_dump_free(contact_dump *dump)
+{
+	if (!dump)
+		return;
+	if (dump->contacts)
+		plist_free(dump->contacts);
+	batch_spool_free(dump->spool);
+	osync_free(dump);
+}
+
+/* Moves the batches collected so far to the spool, the contact-ref wrappers are left behind */
+static osync_bool contact_dump_spill(iphone_env *env, contact_dump *dump, OSyncError **error)
+{
+	plist_t node = NULL;
+
+	osync_trace(TRACE_INTERNAL, "contact dump over %zu bytes, spooling to %s\n", env->memory_limit, env->spool_path);
+	if (!(dump->spool = batch_spool_new(env->spool_path, error)))
+		return FALSE;
+
+	for (node = plist_get_first_child(dump->contacts); node; node = plist_get_next_sibling(node)) {
+		plist_t batch = node;
+
+		if (PLIST_DICT == plist_get_node_type(node))
+			batch = plist_get_next_sibling(plist_get_first_child(node));
+		if (!batch_spool_write(dump->spool, batch, error))
+			return FALSE;
+	}
+
+	plist_free(dump->contacts);
+	dump->contacts = plist_new_array();
+	return TRUE;
+}
+
+/*
+ * Size of batch once serialized for the stylesheet. The binary plist is
+ * far cheaper to build than the XML text, which takes about four times
+ * its size with the tags and the indentation.
+ */
+static size_t batch_xml_size(plist_t batch)
+{
+	char *bin = NULL;
+	uint32_t length = 0;
+
+	plist_to_bin(batch, &bin, &length);
+	free(bin);
+	return (size_t) length * XML_PER_BINARY;
+}
+
+/* collects every batch for the whole dump stylesheet */
+static osync_bool dump_contact_feed(sync_report *report, void *state, plist_t batch, OSyncError **error)
+{
+	iphone_env *env = report->env;
+	contact_dump *dump = (contact_dump *) state;
+	osync_bool result = TRUE;
+
+	if (env->memory_limit && !dump->spool) {
+		dump->size += batch_xml_size(batch);
+		if (dump->size * DUMP_FOOTPRINT > env->memory_limit && !contact_dump_spill(env, dump, error)) {
+			plist_free(batch);
+			return FALSE;
+		}
+	}
+
+	if (dump->spool) {
+		result = batch_spool_write(dump->spool, batch, error);
+		plist_free(batch);
+		return result;
+	}
+
+	//special treatment for contact ref plist
+	if (plist_find_node_by_string(batch, "com.apple.contacts.Contact")) {
+		plist_t contact_ref_dict = plist_new_dict();
+		plist_add_sub_key_el(contact_ref_dict, "contact-ref");
+		plist_add_sub_node(contact_ref_dict, batch);
+		plist_add_sub_node(dump->contacts, contact_ref_dict);
+	}
+	else
+		plist_add_sub_node(dump->contacts, batch);
+	return TRUE;
+}
+
+/*
+ * A spooled dump is read back one batch at a time through the streaming
+ * conversion, so only a single raw batch and the converted contacts are
+ * in memory. The record cache is not used for it.
+ */
+static osync_bool dump_contact_unspool(sync_report *report, contact_dump *dump, OSyncError **error)
+{
+	contact_stream *stream = NULL;
+	plist_t batch = NULL;
+	osync_bool result = FALSE;
+
+	if (!batch_spool_rewind(dump->spool, error) || !(stream = contact_stream_new(error)))
+		goto exit;
+
+	for (;;) {
+		if (!batch_spool_read(dump->spool, &batch, error))
+			goto exit;
+		if (!batch)
+			break;
+		if (!contact_stream_feed(report->env, stream, batch, error))
+			goto exit;
+	}
+
+	result = contact_stream_finish(report, stream, error);
+
+exit:
+	contact_stream_free(stream);
+	return result;
+}
+
+static osync_bool dump_contact_finish(sync_report *report, void *state, OSyncError **error)
+{
+	contact_dump *dump = (contact_dump *) state;
+
+	if (dump->spool)
+		return dump_contact_unspool(report, dump, error);
+	if (!plist_get_first_child(dump->contacts))
+		return TRUE;
+	return process_plist_new_contact(report, dump->contacts, error);
+}
+
+/* an event that can not be converted stays out of the sync, an older copy of it is not reported deleted */
+static void skip_event(const char *uid, void *userdata)
+{
+	sync_report *report = (sync_report *) userdata;
+
+	report->skipped++;
+	sync_stats_count(report->env->stats, STATS_RECORDS_SKIPPED, 1);
+	keep_unconverted_record(report, uid);
+}
+
+/* single events are reported as their batch comes, recurring ones once their rules came too */
+static osync_bool event_feed(sync_report *report, void *state, plist_t batch, OSyncError **error)
+{
+	osync_bool result = pcal_conv_feed((pcal_conv *) state, batch, report_xmlformat, skip_event, report, error);
+	plist_free(batch);
+	return result;
+}
+
+static osync_bool event_finish(sync_report *report, void *state, OSyncError **error)
+{
+	pcal_conv_finish((pcal_conv *) state, skip_event, report);
+	return TRUE;
+}
+
+/* Hands one received batch to the converter, takes ownership of batch */
+static osync_bool consume_batch(sync_report *report, record_converter *converter, plist_t deleted, plist_t batch, OSyncError **error)
+{
+	sync_stats_count(report->env->stats, STATS_BATCHES, 1);
+	collect_deleted_records(batch, converter->entity, deleted);
+	if (report->received)
+		collect_received_records(batch, converter->entity, report->received);
+	return converter->feed(report, converter->state, batch, error);
+}
+
+typedef struct batch_receiver {
+	iphone_env *env;
+	msync_channel *channel;
+	plist_t ack;
+	batch_queue *queue;
+	/* first batch, received before the thread starts */
+	plist_t first;
+	osync_bool failed;
+} batch_receiver;
+
+/*
+ * Receive thread: drives the acknowledge/receive exchange and queues the
+ * raw batches. Blocks on the queue when conversion falls behind, and
+ * stops early if the converting side aborts it.
+ */
+static void *receive_batches(void *userdata)
+{
+	batch_receiver *receiver = (batch_receiver *) userdata;
+	plist_t array = receiver->first;
+
+	receiver->first = NULL;
+	while (!plist_find_node_by_string(array, "SDMessageDeviceReadyToReceiveChanges")) {
+		if (!batch_queue_push(receiver->queue, array))
+			goto exit;
+
+		if (!(array = receive_next_batch(receiver->env, receiver->channel, receiver->ack))) {
+			receiver->failed = TRUE;
+			break;
+		}
+	}
+
+exit:
+	if (array)
+		plist_free(array);
+	batch_queue_close(receiver->queue);
+	return NULL;
+}
+
+/*
+ * Receives the records of report->dataclass from the device and reports
+ * them. A slow sync asks for every record, a fast sync only for the ones
+ * changed since the last anchor, removals included. Both go through the
+ * same conversion. On return the device waits for our changes until
+ * finish_session() is called.
+ */
+static osync_bool receive_records(sync_report *report, record_converter *converter, OSyncError **error)
+{
+	iphone_env *env = report->env;
+	msync_channel *channel = report->channel;
+	uint64_t start = sync_stats_now(env->stats);
+	plist_t array = NULL;
+	plist_t ack = NULL;
+	plist_t deleted = NULL;
+	plist_t node = NULL;
+	batch_queue *queue = NULL;
+	osync_bool result = FALSE;
+
+	array = plist_new_array();
+	if (SLOW_SYNC == report->type)
+		plist_add_sub_string_el(array, "SDMessageGetAllRecordsFromDevice");
+	else
+		plist_add_sub_string_el(array, "SDMessageGetChangesFromDevice");
+	plist_add_sub_string_el(array, report->dataclass);
+
+	iphone_error_t ret = IPHONE_E_UNKNOWN_ERROR;
+
+	ret = send_message(env, channel, array);
+	plist_free(array);
+	array = NULL;
+
+	ret = recv_message(env, channel, &array);
+	if (IPHONE_E_SUCCESS != ret || !array) {
+		osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Failed to receive records from device");
+		goto exit;
+	}
+
+	deleted = plist_new_array();
+	ack = build_ack_msg(report->dataclass);
+	if (SLOW_SYNC == report->type && !(report->received = xmlHashCreate(0))) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate received record table");
+		goto exit;
+	}
+
+	if (env->receive_thread) {
+		batch_receiver receiver = { env, channel, ack, NULL, array, FALSE };
+		pthread_t thread;
+		plist_t batch = NULL;
+		osync_bool consumed = TRUE;
+
+		array = NULL;
+		if (!(queue = batch_queue_new(RECEIVE_QUEUE_SIZE, error))) {
+			plist_free(receiver.first);
+			goto exit;
+		}
+		receiver.queue = queue;
+
+		if (pthread_create(&thread, NULL, receive_batches, &receiver)) {
+			osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to start receive thread");
+			plist_free(receiver.first);
+			goto exit;
+		}
+
+		//convert while the device sends the next batches
+		while (consumed && (batch = batch_queue_pop(queue)))
+			if (!(consumed = consume_batch(report, converter, deleted, batch, error)))
+				batch_queue_abort(queue);
+
+		pthread_join(thread, NULL);
+		if (!consumed)
+			goto exit;
+		if (receiver.failed) {
+			osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Failed to receive records from device");
+			goto exit;
+		}
+	}
+	else {
+		while (!plist_find_node_by_string(array, "SDMessageDeviceReadyToReceiveChanges")) {
+			//convert the batch now so it is freed before acknowledging it
+			osync_bool consumed = consume_batch(report, converter, deleted, array, error);
+			array = NULL;
+			if (!consumed)
+				goto exit;
+
+			if (!(array = receive_next_batch(env, channel, ack))) {
+				osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Failed to receive records from device");
+				goto exit;
+			}
+		}
+		plist_free(array);
+		array = NULL;
+	}
+
+	array = plist_new_array();
+	plist_add_sub_string_el(array, "DLMessagePing");
+	plist_add_sub_string_el(array, "Preparing to get changes for device");
+
+	ret = send_message(env, channel, array);
+	plist_free(array);
+	array = NULL;
+
+	channel->session_open = TRUE;
+	channel->session_dataclass = report->dataclass;
+
+	//now process collected informations
+	result = converter->finish(report, converter->state, error);
+
+	for (node = plist_get_first_child(deleted); result && node; node = plist_get_next_sibling(node)) {
+		char *uid = NULL;
+		plist_get_string_val(node, &uid);
+		result = report_deleted_record(report, uid, error);
+		free(uid);
+	}
+
+	if (result && SLOW_SYNC == report->type)
+		result = report_missing_records(report, error);
+
+exit:
+	if (array)
+		plist_free(array);
+	if (deleted)
+		plist_free(deleted);
+	if (ack)
+		plist_free(ack);
+	if (report->received)
+		xmlHashFree(report->received, NULL);
+	report->received = NULL;
+	batch_queue_free(queue);
+	sync_stats_time(env->stats, STATS_RECEIVE, start);
+	return result;
+}
+
+/*
+ * Opens the device session for a dataclass and tells whether it is a
+ * slow or fast one. The device only offers a fast sync when we send the
+ * anchor of the last session it finished with us. A device that moved
+ * on from the anchor it gave us then was reset or synced with someone
+ * else in between, its changes are not ours and everything is fetched.
+ */
+static osync_bool start_session(iphone_env *env, msync_channel *channel, const char *dataclass, OSyncObjTypeSink *sink, session_type *type, OSyncError **error)
+{
+	iphone_error_t ret = IPHONE_E_UNKNOWN_ERROR;
+	OSyncError *anchor_error = NULL;
+	char *stored = NULL;
+	char *last_anchor = NULL;
+	char *device_anchor = NULL;
+	char *next_anchor = NULL;
+	char *old_timestamp = NULL;
+	char *new_timestamp = NULL;
+	plist_t array = NULL;
+	time_t t = time(NULL);
+	osync_bool result = FALSE;
+
+	*type = SLOW_SYNC;
+	if (!(stored = osync_anchor_retrieve(osync_objtype_sink_get_anchor(sink), &anchor_error)) && anchor_error) {
+		osync_trace(TRACE_INTERNAL, "no %s anchor: %s\n", dataclass, osync_error_print(&anchor_error));
+		osync_error_unref(&anchor_error);
+	}
+	split_anchor(stored, &last_anchor, &device_anchor);
+	//the engine wants everything, so does the device then
+	if (osync_objtype_sink_get_slowsync(sink))
+		last_anchor = NULL;
+
+	next_anchor = osync_time_unix2vtime(&t);
+	array = build_hello_msg(dataclass, last_anchor, next_anchor);
+	ret = send_message(env, channel, array);
+	plist_free(array);
+	array = NULL;
+	ret = recv_message(env, channel, &array);
+
+	if ((IPHONE_E_SUCCESS != ret || !array) && channel->reused) {
+		if (array)
+			plist_free(array);
+		array = NULL;
+		if (reconnect_channel(env, channel, error))
+			result = start_session(env, channel, dataclass, sink, type, error);
+		goto exit;
+	}
+
+	if (IPHONE_E_SUCCESS != ret || !array) {
+		osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Failed to start %s session on device", dataclass);
+		goto exit;
+	}
+
+	get_session_type_and_timestamp(array, (char *) dataclass, &old_timestamp, &new_timestamp, type);
+	if (FAST_SYNC == *type && device_anchor && (!old_timestamp || strcmp(device_anchor, old_timestamp))) {
+		osync_trace(TRACE_INTERNAL, "%s device anchor moved from %s to %s, slow sync\n", dataclass, device_anchor, old_timestamp);
+		*type = SLOW_SYNC;
+	}
+	osync_trace(TRACE_INTERNAL, "%s sync of %s\n", FAST_SYNC == *type ? "fast" : "slow", dataclass);
+
+	//only stored once the whole sync went through
+	osync_free(channel->next_anchor);
+	channel->next_anchor = osync_strdup_printf("%s\n%s", next_anchor, new_timestamp ? new_timestamp : "");
+	result = TRUE;
+
+exit:
+	if (array)
+		plist_free(array);
+	free(old_timestamp);
+	free(new_timestamp);
+	osync_free(next_anchor);
+	osync_free(stored);
+	return result;
+}
+
+/*
+ * Every record of the device goes to the record store batch by batch. A
+ * slow session hands the batches on as they come, a fast one only applies
+ * its changes and the converter then gets the contacts they touched,
+ * rebuilt from the store, so it always sees whole contacts.
+ */
+typedef struct contact_records {
+	sync_report *report;
+	record_converter *inner;
+	contact_cache *store;
+	/* NULL in a slow session */
+	record_changes *changes;
+} contact_records;
+
+/* the stored records can not be trusted anymore, the next session is a slow one */
+static void drop_record_store(iphone_env *env)
+{
+	contact_cache_close(env->record_store);
+	env->record_store = NULL;
+	unlink(env->store_path);
+	unlink(env->store_new_path);
+}
+
+static osync_bool slow_records_feed(sync_report *report, void *state, plist_t batch, OSyncError **error)
+{
+	contact_records *records = (contact_records *) state;
+
+	if (!record_store_batch(records->store, batch, NULL, error)) {
+		plist_free(batch);
+		return FALSE;
+	}
+	return records->inner->feed(report, records->inner->state, batch, error);
+}
+
+static osync_bool slow_records_finish(sync_report *report, void *state, OSyncError **error)
+{
+	contact_records *records = (contact_records *) state;
+
+	return records->inner->finish(report, records->inner->state, error);
+}
+
+/* only applies the changes, the converter gets the touched contacts at finish */
+static osync_bool fast_records_feed(sync_report *report, void *state, plist_t batch, OSyncError **error)
+{
+	contact_records *records = (contact_records *) state;
+	osync_bool result = record_store_batch(records->store, batch, records->changes, error);
+
+	plist_free(batch);
+	return result;
+}
+
+/* hands the converter a rebuilt contact as the two batches it is made of */
+static osync_bool rebuild_raw_contact(const char *uid, char *data, unsigned int size, void *userdata, OSyncError **error)
+{
+	contact_records *records = (contact_records *) userdata;
+	plist_t root = NULL;
+	plist_t message = NULL;
+	osync_bool result = TRUE;
+
+	plist_from_bin(data, size, &root);
+	osync_free(data);
+
+	for (message = root ? plist_get_first_child(root) : NULL; result && message; message = plist_get_next_sibling(message))
+		result = records->inner->feed(records->report, records->inner->state, plist_copy_container(message), error);
+
+	if (root)
+		plist_free(root);
+	return result;
+}
+
+static osync_bool fast_records_finish(sync_report *report, void *state, OSyncError **error)
+{
+	contact_records *records = (contact_records *) state;
+	osync_bool result = record_store_rebuild(records->store, records->changes, rebuild_raw_contact, records, error)
+	                    && records->inner->finish(report, records->inner->state, error);
+
+	if (!result)
+		drop_record_store(report->env);
+	return result;
+}
+
+static osync_bool receive_contacts(iphone_env *env, session_type type, OSyncContext *ctx, OSyncError **error)
+{
+	sync_report report = { env, type, ctx, env->contact_cache, NULL, "com.apple.Contacts", env->contact_sink, env->contact_format, &env->contact_channel };
+	record_converter converter = { NULL, NULL, NULL, "com.apple.contacts.Contact" };
+	contact_records records = { &report, &converter, env->record_store, NULL };
+	record_converter merging = { slow_records_feed, slow_records_finish, &records, "com.apple.contacts.Contact" };
+	osync_bool result = FALSE;
+
+	if (FAST_SYNC == type) {
+		merging.feed = fast_records_feed;
+		merging.finish = fast_records_finish;
+		if (!(records.changes = record_changes_new(error)))
+			goto exit;
+	}
+
+	//raw records need no converter at all
+	if (env->raw_format) {
+		report.format = env->raw_format;
+		converter.feed = raw_contact_feed;
+		converter.finish = raw_contact_finish;
+		converter.state = pcont_raw_new(error);
+	}
+	//the native converter always works batch by batch
+	else if (!env->xslt_path) {
+		converter.feed = native_contact_feed;
+		converter.finish = native_contact_finish;
+		converter.state = pcont_conv_new(error);
+	}
+	else if (env->streaming) {
+		converter.feed = stream_contact_feed;
+		converter.finish = stream_contact_finish;
+		converter.state = contact_stream_new(error);
+	}
+	else {
+		converter.feed = dump_contact_feed;
+		converter.finish = dump_contact_finish;
+		converter.state = contact_dump_new(error);
+	}
+	if (!converter.state)
+		goto exit;
+
+	result = receive_records(&report, &merging, error);
+
+	if (env->raw_format)
+		pcont_raw_free((pcont_raw *) converter.state);
+	else if (!env->xslt_path)
+		pcont_conv_free((pcont_conv *) converter.state);
+	else if (env->streaming)
+		contact_stream_free((contact_stream *) converter.state);
+	else
+		contact_dump_free((contact_dump *) converter.state);
+
+exit:
+	record_changes_free(records.changes);
+	return result;
+}
+
+/*
+ * Answers a context under env->report_lock, a get_changes() of another
+ * dataclass may be reporting from its thread meanwhile.
+ */
+static void answer_context(iphone_env *env, OSyncContext *ctx, OSyncError *error)
+{
+	pthread_mutex_lock(&env->report_lock);
+	if (error)
+		osync_context_report_osyncerror(ctx, error);
+	else
+		osync_context_report_success(ctx);
+	pthread_mutex_unlock(&env->report_lock);
+}
+
+typedef struct changes_job {
+	iphone_env *env;
+	OSyncContext *ctx;
+	void (*run)(iphone_env *env, OSyncContext *ctx);
+} changes_job;
+
+static void *changes_worker(void *userdata)
+{
+	changes_job *job = (changes_job *) userdata;
+
+	job->run(job->env, job->ctx);
+	osync_context_unref(job->ctx);
+	osync_free(job);
+	return NULL;
+}
+
+/*
+ * Runs a get_changes() on its own thread when dataclasses run in
+ * parallel: the engine goes on with the next sink, whose channel
+ * receives at the same time. Device I/O and conversion run freely on
+ * the threads, the reports into the hashtables and contexts are
+ * serialized by env->report_lock, and the context is answered from the
+ * thread under it too.
+ */
+static void run_changes(iphone_env *env, msync_channel *channel, OSyncContext *ctx, void (*run)(iphone_env *env, OSyncContext *ctx))
+{
+	changes_job *job = NULL;
+
+	join_channel_worker(channel);
+	if (env->parallel && (job = osync_try_malloc0(sizeof(changes_job), NULL))) {
+		job->env = env;
+		job->ctx = ctx;
+		job->run = run;
+		osync_context_ref(ctx);
+		if (!pthread_create(&channel->worker, NULL, changes_worker, job)) {
+			channel->worker_started = TRUE;
+			return;
+		}
+		osync_trace(TRACE_INTERNAL, "unable to start get_changes thread, running it here\n");
+		osync_context_unref(ctx);
+		osync_free(job);
+	}
+	run(env, ctx);
+}
 
+/*
+ * A fast session needs the records the last sync left in the store,
+ * without them everything is fetched again. A slow session starts a new
+ * store next to it, which only replaces the old one once the sync is
+ * done: a slow session broken off halfway leaves no store at all.
+ */
+static osync_bool open_record_store(iphone_env *env, session_type *type, OSyncError **error)
+{
+	if (FAST_SYNC == *type) {
+		if (!(env->record_store = contact_cache_open(env->store_path, RECORD_STORE_VERSION, error)))
+			return FALSE;
+		if (contact_cache_valid(env->record_store)) {
+			env->store_is_new = FALSE;
+			return TRUE;
+		}
+
+		osync_trace(TRACE_INTERNAL, "no contact records from the last sync, slow sync\n");
+		contact_cache_close(env->record_store);
+		*type = SLOW_SYNC;
 	}
+
+	//contacts the slow session does not send are gone from the device
+	unlink(env->store_path);
+	unlink(env->store_new_path);
+	env->store_is_new = TRUE;
+	return NULL != (env->record_store = contact_cache_open(env->store_new_path, RECORD_STORE_VERSION, error));
 }
 
-static void process_plist_new_contact(iphone_env *env, plist_t contacts, session_type type, OSyncPluginInfo *info, OSyncContext *ctx)
+static void report_contact_changes(iphone_env *env, OSyncContext *ctx)
 {
-	char slow_sync_flag = 0;
+	osync_trace(TRACE_ENTRY, "%s(%p, %p)", __func__, env, ctx);
+
+	uint64_t start = sync_stats_now(env->stats);
 	OSyncError *error = NULL;
-	OSyncXMLFormat *xmlformat;
-	OSyncData *odata = NULL;
-	OSyncChange *chg = NULL;
-	char *plist_xml = NULL;
-	uint32_t length = 0;
-	int result = 0;
-	xmlDocPtr contact_doc = NULL;
-	xmlXPathContext *xpath_ctx;
-	xmlXPathObject *xpathObj;
-	xmlNode *uid_node;
-	char *uid = NULL;
+	session_type type;
 
-	plist_to_xml(contacts, &plist_xml, &length);
-	if ((result = xslt_transform(env->xslt_ctx_pcont, plist_xml)))
+	if (!start_session(env, &env->contact_channel, "com.apple.Contacts", env->contact_sink, &type, &error))
+		goto error;
+	if (!env->record_store && !open_record_store(env, &type, &error))
 		goto error;
 
-	free(plist_xml);
-	plist_xml = env->xslt_ctx_pcont->xml_str;
+	//only the whole dump stylesheet path goes through the cache
+	if (env->record_cache && env->xslt_path && !env->streaming && !env->raw_format && !env->contact_cache)
+		if (!(env->contact_cache = contact_cache_open(env->cache_path, env->cache_version, &error)))
+			goto error;
 
-	//now loop over contacts
+	//only a slow sync converting batch by batch leaves something to resume
+	if (env->journal_path && env->xslt_path && !env->raw_format && SLOW_SYNC == type && (env->streaming || env->memory_limit) && !env->contact_journal)
+		if (!(env->contact_journal = batch_journal_open(env->journal_path, env->cache_version, &error)))
+			goto error;
 
-	xmlDocPtr plist_doc = xmlReadMemory(plist_xml, length, NULL, NULL, 0);
-	if (!plist_doc)
-		goto error;
-	xmlNodePtr root_node = xmlDocGetRootElement(plist_doc);
-	if (!root_node)
+	//the session stays open for committed_all()
+	if (!receive_contacts(env, type, ctx, &error))
 		goto error;
-	
-	xmlNodePtr node = NULL;
-	for (node = root_node->children; node; node = node->next) {
 
-		contact_doc = xmlNewDoc("1.0");
-		xmlDocSetRootElement(contact_doc, xmlCopyNode( node,1));
-		
-		char *contact_xml = NULL;
-		int size = 0;
-		xmlDocDumpMemory(contact_doc, (xmlChar **) &contact_xml, &size);
+	sync_stats_time(env->stats, STATS_GET_CHANGES, start);
+	//Now we need to answer the call
+	answer_context(env, ctx, NULL);
+	osync_trace(TRACE_EXIT, "%s", __func__);
+	return;
 
-		xmlformat = osync_xmlformat_parse(contact_xml, strlen(contact_xml), &error);
-		if (!xmlformat)
-			goto error;
-	
-		osync_xmlformat_sort(xmlformat);
-	
-		odata = osync_data_new(xmlformat,
-					osync_xmlformat_size(),
-					env->contact_format, &error);
-	
-		if (!odata)
-			goto cleanup;
-	
-		if (!(chg = osync_change_new(&error)))
-			goto cleanup;
-		osync_data_set_objtype(odata, osync_objtype_sink_get_name(env->contact_sink));
-		osync_change_set_data(chg, odata);
-		osync_data_unref(odata);
+error :
+	answer_context(env, ctx, error);
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(&error));
+	osync_error_unref(&error);
+	return;
+}
 
-		//compute uid
-		xpath_ctx = xmlXPathNewContext(contact_doc);
-		xpathObj = xmlXPathEvalExpression("/contact/Uid/content", xpath_ctx);
+static void get_contact_changes(void *userdata, OSyncPluginInfo *info, OSyncContext *ctx)
+{
+	iphone_env *env = (iphone_env *)userdata;
+	run_changes(env, &env->contact_channel, ctx, report_contact_changes);
+}
 
-		//check that there is only one field
-		if ( 1 != xpathObj->nodesetval->nodeNr)
-			goto cleanup;
+static void report_calendar_changes(iphone_env *env, OSyncContext *ctx)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p)", __func__, env, ctx);
 
-		uid_node = xpathObj->nodesetval->nodeTab[0];
+	msync_channel *channel = &env->calendar_channel;
+	sync_report report = { env, SLOW_SYNC, ctx, NULL, NULL, "com.apple.Calendars", env->calendar_sink, env->calendar_format, channel };
+	record_converter converter = { event_feed, event_finish, NULL, "com.apple.calendars.Event" };
+	uint64_t start = sync_stats_now(env->stats);
+	OSyncError *error = NULL;
+	osync_bool result = FALSE;
 
-		uid = strdup((char *) xmlNodeGetContent(uid_node));
-		xmlXPathFreeContext(xpath_ctx);
-		xmlXPathFreeObject(xpathObj);
-		xmlFreeDoc(contact_doc);
+	if (!start_session(env, channel, report.dataclass, report.sink, &report.type, &error))
+		goto error;
+	if (!(converter.state = pcal_conv_new(&error)))
+		goto error;
 
-		osync_change_set_uid(chg, uid);
-		free(uid);
-		uid = NULL;
+	result = receive_records(&report, &converter, &error);
+	pcal_conv_free((pcal_conv *) converter.state);
 
-		if (SLOW_SYNC == type)
-			osync_change_set_changetype(chg, OSYNC_CHANGE_TYPE_ADDED);
-		else
-//			if (gcal_contact_is_deleted(contact)) {
-//				osync_change_set_changetype(chg, OSYNC_CHANGE_TYPE_DELETED);
-//				osync_trace(TRACE_INTERNAL, "deleted entry!");
-//			}
-//			else
-				osync_change_set_changetype(chg, OSYNC_CHANGE_TYPE_MODIFIED);
-	
-		osync_context_report_change(ctx, chg);
-		osync_change_unref(chg);
-		
+	//nothing is written back to the calendar, do not keep the device waiting
+	if (channel->session_open && !finish_session(env, channel) && result) {
+		osync_error_set(&error, OSYNC_ERROR_IO_ERROR, "Failed to finish session on device");
+		result = FALSE;
 	}
-exit:
-	osync_context_report_success(ctx);
+	if (!result)
+		goto error;
+
+	if (report.skipped) {
+		OSyncError *warning = NULL;
+		osync_error_set(&warning, OSYNC_ERROR_CONVERT, "%d events were left out of the sync, their recurrence could not be converted", report.skipped);
+		pthread_mutex_lock(&env->report_lock);
+		osync_context_report_osyncwarning(ctx, warning);
+		pthread_mutex_unlock(&env->report_lock);
+		osync_error_unref(&warning);
+	}
+
+	sync_stats_time(env->stats, STATS_GET_CHANGES, start);
+	answer_context(env, ctx, NULL);
+	osync_trace(TRACE_EXIT, "%s", __func__);
 	return;
 
-cleanup:
+error :
+	answer_context(env, ctx, error);
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(&error));
 	osync_error_unref(&error);
-	osync_xmlformat_unref(&xmlformat);
-	xmlXPathFreeContext(xpath_ctx);
-	xmlXPathFreeObject(xpathObj);
-	xmlFreeDoc(contact_doc);
-	free(uid);
+	return;
+}
 
-error:
-	osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Error processing contact plist");
+static void get_calendar_changes(void *userdata, OSyncPluginInfo *info, OSyncContext *ctx)
+{
+	iphone_env *env = (iphone_env *)userdata;
+	run_changes(env, &env->calendar_channel, ctx, report_calendar_changes);
 }
 
-static void slow_contact_sync(iphone_env *env, OSyncPluginInfo *info, OSyncContext *ctx)
+/* answers every pending commit with error, or just drops them without one */
+static void fail_contact_commits(iphone_env *env, OSyncError *error)
 {
-	plist_t array = NULL;
-	array = plist_new_array();
-	plist_add_sub_string_el(array, "SDMessageGetAllRecordsFromDevice");
-	plist_add_sub_string_el(array, "com.apple.Contacts");
+	contact_commit *commit = NULL;
+	contact_commit *next = NULL;
+
+	pthread_mutex_lock(&env->report_lock);
+	for (commit = env->commits_first; commit; commit = next) {
+		next = commit->next;
+		if (error)
+			osync_context_report_osyncerror(commit->ctx, error);
+		else
+			osync_context_report_error(commit->ctx, OSYNC_ERROR_GENERIC, "Change was not sent to the device");
+		contact_commit_release(commit);
+	}
+	pthread_mutex_unlock(&env->report_lock);
+	env->commits_first = NULL;
+	env->commits_last = NULL;
+}
 
-	iphone_error_t ret = IPHONE_E_UNKNOWN_ERROR;
+/*
+ * Appends the device records for one committed change to the batch dict:
+ * the contact record and its phone, email and address records from the
+ * osync2pcont stylesheet, or the removed record id for a deletion.
+ */
+static osync_bool append_contact_records(iphone_env *env, xmlNodePtr dict, contact_commit *commit, OSyncError **error)
+{
+	const char *uid = osync_change_get_uid(commit->change);
+	OSyncData *odata = NULL;
+	char *data = NULL;
+	unsigned int size = 0;
+	char *xml = NULL;
+	xmlDocPtr records = NULL;
+	xmlNodePtr node = NULL;
+	osync_bool result = FALSE;
 
-	ret = iphone_msync_send(env->msync, array);
-	plist_free(array);
-	array = NULL;
+	if (OSYNC_CHANGE_TYPE_DELETED == osync_change_get_changetype(commit->change)) {
+		xmlNewTextChild(dict, NULL, BAD_CAST "key", BAD_CAST uid);
+		xmlNewTextChild(dict, NULL, BAD_CAST "string", BAD_CAST EMPTY_PARAMETER_STRING);
+		return TRUE;
+	}
 
-	ret = iphone_msync_recv(env->msync, &array);
+	odata = osync_change_get_data(commit->change);
+	osync_data_get_data(odata, &data, &size);
+	if (!osync_xmlformat_assemble((OSyncXMLFormat *) data, &xml, &size, error))
+		goto exit;
 
-	plist_t contact_node;
-	plist_t switch_node;
+	const char *params[] = { "contact-id", uid, NULL };
+	if (!(records = xslt_transform_doc_params(env->xslt_ctx_pcont_commit, xml, params))
+	    || !xmlDocGetRootElement(records)) {
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Error converting contact %s for the device", uid);
+		goto exit;
+	}
 
-	contact_node = plist_find_node_by_string(array, "com.apple.Contacts");
-	switch_node = plist_find_node_by_string(array, "SDMessageDeviceReadyToReceiveChanges");
+	for (node = xmlDocGetRootElement(records)->children; node; node = node->next)
+		if (XML_ELEMENT_NODE == node->type)
+			xmlAddChild(dict, xmlDocCopyNode(node, dict->doc, 1));
+	result = TRUE;
 
-	//create the contacts document
-	plist_t contacts = plist_new_array();
+exit:
+	if (records)
+		xmlFreeDoc(records);
+	osync_free(xml);
+	return result;
+}
 
-	while (NULL == switch_node) {
+/* the same records straight from the fields, for the native serializer */
+static osync_bool append_native_records(plist_t records, contact_commit *commit, OSyncError **error)
+{
+	const char *uid = osync_change_get_uid(commit->change);
+	char *data = NULL;
+	unsigned int size = 0;
+
+	if (OSYNC_CHANGE_TYPE_DELETED == osync_change_get_changetype(commit->change)) {
+		plist_add_sub_key_el(records, uid);
+		plist_add_sub_string_el(records, EMPTY_PARAMETER_STRING);
+		return TRUE;
+	}
 
-		//special treatment for contact ref plist
-		if (plist_find_node_by_string(array, "com.apple.contacts.Contact")) {
-			plist_t contact_ref_dict = plist_new_dict();
-			plist_add_sub_key_el(contact_ref_dict, "contact-ref");
-			plist_add_sub_node(contact_ref_dict, array);
-			plist_add_sub_node(contacts, contact_ref_dict);
-		}
-		else
-			plist_add_sub_node(contacts, array);
+	osync_data_get_data(osync_change_get_data(commit->change), &data, &size);
+	return pcont_commit_append(records, uid, (OSyncXMLFormat *) data, error);
+}
 
-		array = NULL;
+typedef struct removed_attributes {
+	/* uids of the modified contacts of the batch */
+	xmlHashTablePtr contacts;
+	plist_t records;
+} removed_attributes;
 
-		array = plist_new_array();
-		plist_add_sub_string_el(array, "SDMessageAcknowledgeChangesFromDevice");
-		plist_add_sub_string_el(array, "com.apple.Contacts");
+static void append_removed_attribute(const char *id, const char *owner, const char *blob, unsigned int size, void *userdata)
+{
+	removed_attributes *removed = (removed_attributes *) userdata;
 
-		ret = iphone_msync_send(env->msync, array);
-		plist_free(array);
-		array = NULL;
+	if (*owner && xmlHashLookup(removed->contacts, BAD_CAST owner) && !dict_get_value(removed->records, id)) {
+		plist_add_sub_key_el(removed->records, id);
+		plist_add_sub_string_el(removed->records, EMPTY_PARAMETER_STRING);
+	}
+}
 
-		ret = iphone_msync_recv(env->msync, &array);
+/*
+ * A modified contact is sent with all of its phone, email and address
+ * records, those the device had before and that are not among them any
+ * more are removed. One pass over the store serves the whole batch.
+ */
+static void append_removed_attributes(iphone_env *env, plist_t records, contact_commit *first, contact_commit *last)
+{
+	removed_attributes removed = { NULL, records };
+	contact_commit *commit = NULL;
 
-		contact_node = plist_find_node_by_string(array, "com.apple.Contacts");
-		switch_node = plist_find_node_by_string(array, "SDMessageDeviceReadyToReceiveChanges");
+	if (!env->record_store) {
+		osync_trace(TRACE_INTERNAL, "no stored records, old attributes of modified contacts stay\n");
+		return;
 	}
-	plist_free(array);
-	array = NULL;
+	if (!(removed.contacts = xmlHashCreate(0)))
+		return;
 
-	array = plist_new_array();
-	plist_add_sub_string_el(array, "DLMessagePing");
-	plist_add_sub_string_el(array, "Preparing to get changes for device");
+	for (commit = first; commit; commit = commit == last ? NULL : commit->next)
+		if (OSYNC_CHANGE_TYPE_MODIFIED == osync_change_get_changetype(commit->change))
+			xmlHashAddEntry(removed.contacts, BAD_CAST osync_change_get_uid(commit->change), removed.contacts);
 
-	ret = iphone_msync_send(env->msync, array);
-	plist_free(array);
-	array = NULL;
+	if (xmlHashSize(removed.contacts))
+		contact_cache_scan(env->record_store, append_removed_attribute, &removed);
+	xmlHashFree(removed.contacts, NULL);
+}
 
-	array = plist_new_array();
-	plist_add_sub_string_el(array, "SDMessageFinishSessionOnDevice");
-	plist_add_sub_string_el(array, "com.apple.Contacts");
+/* the hash the contact gets once it comes back from the device */
+static char *hash_sent_contact(iphone_env *env, const char *data, unsigned int size)
+{
+	OSyncXMLFormat *xmlformat = NULL;
+	char *hash = NULL;
+
+	if (env->raw_format)
+		return osync_strdup_printf("%016llx", (unsigned long long) contact_cache_digest(data, size, CONTACT_CACHE_SEED));
+
+	if (!(xmlformat = pcont_raw_convert(data, size, NULL)))
+		return NULL;
+	osync_xmlformat_sort(xmlformat);
+	hash = hash_xmlformat(xmlformat, NULL);
+	osync_xmlformat_unref(xmlformat);
+	return hash;
+}
 
-	ret = iphone_msync_send(env->msync, array);
-	plist_free(array);
-	array = NULL;
+typedef struct sent_contacts {
+	iphone_env *env;
+	/* hash of every sent contact by its final uid */
+	xmlHashTablePtr hashes;
+} sent_contacts;
 
-	ret = iphone_msync_recv(env->msync, &array);
+static osync_bool keep_sent_contact(const char *uid, char *data, unsigned int size, void *userdata, OSyncError **error)
+{
+	sent_contacts *sent = (sent_contacts *) userdata;
+	iphone_env *env = sent->env;
+	char *hash = hash_sent_contact(env, data, size);
+	osync_bool result = TRUE;
+
+	if (hash && xmlHashAddEntry(sent->hashes, BAD_CAST uid, hash))
+		osync_free(hash);
+	if (env->record_store)
+		result = record_store_contact(env->record_store, uid, data, size, error);
+	osync_free(data);
+	return result;
+}
 
-	plist_t finished = plist_find_node_by_string(array, "SDMessageDeviceFinishedSession");
-	contact_node = plist_find_node_by_string(array, "com.apple.Contacts");
+/*
+ * Hashes the sent contacts as they will come back and keeps their records
+ * for the next fast session, the records removed go from the store. A
+ * store that missed them is dropped, so the next session is a slow one.
+ */
+static void keep_sent_contacts(iphone_env *env, plist_t records, plist_t reply, xmlHashTablePtr hashes)
+{
+	sent_contacts sent = { env, hashes };
+	OSyncError *error = NULL;
+	pcont_raw *raw = NULL;
+	plist_t key = NULL;
+	plist_t value = NULL;
 
-	//now process collected informations
-	process_plist_new_contact(env, contacts, SLOW_SYNC, info, ctx);
+	if (!(raw = pcont_raw_new(&error))
+	    || !pcont_raw_feed_sent(raw, records, message_get_records(reply), &error)
+	    || !pcont_raw_finish(raw, keep_sent_contact, &sent, &error))
+		goto error;
+	pcont_raw_free(raw);
+	raw = NULL;
+
+	if (!env->record_store)
+		return;
+
+	//deletions are sent as a plain string
+	for (key = plist_get_first_child(records); key; key = plist_get_next_sibling(value)) {
+		char *id = NULL;
+
+		if (!(value = plist_get_next_sibling(key)))
+			break;
+		if (PLIST_KEY != plist_get_node_type(key) || PLIST_DICT == plist_get_node_type(value))
+			continue;
+		plist_get_key_val(key, &id);
+		if (id)
+			contact_cache_remove(env->record_store, id);
+		free(id);
+	}
+	if (contact_cache_flush(env->record_store, &error))
+		return;
 
+error:
+	osync_trace(TRACE_INTERNAL, "sent contacts not stored: %s\n", osync_error_print(&error));
+	osync_error_unref(&error);
+	pcont_raw_free(raw);
+	drop_record_store(env);
 }
 
-static void fast_contact_sync(iphone_env *env, OSyncPluginInfo *info, OSyncContext *ctx)
+/* walks the device's remapping reply and renames the matching commits */
+static void remap_contact_commits(plist_t reply, xmlHashTablePtr sent)
 {
+	plist_t remap = NULL;
+	plist_t key = NULL;
+	plist_t value = NULL;
+
+	if (!(remap = message_get_records(reply)))
+		return;
+
+	for (key = plist_get_first_child(remap); key; key = plist_get_next_sibling(value)) {
+		char *old_id = NULL;
+		char *new_id = NULL;
+		contact_commit *commit = NULL;
+
+		if (!(value = plist_get_next_sibling(key)))
+			break;
+		if (PLIST_KEY != plist_get_node_type(key) || PLIST_STRING != plist_get_node_type(value))
+			continue;
+
+		plist_get_key_val(key, &old_id);
+		plist_get_string_val(value, &new_id);
+		//attribute records are remapped too, only contacts matter here
+		if (old_id && new_id && (commit = xmlHashLookup(sent, BAD_CAST old_id)))
+			osync_change_set_uid(commit->change, new_id);
+		free(old_id);
+		free(new_id);
+	}
 }
 
-static void get_contact_changes(void *userdata, OSyncPluginInfo *info, OSyncContext *ctx)
+/*
+ * Sends up to env->commit_batch pending changes as one
+ * SDMessageProcessChanges message. The device answers with the ids it
+ * gave to new records, then every change of the batch gets its final
+ * uid and hash in one pass and its context answered.
+ */
+static osync_bool send_contact_commits(iphone_env *env, OSyncError **error)
 {
-	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p)", __func__, userdata, info, ctx);
+	OSyncHashTable *table = osync_objtype_sink_get_hashtable(env->contact_sink);
+	uint64_t start = sync_stats_now(env->stats);
+	contact_commit *commit = NULL;
+	contact_commit *last = NULL;
+	xmlHashTablePtr sent = NULL;
+	xmlHashTablePtr hashes = NULL;
+	xmlDocPtr batch_doc = NULL;
+	xmlNodePtr dict = NULL;
+	xmlChar *batch_xml = NULL;
+	int batch_size = 0;
+	plist_t records = NULL;
+	plist_t sent_records = NULL;
+	plist_t array = NULL;
+	int count = 0;
+	osync_bool result = FALSE;
+
+	//the stylesheet output has to go through XML text, the native records do not
+	sent = xmlHashCreate(env->commit_batch);
+	hashes = xmlHashCreate(env->commit_batch);
+	if (env->xslt_ctx_pcont_commit && (batch_doc = xmlNewDoc(BAD_CAST "1.0"))) {
+		xmlDocSetRootElement(batch_doc, xmlNewNode(NULL, BAD_CAST "plist"));
+		dict = xmlNewChild(xmlDocGetRootElement(batch_doc), NULL, BAD_CAST "dict", NULL);
+	}
+	else if (!env->xslt_ctx_pcont_commit)
+		records = plist_new_dict();
+	if (!sent || !hashes || (!dict && !records)) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate contact batch");
+		goto exit;
+	}
 
-	iphone_env *env = (iphone_env *)userdata;
-//	OSyncFormatEnv *formatenv = osync_plugin_info_get_format_env(info);
-//	OSyncObjTypeSink *sink = osync_plugin_info_get_sink(info);
+	for (commit = env->commits_first; commit && count < env->commit_batch; commit = commit->next, count++) {
+		if (dict ? !append_contact_records(env, dict, commit, error) : !append_native_records(records, commit, error))
+			goto exit;
+		xmlHashAddEntry(sent, BAD_CAST osync_change_get_uid(commit->change), commit);
+		last = commit;
+	}
 
+	if (dict) {
+		xmlDocDumpMemory(batch_doc, &batch_xml, &batch_size);
+		plist_from_xml((const char *) batch_xml, batch_size, &records);
+		if (!records) {
+			osync_error_set(error, OSYNC_ERROR_CONVERT, "Unable to build contact batch");
+			goto exit;
+		}
+	}
+	append_removed_attributes(env, records, env->commits_first, last);
+	//the message takes the records, the store needs them once the device renamed them
+	sent_records = plist_copy_container(records);
 
-	OSyncError *error = NULL;
-	iphone_error_t ret = IPHONE_E_UNKNOWN_ERROR;
+	array = plist_new_array();
+	plist_add_sub_string_el(array, "SDMessageProcessChanges");
+	plist_add_sub_string_el(array, "com.apple.Contacts");
+	plist_add_sub_node(array, records);
+	records = NULL;
+	//more changes follow this batch
+	plist_add_sub_bool_el(array, NULL != last->next);
+	plist_add_sub_string_el(array, EMPTY_PARAMETER_STRING);
 
-	plist_t array = build_contact_hello_msg(env);
-	ret = iphone_msync_send(env->msync, array);
+	send_message(env, &env->contact_channel, array);
 	plist_free(array);
 	array = NULL;
-	ret = iphone_msync_recv(env->msync, &array);
 
-	if ( IPHONE_E_SUCCESS == ret && array) {
+	if (IPHONE_E_SUCCESS != recv_message(env, &env->contact_channel, &array) || !array
+	    || !plist_find_node_by_string(array, "SDMessageRemapRecordIdentifiers")) {
+		osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Device did not accept contact changes");
+		goto exit;
+	}
+	remap_contact_commits(array, sent);
+	keep_sent_contacts(env, sent_records, array, hashes);
+
+	//the whole batch made it, answer it
+	for (; count > 0; count--) {
+		commit = env->commits_first;
+
+		//a contact that does not convert back gets no hash of ours and comes back modified once
+		if (OSYNC_CHANGE_TYPE_DELETED != osync_change_get_changetype(commit->change)) {
+			const char *hash = xmlHashLookup(hashes, BAD_CAST osync_change_get_uid(commit->change));
+			if (hash)
+				osync_change_set_hash(commit->change, hash);
+		}
+		pthread_mutex_lock(&env->report_lock);
+		osync_hashtable_update_change(table, commit->change);
+		osync_context_report_success(commit->ctx);
+		pthread_mutex_unlock(&env->report_lock);
+		sync_stats_count(env->stats, STATS_CHANGES_COMMITTED, 1);
+
+		env->commits_first = commit->next;
+		contact_commit_release(commit);
+	}
+	if (!env->commits_first)
+		env->commits_last = NULL;
+	result = TRUE;
 
-		char* old_timestamp = NULL;
-		char* new_timestamp = NULL;
-		session_type type;
-		get_session_type_and_timestamp (array, "com.apple.Contacts", &old_timestamp, &new_timestamp, &type);
+exit:
+	if (array)
 		plist_free(array);
-		array = NULL;
+	if (records)
+		plist_free(records);
+	if (sent_records)
+		plist_free(sent_records);
+	if (batch_xml)
+		xmlFree(batch_xml);
+	if (batch_doc)
+		xmlFreeDoc(batch_doc);
+	if (sent)
+		xmlHashFree(sent, NULL);
+	if (hashes)
+		xmlHashFree(hashes, (xmlHashDeallocator) osync_free);
+	sync_stats_time(env->stats, STATS_COMMIT, start);
+	return result;
+}
+
+static osync_bool commit_xmlformat(iphone_env *env, OSyncChange *change, OSyncError **error)
+{
+	OSyncData *odata = osync_change_get_data(change);
+	OSyncXMLFormat *xmlformat = NULL;
+	char *data = NULL;
+	unsigned int size = 0;
+
+	if (strcmp(osync_objformat_get_name(osync_data_get_objformat(odata)), PCONT_RAW_FORMAT))
+		return TRUE;
 
-		if (SLOW_SYNC == type)
-			slow_contact_sync(env, info, ctx);
-		else 
-			fast_contact_sync(env, info, ctx);
+	osync_data_get_data(odata, &data, &size);
+	if (!(xmlformat = pcont_raw_convert(data, size, error)))
+		return FALSE;
+	osync_xmlformat_sort(xmlformat);
+
+	//osync_data_set_data() does not release the old buffer
+	osync_data_set_data(odata, (char *) xmlformat, osync_xmlformat_size());
+	osync_data_set_objformat(odata, env->contact_format);
+	osync_free(data);
+	return TRUE;
+}
+
+static void commit_contact_change(void *userdata, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *change)
+{
+	iphone_env *env = (iphone_env *)userdata;
+	OSyncError *error = NULL;
+	contact_commit *commit = NULL;
+
+	//the device only gets changes once committed_all() sends the batches
+	//raw records from another device, the commit path works on xmlformat
+	if (OSYNC_CHANGE_TYPE_DELETED != osync_change_get_changetype(change) && !commit_xmlformat(env, change, &error))
+		goto error;
+
+	if (!(commit = arena_alloc(env->arena, sizeof(contact_commit)))) {
+		osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to queue contact change");
+		goto error;
 	}
 
-	//Now we need to answer the call
-	osync_context_report_success(ctx);
-	osync_trace(TRACE_EXIT, "%s", __func__);
-	return;
+	osync_change_ref(change);
+	commit->change = change;
+	osync_context_ref(ctx);
+	commit->ctx = ctx;
 
-error :
-	osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Synchronisation failed");
+	if (env->commits_last)
+		env->commits_last->next = commit;
+	else
+		env->commits_first = commit;
+	env->commits_last = commit;
 	return;
+
+error:
+	answer_context(env, ctx, error);
+	osync_error_unref(&error);
 }
 
-static void commit_contact_change(void *userdata, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *change)
+/* never called, the calendar sink is read only */
+static void commit_calendar_change(void *userdata, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *change)
+{
+	osync_context_report_error(ctx, OSYNC_ERROR_NOT_SUPPORTED, "Writing events to the device is not supported");
+}
+
+static void committed_all(void *userdata, OSyncPluginInfo *info, OSyncContext *ctx)
 {
 	iphone_env *env = (iphone_env *)userdata;
-	OSyncObjTypeSink *sink = osync_plugin_info_get_sink(info);
-	
-	/*
-	 * Here you have to add, modify or delete a object
-	 * 
-	 */
-// 	switch (osync_change_get_changetype(change)) {
-// 		case OSYNC_CHANGE_TYPE_DELETED:
-// 			//Delete the change
-// 			//Dont forget to answer the call on error
-// 			break;
-// 		case OSYNC_CHANGE_TYPE_ADDED:
-// 			//Add the change
-// 			//Dont forget to answer the call on error
-// 			osync_change_set_hash(change, "new hash");
-// 			break;
-// 		case OSYNC_CHANGE_TYPE_MODIFIED:
-// 			//Modify the change
-// 			//Dont forget to answer the call on error
-// 			osync_change_set_hash(change, "new hash");
-// 			break;
-// 		default:
-// 			;
-// 	}
-// 
-// 	//If you are using hashtables you have to calculate the hash here:
-// 	osync_hashtable_update_change(sinkenv->hashtable, change);
+	msync_channel *channel = &env->contact_channel;
+	OSyncError *error = NULL;
+	osync_bool result = TRUE;
 
-	//Answer the call
-	osync_context_report_success(ctx);
+	join_channel_worker(channel);
+	if (env->commits_first && !channel->session_open) {
+		osync_error_set(&error, OSYNC_ERROR_GENERIC, "Device is not waiting for changes");
+		result = FALSE;
+	}
+
+	while (result && env->commits_first)
+		result = send_contact_commits(env, &error);
+
+	//changes that never made it to the device
+	fail_contact_commits(env, error);
+
+	if (channel->session_open && !finish_session(env, channel) && result) {
+		osync_error_set(&error, OSYNC_ERROR_IO_ERROR, "Failed to finish session on device");
+		result = FALSE;
+	}
+
+	answer_context(env, ctx, result ? NULL : error);
+	if (error)
+		osync_error_unref(&error);
 }
 
 static void sync_done(void *userdata, OSyncPluginInfo *info, OSyncContext *ctx)
@@ -486,18 +3019,58 @@ static void sync_done(void *userdata, OSyncPluginInfo *info, OSyncContext *ctx)
 	/*
 	 * This function will only be called if the sync was successful
 	 */
+	iphone_env *env = (iphone_env *)userdata;
 	OSyncError *error = NULL;
 	OSyncObjTypeSink *sink = osync_plugin_info_get_sink(info);
-	
-	//If we use anchors we have to update it now.
-	//Now you get/calculate the current anchor of the device
-// 	char *lanchor = NULL;
-// 	char *anchorpath = osync_strdup_printf("%s/anchor.db", osync_plugin_info_get_configdir(info));
-// 	osync_anchor_update(anchorpath, "lanchor", lanchor);
-// 	osync_free(anchorpath);
-	//Save hashtable to database
+	msync_channel *channel = sink_channel(env, info);
+
+	//the device finished the session, next time it can be a fast one
+	if (channel->next_anchor) {
+		if (!osync_anchor_update(osync_objtype_sink_get_anchor(sink), channel->next_anchor, &error))
+			goto error;
+		osync_free(channel->next_anchor);
+		channel->next_anchor = NULL;
+	}
+
+	//a cache that could not be written only costs conversions next time
+	if (env->contact_cache) {
+		if (!contact_cache_save(env->contact_cache, &error)) {
+			osync_trace(TRACE_INTERNAL, "%s", osync_error_print(&error));
+			osync_error_unref(&error);
+		}
+		contact_cache_close(env->contact_cache);
+		env->contact_cache = NULL;
+	}
+	if (channel == &env->contact_channel) {
+		batch_journal_discard(env->contact_journal);
+		env->contact_journal = NULL;
+		close_quarantine(env);
+
+		//stale records would corrupt the next fast session, better none
+		if (env->record_store && !contact_cache_save(env->record_store, &error)) {
+			osync_trace(TRACE_INTERNAL, "%s", osync_error_print(&error));
+			osync_error_unref(&error);
+			drop_record_store(env);
+		}
+		contact_cache_close(env->record_store);
+		env->record_store = NULL;
+		if (env->store_is_new && rename(env->store_new_path, env->store_path) && ENOENT != errno)
+			osync_trace(TRACE_INTERNAL, "unable to keep %s: %s\n", env->store_path, strerror(errno));
+		env->store_is_new = FALSE;
+	}
+
+	//every sink is done once, the last one leaves the complete figures
+	if (!sync_stats_write(env->stats, env->stats_path, "success", &error)) {
+		osync_trace(TRACE_INTERNAL, "%s", osync_error_print(&error));
+		osync_error_unref(&error);
+	}
+	env->stats_written = TRUE;
+	env->sync_completed = TRUE;
+
+	//every sink calls this, only release once nothing points into the arena
+	if (!env->commits_first)
+		arena_reset(env->arena);
 
-	
 	//Answer the call
 	osync_context_report_success(ctx);
 	return;
@@ -511,14 +3084,60 @@ static void disconnect(void *userdata, OSyncPluginInfo *info, OSyncContext *ctx)
 {
 	//Close all stuff you need to close
 	iphone_env *env = (iphone_env *)userdata;
+	msync_channel *channel = sink_channel(env, info);
+
+	join_channel_worker(channel);
+	if (!env->sync_completed)
+		env->link_idle = FALSE;
+
+	//no commit phase ran, do not leave the device waiting
+	if (channel->session_open && !finish_session(env, channel))
+		env->link_idle = FALSE;
+	if (channel == &env->contact_channel) {
+		fail_contact_commits(env, NULL);
+		//only a successful sync keeps what it cached
+		contact_cache_close(env->contact_cache);
+		env->contact_cache = NULL;
+		//a broken off sync keeps its journal for the next one
+		batch_journal_close(env->contact_journal);
+		env->contact_journal = NULL;
+		close_quarantine(env);
+		//the changes of a fast session come again and apply the same, the store of a slow one is unfinished
+		contact_cache_close(env->record_store);
+		env->record_store = NULL;
+		if (env->store_is_new)
+			unlink(env->store_new_path);
+		env->store_is_new = FALSE;
+	}
+
+	if (channel->transport)
+		env->connected_sinks--;
+	close_channel(channel);
+
+	//the device link goes with the last sink
+	if (env->connected_sinks > 0) {
+		osync_context_report_success(ctx);
+		return;
+	}
+	arena_reset(env->arena);
+
+	//sync_done() never came, the figures still tell how far it got
+	if (env->stats && !env->stats_written) {
+		OSyncError *error = NULL;
+		if (!sync_stats_write(env->stats, env->stats_path, "failed", &error)) {
+			osync_trace(TRACE_INTERNAL, "%s", osync_error_print(&error));
+			osync_error_unref(&error);
+		}
+		env->stats_written = TRUE;
+	}
+
+	//a link is only kept once the device is back to waiting for a session
+	if (env->keep_alive && env->link && env->link_idle)
+		device_link_hold(env->link);
+	else
+		device_link_close(env->link);
+	env->link = NULL;
 
-	iphone_msync_free_client(env->msync);
-	env->msync = NULL;
-	iphone_lckd_free_client(env->lckd);
-	env->lckd = NULL;
-	iphone_free_device(env->device);
-	env->device = NULL;
-	
 	//Answer the call
 	osync_context_report_success(ctx);
 }
@@ -532,6 +3151,62 @@ static void finalize(void *userdata)
 }
 
 
+static osync_bool get_advanced_option_bool(OSyncPluginConfig *config, const char *name, osync_bool def)
+{
+	OSyncPluginAdvancedOption *option = osync_plugin_config_get_advancedoption_value_by_name(config, name);
+	const char *value = NULL;
+
+	if (!option || !(value = osync_plugin_advancedoption_get_value(option)))
+		return def;
+
+	return !strcmp(value, "1") || !strcasecmp(value, "true");
+}
+
+static int get_advanced_option_int(OSyncPluginConfig *config, const char *name, int def)
+{
+	OSyncPluginAdvancedOption *option = osync_plugin_config_get_advancedoption_value_by_name(config, name);
+	const char *value = NULL;
+	int result = 0;
+
+	if (!option || !(value = osync_plugin_advancedoption_get_value(option)))
+		return def;
+
+	result = atoi(value);
+	return result > 0 ? result : def;
+}
+
+/* a copy of a non empty option value, or NULL */
+static char *get_advanced_option_string(OSyncPluginConfig *config, const char *name)
+{
+	OSyncPluginAdvancedOption *option = osync_plugin_config_get_advancedoption_value_by_name(config, name);
+	const char *value = NULL;
+
+	if (!option || !(value = osync_plugin_advancedoption_get_value(option)) || !*value)
+		return NULL;
+	return osync_strdup(value);
+}
+
+/* "auto" or 0 sizes the pool to the online cores, unset means a single thread */
+static int get_advanced_option_workers(OSyncPluginConfig *config, const char *name)
+{
+	OSyncPluginAdvancedOption *option = osync_plugin_config_get_advancedoption_value_by_name(config, name);
+	const char *value = NULL;
+	long workers = 1;
+
+	if (!option || !(value = osync_plugin_advancedoption_get_value(option)))
+		return 1;
+
+	if (!strcasecmp(value, "auto") || !(workers = strtol(value, NULL, 10)))
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1)
+		workers = 1;
+	if (workers > MAX_WORKERS)
+		workers = MAX_WORKERS;
+
+	osync_trace(TRACE_INTERNAL, "using %ld contact workers\n", workers);
+	return (int) workers;
+}
+
 static void *initialize(OSyncPlugin *plugin, OSyncPluginInfo *info, OSyncError **error)
 {
 	/*
@@ -550,6 +3225,7 @@ static void *initialize(OSyncPlugin *plugin, OSyncPluginInfo *info, OSyncError *
 	if (!env)
 		goto error;
 	memset(env, 0, sizeof(iphone_env));
+	pthread_mutex_init(&env->report_lock, NULL);
 
 	osync_trace(TRACE_INTERNAL, "The config: %s", osync_plugin_info_get_config(info));
 
@@ -560,14 +3236,66 @@ static void *initialize(OSyncPlugin *plugin, OSyncPluginInfo *info, OSyncError *
 	 * Process plugin specific advanced options 
 	 */
 	OSyncPluginAdvancedOption *advanced = osync_plugin_config_get_advancedoption_value_by_name(config, "xslt");
-	if (!advanced) {
-		osync_trace(TRACE_INTERNAL, "Cannot locate xslt config!\n");
-		goto error_free_env;
+	const char *xslt_path = advanced ? osync_plugin_advancedoption_get_value(advanced) : NULL;
+	if (xslt_path && strlen(xslt_path) > 0) {
+		if (!(env->xslt_path = strdup(xslt_path)))
+			goto error_free_env;
 	}
+	else
+		osync_trace(TRACE_INTERNAL, "No xslt config, using native contact converter\n");
+
+	env->streaming = get_advanced_option_bool(config, "streaming", FALSE);
+	env->receive_thread = get_advanced_option_bool(config, "receive_thread", FALSE);
+	env->workers = get_advanced_option_workers(config, "workers");
+	env->commit_batch = get_advanced_option_int(config, "commit_batch", DEFAULT_COMMIT_BATCH);
+	env->record_cache = get_advanced_option_bool(config, "record_cache", FALSE);
+	if (env->record_cache && !(env->cache_path = osync_strdup_printf("%s/contact_cache.db", osync_plugin_info_get_configdir(info))))
+		goto error_free_env;
+	if (!(env->store_path = osync_strdup_printf("%s/contact_records.db", osync_plugin_info_get_configdir(info))))
+		goto error_free_env;
+	if (!(env->store_new_path = osync_strdup_printf("%s.new", env->store_path)))
+		goto error_free_env;
+
+	//stand-ins for the device, and a capture of whatever is used
+	env->emulator = get_advanced_option_string(config, "emulator");
+	env->replay_path = get_advanced_option_string(config, "replay");
+	env->capture_path = get_advanced_option_string(config, "capture");
+	env->link_latency = get_advanced_option_int(config, "link_latency", 0);
+
+	//contacts and calendars over their own MobileSync connections at once
+	env->parallel = get_advanced_option_bool(config, "parallel_dataclasses", FALSE);
+
+	//one plugin instance per device when several are attached
+	env->device_uuid = get_advanced_option_string(config, "device_uuid");
 
-	if (!(env->xslt_path = strdup(osync_plugin_advancedoption_get_value(advanced))))
+	//hold the device link between syncs of the same device
+	env->keep_alive = get_advanced_option_bool(config, "keep_alive", FALSE);
+	if (env->keep_alive)
+		device_link_pool_ref();
+
+	//in megabytes, past it the whole dump is spooled to disk
+	env->memory_limit = (size_t) get_advanced_option_int(config, "memory_limit", 0) << 20;
+
+	//a contact that does not convert no longer fails the whole sink
+	if (get_advanced_option_bool(config, "skip_bad_records", FALSE)
+	    && !(env->quarantine_path = osync_strdup_printf("%s/contact_quarantine.xml", osync_plugin_info_get_configdir(info))))
+		goto error_free_env;
+
+	//converted batches of a slow sync survive an interruption
+	if (get_advanced_option_bool(config, "resume_journal", FALSE)
+	    && !(env->journal_path = osync_strdup_printf("%s/contact_journal.bin", osync_plugin_info_get_configdir(info))))
 		goto error_free_env;
 
+	if (!(env->arena = arena_new(0, error)))
+		goto error_free_env;
+
+	if (get_advanced_option_bool(config, "stats", FALSE)) {
+		if (!(env->stats = sync_stats_new(error)))
+			goto error_free_env;
+		if (!(env->stats_path = osync_strdup_printf("%s/sync_stats.json", osync_plugin_info_get_configdir(info))))
+			goto error_free_env;
+	}
+
 
 	//allocate contact sink
 	OSyncObjTypeSinkFunctions functions_contact;
@@ -575,6 +3303,7 @@ static void *initialize(OSyncPlugin *plugin, OSyncPluginInfo *info, OSyncError *
 	functions_contact.connect = connect;
 	functions_contact.get_changes = get_contact_changes;
 	functions_contact.commit = commit_contact_change;
+	functions_contact.committed_all = committed_all;
 	functions_contact.disconnect = disconnect;
 	functions_contact.sync_done = sync_done;
 
@@ -587,6 +3316,27 @@ static void *initialize(OSyncPlugin *plugin, OSyncPluginInfo *info, OSyncError *
 	}
 	osync_objformat_ref(env->contact_format);
 
+	//needs the iphone-format plugin next to this one
+	if (get_advanced_option_bool(config, "raw_format", FALSE)) {
+		if (!(env->raw_format = osync_format_env_find_objformat(formatenv, PCONT_RAW_FORMAT))) {
+			osync_error_set(error, OSYNC_ERROR_GENERIC, "Failed to find objformat %s", PCONT_RAW_FORMAT);
+			goto error_free_env;
+		}
+		osync_objformat_ref(env->raw_format);
+	}
+
+	/*
+	 * Only the whole dump stylesheet holds the raw address book at once.
+	 * The other converters drop each batch once fed, what they keep is the
+	 * converted contacts, which a spool of raw batches would not shrink.
+	 */
+	if (env->memory_limit && (!env->xslt_path || env->streaming || env->raw_format)) {
+		osync_trace(TRACE_INTERNAL, "memory_limit only applies to the whole dump stylesheet, ignored\n");
+		env->memory_limit = 0;
+	}
+	if (env->memory_limit && !(env->spool_path = osync_strdup_printf("%s/contact_spool.bin", osync_plugin_info_get_configdir(info))))
+		goto error_free_env;
+
 	env->contact_sink = osync_plugin_info_find_objtype(info, "contact");
 	if (!env->contact_sink) {
 		osync_trace(TRACE_ERROR, "%s", "Failed to find objtype contact!");
@@ -595,12 +3345,44 @@ static void *initialize(OSyncPlugin *plugin, OSyncPluginInfo *info, OSyncError *
 
 	osync_objtype_sink_set_functions(env->contact_sink, functions_contact, env);
 	osync_objtype_sink_enable_anchor(env->contact_sink, TRUE);
+	osync_objtype_sink_enable_hashtable(env->contact_sink, TRUE);
 	osync_plugin_info_add_objtype(info, env->contact_sink);
 
-	if (!(env->xslt_ctx_pcont = xslt_new()))
-		goto error_free_env;
-	else
-		osync_trace(TRACE_INTERNAL, "\tsucceed creating xslt_pcont!\n");
+	//allocate calendar sink, read only for now
+	OSyncObjTypeSinkFunctions functions_calendar;
+	memset(&functions_calendar, 0, sizeof(OSyncObjTypeSinkFunctions));
+	functions_calendar.connect = connect;
+	functions_calendar.get_changes = get_calendar_changes;
+	functions_calendar.commit = commit_calendar_change;
+	functions_calendar.disconnect = disconnect;
+	functions_calendar.sync_done = sync_done;
+
+	env->calendar_sink = osync_plugin_info_find_objtype(info, "event");
+	if (env->calendar_sink) {
+		osync_trace(TRACE_INTERNAL, "\tcreating calendar sink...\n");
+		env->calendar_format = osync_format_env_find_objformat(formatenv, "xmlformat-event");
+		if (!env->calendar_format) {
+			osync_trace(TRACE_ERROR, "%s", "Failed to find objformat xmlformat-event!");
+			goto error_free_env;
+		}
+		osync_objformat_ref(env->calendar_format);
+
+		osync_objtype_sink_set_functions(env->calendar_sink, functions_calendar, env);
+		osync_objtype_sink_enable_anchor(env->calendar_sink, TRUE);
+		osync_objtype_sink_enable_hashtable(env->calendar_sink, TRUE);
+		//events are only read, the engine must not route changes from other members here
+		osync_objtype_sink_set_write(env->calendar_sink, FALSE);
+		osync_plugin_info_add_objtype(info, env->calendar_sink);
+	}
+
+	if (env->xslt_path) {
+		if (!(env->xslt_ctx_pcont = xslt_new()))
+			goto error_free_env;
+		else
+			osync_trace(TRACE_INTERNAL, "\tsucceed creating xslt_pcont!\n");
+		if (!(env->xslt_ctx_pcont_commit = xslt_new()))
+			goto error_free_env;
+	}
 
 	//Now your return your struct.
 	return (void *) env;
@@ -625,6 +3407,9 @@ static osync_bool discover(OSyncPluginInfo *info, void *userdata, OSyncError **e
 		return FALSE;
 	}
 	osync_objtype_sink_set_available(sink, TRUE);
+
+	if ((sink = osync_plugin_info_find_objtype(info, "event")))
+		osync_objtype_sink_set_available(sink, TRUE);
 	
 	OSyncVersion *version = osync_version_new(error);
 	osync_version_set_plugin(version, "iphone-sync");
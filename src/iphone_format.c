@@ -0,0 +1,112 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/**
+ * @file   iphone_format.c
+ *
+ * @brief  The iphone-contact objformat and its converter to xmlformat-contact.
+ *
+ * The sync plugin reports contacts in this format when raw_format is
+ * set, so the engine only pays for a conversion on the records it
+ * actually maps or writes to the other side.
+ */
+
+#include <opensync/opensync.h>
+#include <opensync/opensync-format.h>
+#include <opensync/opensync-xmlformat.h>
+
+#include <string.h>
+
+#include "pcont_raw.h"
+
+static OSyncConvCmpResult compare_raw_contact(const char *leftdata, unsigned int leftsize, const char *rightdata, unsigned int rightsize)
+{
+	//the same device records serialize to the same bytes
+	if (leftsize == rightsize && !memcmp(leftdata, rightdata, leftsize))
+		return OSYNC_CONV_DATA_SAME;
+	return OSYNC_CONV_DATA_MISMATCH;
+}
+
+static void destroy_raw_contact(char *input, unsigned int inpsize)
+{
+	osync_free(input);
+}
+
+static osync_bool copy_raw_contact(const char *input, unsigned int inpsize, char **output, unsigned int *outpsize, OSyncError **error)
+{
+	if (!(*output = osync_try_malloc0(inpsize, error)))
+		return FALSE;
+	memcpy(*output, input, inpsize);
+	*outpsize = inpsize;
+	return TRUE;
+}
+
+static osync_bool conv_raw_contact_to_xmlformat(char *input, unsigned int inpsize, char **output, unsigned int *outpsize, osync_bool *free_input, const char *config, void *userdata, OSyncError **error)
+{
+	OSyncXMLFormat *xmlformat = pcont_raw_convert(input, inpsize, error);
+	if (!xmlformat)
+		return FALSE;
+
+	osync_xmlformat_sort(xmlformat);
+	*output = (char *) xmlformat;
+	*outpsize = osync_xmlformat_size();
+	*free_input = TRUE;
+	return TRUE;
+}
+
+osync_bool get_format_info(OSyncFormatEnv *env, OSyncError **error)
+{
+	OSyncObjFormat *format = osync_objformat_new(PCONT_RAW_FORMAT, "contact", error);
+	if (!format)
+		return FALSE;
+
+	osync_objformat_set_compare_func(format, compare_raw_contact);
+	osync_objformat_set_destroy_func(format, destroy_raw_contact);
+	osync_objformat_set_copy_func(format, copy_raw_contact);
+
+	osync_format_env_register_objformat(env, format);
+	osync_objformat_unref(format);
+	return TRUE;
+}
+
+osync_bool get_conversion_info(OSyncFormatEnv *env, OSyncError **error)
+{
+	OSyncObjFormat *raw = osync_format_env_find_objformat(env, PCONT_RAW_FORMAT);
+	OSyncObjFormat *xmlformat = osync_format_env_find_objformat(env, "xmlformat-contact");
+	OSyncFormatConverter *conv = NULL;
+
+	if (!raw || !xmlformat) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to find the %s and xmlformat-contact formats", PCONT_RAW_FORMAT);
+		return FALSE;
+	}
+
+	if (!(conv = osync_converter_new(OSYNC_CONVERTER_CONV, raw, xmlformat, conv_raw_contact_to_xmlformat, error)))
+		return FALSE;
+	osync_format_env_register_converter(env, conv);
+	osync_converter_unref(conv);
+	return TRUE;
+}
+
+int get_version(void)
+{
+	return 1;
+}
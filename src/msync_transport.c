@@ -0,0 +1,381 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+#include "msync_transport.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct msync_transport {
+	iphone_error_t (*send)(msync_transport *transport, plist_t plist);
+	iphone_error_t (*recv)(msync_transport *transport, plist_t *plist);
+	void (*free)(msync_transport *transport);
+	/* milliseconds added to every message */
+	int latency;
+	/* device client, not owned */
+	iphone_msync_client_t msync;
+	/* socket, replay or capture file */
+	int fd;
+	/* transport being captured */
+	msync_transport *inner;
+	/* framed bytes read so far */
+	uint64_t received;
+};
+
+static osync_bool write_all(int fd, const void *data, size_t size)
+{
+	const char *p = data;
+
+	while (size > 0) {
+		ssize_t written = write(fd, p, size);
+		if (written < 0 && EINTR == errno)
+			continue;
+		if (written <= 0)
+			return FALSE;
+		p += written;
+		size -= written;
+	}
+	return TRUE;
+}
+
+static osync_bool read_all(int fd, void *data, size_t size)
+{
+	char *p = data;
+
+	while (size > 0) {
+		ssize_t got = read(fd, p, size);
+		if (got < 0 && EINTR == errno)
+			continue;
+		if (got <= 0)
+			return FALSE;
+		p += got;
+		size -= got;
+	}
+	return TRUE;
+}
+
+osync_bool msync_frame_write(int fd, char tag, plist_t plist)
+{
+	char *xml = NULL;
+	uint32_t length = 0;
+	unsigned char header[4];
+	osync_bool result = FALSE;
+
+	plist_to_xml(plist, &xml, &length);
+	if (!xml)
+		return FALSE;
+
+	header[0] = length >> 24;
+	header[1] = length >> 16;
+	header[2] = length >> 8;
+	header[3] = length;
+
+	result = (!tag || write_all(fd, &tag, 1))
+		&& write_all(fd, header, sizeof(header))
+		&& write_all(fd, xml, length);
+	free(xml);
+	return result;
+}
+
+static osync_bool read_frame(int fd, char *tag, plist_t *plist, uint64_t *received)
+{
+	unsigned char header[4];
+	uint32_t length = 0;
+	char *xml = NULL;
+
+	*plist = NULL;
+	if (tag && !read_all(fd, tag, 1))
+		return FALSE;
+	if (!read_all(fd, header, sizeof(header)))
+		return FALSE;
+
+	length = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+	if (!(xml = malloc(length)))
+		return FALSE;
+	if (read_all(fd, xml, length))
+		plist_from_xml(xml, length, plist);
+	free(xml);
+
+	if (received)
+		*received += sizeof(header) + length;
+	return NULL != *plist;
+}
+
+osync_bool msync_frame_read(int fd, char *tag, plist_t *plist)
+{
+	return read_frame(fd, tag, plist, NULL);
+}
+
+static msync_transport *transport_new(OSyncError **error)
+{
+	msync_transport *transport = osync_try_malloc0(sizeof(msync_transport), error);
+	if (transport)
+		transport->fd = -1;
+	return transport;
+}
+
+static void close_free(msync_transport *transport)
+{
+	if (transport->fd >= 0)
+		close(transport->fd);
+	msync_transport_free(transport->inner);
+}
+
+static iphone_error_t device_send(msync_transport *transport, plist_t plist)
+{
+	return iphone_msync_send(transport->msync, plist);
+}
+
+static iphone_error_t device_recv(msync_transport *transport, plist_t *plist)
+{
+	return iphone_msync_recv(transport->msync, plist);
+}
+
+msync_transport *msync_transport_new_device(iphone_msync_client_t msync, OSyncError **error)
+{
+	msync_transport *transport = transport_new(error);
+	if (!transport)
+		return NULL;
+
+	transport->send = device_send;
+	transport->recv = device_recv;
+	transport->msync = msync;
+	return transport;
+}
+
+static iphone_error_t socket_send(msync_transport *transport, plist_t plist)
+{
+	return msync_frame_write(transport->fd, 0, plist) ? IPHONE_E_SUCCESS : IPHONE_E_UNKNOWN_ERROR;
+}
+
+static iphone_error_t socket_recv(msync_transport *transport, plist_t *plist)
+{
+	return read_frame(transport->fd, NULL, plist, &transport->received) ? IPHONE_E_SUCCESS : IPHONE_E_UNKNOWN_ERROR;
+}
+
+static int connect_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd = -1;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int connect_tcp(const char *address)
+{
+	struct addrinfo hints;
+	struct addrinfo *addrs = NULL;
+	struct addrinfo *ai = NULL;
+	char *host = strdup(address);
+	char *port = NULL;
+	int fd = -1;
+
+	if (!host || !(port = strrchr(host, ':'))) {
+		free(host);
+		return -1;
+	}
+	*port++ = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (!getaddrinfo(*host ? host : NULL, port, &hints, &addrs)) {
+		for (ai = addrs; ai && fd < 0; ai = ai->ai_next) {
+			if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+				continue;
+			if (connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		freeaddrinfo(addrs);
+	}
+	free(host);
+	return fd;
+}
+
+msync_transport *msync_transport_new_socket(const char *address, OSyncError **error)
+{
+	msync_transport *transport = transport_new(error);
+	if (!transport)
+		return NULL;
+
+	transport->send = socket_send;
+	transport->recv = socket_recv;
+	transport->free = close_free;
+
+	if (!strncmp(address, "unix:", 5))
+		transport->fd = connect_unix(address + 5);
+	else
+		transport->fd = connect_tcp(address);
+
+	if (transport->fd < 0) {
+		osync_error_set(error, OSYNC_ERROR_NO_CONNECTION, "Unable to connect to MobileSync emulator at %s", address);
+		msync_transport_free(transport);
+		return NULL;
+	}
+	return transport;
+}
+
+/* the next recorded message, which has to go in the direction asked for */
+static iphone_error_t replay_next(msync_transport *transport, char direction, plist_t *plist)
+{
+	char tag = 0;
+
+	if (!read_frame(transport->fd, &tag, plist, 'R' == direction ? &transport->received : NULL))
+		return IPHONE_E_UNKNOWN_ERROR;
+	if (tag != direction) {
+		osync_trace(TRACE_INTERNAL, "replay out of step, expected '%c' and got '%c'\n", direction, tag);
+		plist_free(*plist);
+		*plist = NULL;
+		return IPHONE_E_UNKNOWN_ERROR;
+	}
+	return IPHONE_E_SUCCESS;
+}
+
+static iphone_error_t replay_send(msync_transport *transport, plist_t plist)
+{
+	plist_t recorded = NULL;
+	iphone_error_t ret = replay_next(transport, 'S', &recorded);
+
+	//the content of what we send may differ from the capture, only its place matters
+	if (recorded)
+		plist_free(recorded);
+	return ret;
+}
+
+static iphone_error_t replay_recv(msync_transport *transport, plist_t *plist)
+{
+	return replay_next(transport, 'R', plist);
+}
+
+msync_transport *msync_transport_new_replay(const char *path, OSyncError **error)
+{
+	msync_transport *transport = transport_new(error);
+	if (!transport)
+		return NULL;
+
+	transport->send = replay_send;
+	transport->recv = replay_recv;
+	transport->free = close_free;
+
+	if ((transport->fd = open(path, O_RDONLY)) < 0) {
+		osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to open capture %s: %s", path, strerror(errno));
+		msync_transport_free(transport);
+		return NULL;
+	}
+	return transport;
+}
+
+static iphone_error_t capture_send(msync_transport *transport, plist_t plist)
+{
+	iphone_error_t ret = msync_transport_send(transport->inner, plist);
+
+	if (IPHONE_E_SUCCESS == ret && !msync_frame_write(transport->fd, 'S', plist))
+		osync_trace(TRACE_INTERNAL, "unable to capture sent message\n");
+	return ret;
+}
+
+static iphone_error_t capture_recv(msync_transport *transport, plist_t *plist)
+{
+	iphone_error_t ret = msync_transport_recv(transport->inner, plist);
+
+	if (IPHONE_E_SUCCESS == ret && *plist && !msync_frame_write(transport->fd, 'R', *plist))
+		osync_trace(TRACE_INTERNAL, "unable to capture received message\n");
+	return ret;
+}
+
+msync_transport *msync_transport_new_capture(msync_transport *inner, const char *path, OSyncError **error)
+{
+	msync_transport *transport = transport_new(error);
+	if (!transport) {
+		msync_transport_free(inner);
+		return NULL;
+	}
+
+	transport->send = capture_send;
+	transport->recv = capture_recv;
+	transport->free = close_free;
+	transport->inner = inner;
+
+	if ((transport->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+		osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to create capture %s: %s", path, strerror(errno));
+		msync_transport_free(transport);
+		return NULL;
+	}
+	return transport;
+}
+
+void msync_transport_set_latency(msync_transport *transport, int latency)
+{
+	transport->latency = latency > 0 ? latency : 0;
+}
+
+iphone_error_t msync_transport_send(msync_transport *transport, plist_t plist)
+{
+	if (transport->latency)
+		usleep(transport->latency * 1000);
+	return transport->send(transport, plist);
+}
+
+iphone_error_t msync_transport_recv(msync_transport *transport, plist_t *plist)
+{
+	if (transport->latency)
+		usleep(transport->latency * 1000);
+	return transport->recv(transport, plist);
+}
+
+uint64_t msync_transport_get_received(msync_transport *transport)
+{
+	if (transport->inner)
+		return msync_transport_get_received(transport->inner);
+	return transport->received;
+}
+
+void msync_transport_free(msync_transport *transport)
+{
+	if (!transport)
+		return;
+	if (transport->free)
+		transport->free(transport);
+	osync_free(transport);
+}
@@ -0,0 +1,79 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/**
+ * @file   msync_transport.h
+ *
+ * @brief  Where MobileSync messages go and come from.
+ *
+ * The plugin only talks to the device through msync_transport_send()
+ * and msync_transport_recv(). Besides the device itself, a transport can
+ * be a socket to a local emulator or a replay of a captured session, and
+ * any transport can be wrapped to capture its messages to a file. Every
+ * message can be delayed to emulate a slower link.
+ *
+ * Over a socket and in capture files, a message is framed as a 4 byte
+ * big endian length followed by the XML plist. Capture records are
+ * prefixed with 'S' for sent and 'R' for received messages.
+ */
+
+#ifndef __MSYNC_TRANSPORT__
+#define __MSYNC_TRANSPORT__
+
+#include <opensync/opensync.h>
+
+#include <libiphone/libiphone.h>
+#include <plist/plist.h>
+
+#include <stdint.h>
+
+typedef struct msync_transport msync_transport;
+
+/* talks to the device through an already started MobileSync client, which stays owned by the caller */
+msync_transport *msync_transport_new_device(iphone_msync_client_t msync, OSyncError **error);
+
+/* connects to an emulator, address is "host:port" or "unix:<path>" */
+msync_transport *msync_transport_new_socket(const char *address, OSyncError **error);
+
+/* plays back a capture, answering the messages sent in the same order as recorded */
+msync_transport *msync_transport_new_replay(const char *path, OSyncError **error);
+
+/* records every message going through inner to path, takes ownership of inner */
+msync_transport *msync_transport_new_capture(msync_transport *inner, const char *path, OSyncError **error);
+
+/* delays every message by latency milliseconds */
+void msync_transport_set_latency(msync_transport *transport, int latency);
+
+iphone_error_t msync_transport_send(msync_transport *transport, plist_t plist);
+iphone_error_t msync_transport_recv(msync_transport *transport, plist_t *plist);
+
+/* bytes received so far, only known when the transport does the framing itself */
+uint64_t msync_transport_get_received(msync_transport *transport);
+
+void msync_transport_free(msync_transport *transport);
+
+/* framing shared with the emulator, a 0 tag writes an untagged frame, plist stays owned by the caller */
+osync_bool msync_frame_write(int fd, char tag, plist_t plist);
+/* reads one frame, tag may be NULL when frames are not tagged */
+osync_bool msync_frame_read(int fd, char *tag, plist_t *plist);
+
+#endif
@@ -0,0 +1,553 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+#include "pcal_conv.h"
+#include "plist_aux.h"
+
+#include <opensync/opensync-time.h>
+
+#include <libxml/hash.h>
+
+#include <ctype.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ENTITY_KEY "com.apple.syncservices.RecordEntityName"
+#define EVENT_ENTITY "com.apple.calendars.Event"
+#define RECURRENCE_ENTITY "com.apple.calendars.Recurrence"
+
+/* a recurring event waiting for its recurrence records */
+typedef struct pending_event {
+	plist_t record;
+	/* copies of the recurrence records received so far */
+	plist_t rules;
+	int missing;
+} pending_event;
+
+struct pcal_conv {
+	/* pending events by id */
+	xmlHashTablePtr events;
+	/* recurrence records received before their event, by id */
+	xmlHashTablePtr rules;
+};
+
+static void pending_event_free(pending_event *event)
+{
+	plist_free(event->record);
+	plist_free(event->rules);
+	osync_free(event);
+}
+
+pcal_conv *pcal_conv_new(OSyncError **error)
+{
+	pcal_conv *conv = osync_try_malloc0(sizeof(pcal_conv), error);
+	if (!conv)
+		return NULL;
+
+	if (!(conv->events = xmlHashCreate(0)) || !(conv->rules = xmlHashCreate(0))) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate event tables");
+		pcal_conv_free(conv);
+		return NULL;
+	}
+	return conv;
+}
+
+void pcal_conv_free(pcal_conv *conv)
+{
+	if (!conv)
+		return;
+	if (conv->events)
+		xmlHashFree(conv->events, (xmlHashDeallocator) pending_event_free);
+	if (conv->rules)
+		xmlHashFree(conv->rules, (xmlHashDeallocator) plist_free);
+	osync_free(conv);
+}
+
+static osync_bool add_content_field(OSyncXMLFormat *xmlformat, const char *name, plist_t record, const char *key, OSyncError **error)
+{
+	OSyncXMLField *field = NULL;
+	osync_bool result = TRUE;
+	char *value = dict_get_string(record, key);
+
+	//unlike contacts, missing event fields are left out
+	if (!value || !*value)
+		goto exit;
+
+	if (!(field = osync_xmlfield_new(xmlformat, name, error)))
+		result = FALSE;
+	else
+		result = osync_xmlfield_set_key_value(field, "Content", value, error);
+
+exit:
+	free(value);
+	return result;
+}
+
+static osync_bool get_bool(plist_t record, const char *key)
+{
+	plist_t node = dict_get_value(record, key);
+	uint8_t value = 0;
+
+	if (node && PLIST_BOOLEAN == plist_get_node_type(node))
+		plist_get_bool_val(node, &value);
+	return value;
+}
+
+/* integers are unsigned in the plist, negative ones (last week, last day) wrap */
+static osync_bool get_int(plist_t node, int64_t *value)
+{
+	uint64_t uint_val = 0;
+
+	if (!node || PLIST_UINT != plist_get_node_type(node))
+		return FALSE;
+	plist_get_uint_val(node, &uint_val);
+	*value = (int64_t) uint_val;
+	return TRUE;
+}
+
+/* all day events only keep the date, others are stored in UTC, to be freed with osync_free() */
+static char *format_date(plist_t node, osync_bool all_day)
+{
+	int32_t sec = 0;
+	int32_t usec = 0;
+	time_t t = 0;
+	char date[16];
+	struct tm tm;
+
+	plist_get_date_val(node, &sec, &usec);
+	t = sec;
+
+	if (!all_day)
+		return osync_time_unix2vtime(&t);
+	if (!gmtime_r(&t, &tm))
+		return NULL;
+	strftime(date, sizeof(date), "%Y%m%d", &tm);
+	return osync_strdup(date);
+}
+
+static osync_bool add_date_node(OSyncXMLFormat *xmlformat, const char *name, plist_t node, osync_bool all_day, OSyncError **error)
+{
+	OSyncXMLField *field = NULL;
+	char *value = NULL;
+	osync_bool result = FALSE;
+
+	if (!(value = format_date(node, all_day))) {
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Invalid date for %s", name);
+		return FALSE;
+	}
+
+	if ((field = osync_xmlfield_new(xmlformat, name, error))) {
+		if (all_day)
+			osync_xmlfield_set_attr(field, "Value", "DATE");
+		result = osync_xmlfield_set_key_value(field, "Content", value, error);
+	}
+	osync_free(value);
+	return result;
+}
+
+static osync_bool add_date_field(OSyncXMLFormat *xmlformat, const char *name, plist_t record, const char *key, osync_bool all_day, OSyncError **error)
+{
+	plist_t node = dict_get_value(record, key);
+
+	if (!node || PLIST_DATE != plist_get_node_type(node))
+		return TRUE;
+	return add_date_node(xmlformat, name, node, all_day, error);
+}
+
+/* "daily", "weekly"... as the RRULE keyword, NULL for what iCalendar has no name for */
+static char *rule_frequency(plist_t rule)
+{
+	static const char *names[] = { "SECONDLY", "MINUTELY", "HOURLY", "DAILY", "WEEKLY", "MONTHLY", "YEARLY", NULL };
+	char *frequency = dict_get_string(rule, "frequency");
+	char *p = NULL;
+	int i = 0;
+
+	for (p = frequency; p && *p; p++)
+		*p = toupper((unsigned char) *p);
+	for (i = 0; frequency && names[i]; i++)
+		if (!strcmp(frequency, names[i]))
+			return frequency;
+	free(frequency);
+	return NULL;
+}
+
+/* a number, or an array of numbers, as the comma separated RRULE list */
+static void format_numbers(plist_t node, char *buffer, size_t size)
+{
+	plist_t item = NULL;
+	int64_t value = 0;
+	size_t length = 0;
+
+	buffer[0] = '\0';
+	if (!node)
+		return;
+	if (PLIST_ARRAY != plist_get_node_type(node)) {
+		if (get_int(node, &value))
+			snprintf(buffer, size, "%lld", (long long) value);
+		return;
+	}
+
+	for (item = plist_get_first_child(node); item && length < size; item = plist_get_next_sibling(item)) {
+		if (!get_int(item, &value))
+			continue;
+		length += snprintf(buffer + length, size - length, "%s%lld", length ? "," : "", (long long) value);
+	}
+}
+
+static const char *weekdays[] = { "SU", "MO", "TU", "WE", "TH", "FR", "SA" };
+
+/* weekdays count from 1 for sunday, a day can be a string already */
+static const char *format_weekday(plist_t node)
+{
+	static char name[3];
+	int64_t value = 0;
+	char *string = NULL;
+
+	if (get_int(node, &value))
+		return value >= 1 && value <= 7 ? weekdays[value - 1] : NULL;
+	if (node && PLIST_STRING == plist_get_node_type(node))
+		plist_get_string_val(node, &string);
+	if (!string || 2 != strlen(string)) {
+		free(string);
+		return NULL;
+	}
+	name[0] = toupper((unsigned char) string[0]);
+	name[1] = toupper((unsigned char) string[1]);
+	name[2] = '\0';
+	free(string);
+	return name;
+}
+
+/* first item of an array value, NULL when missing or not an array */
+static plist_t first_item(plist_t record, const char *key)
+{
+	plist_t node = dict_get_value(record, key);
+
+	if (!node || PLIST_ARRAY != plist_get_node_type(node))
+		return NULL;
+	return plist_get_first_child(node);
+}
+
+/* "bydaydays" holds the weekdays, "bydayfreq" the week of each, 0 for every week */
+static void format_byday(plist_t rule, char *buffer, size_t size)
+{
+	plist_t day = first_item(rule, "bydaydays");
+	plist_t freq = first_item(rule, "bydayfreq");
+	size_t length = 0;
+
+	buffer[0] = '\0';
+	for (; day && length < size; day = plist_get_next_sibling(day)) {
+		const char *name = format_weekday(day);
+		int64_t week = 0;
+
+		if (freq) {
+			get_int(freq, &week);
+			freq = plist_get_next_sibling(freq);
+		}
+		if (!name)
+			continue;
+		if (week)
+			length += snprintf(buffer + length, size - length, "%s%lld%s", length ? "," : "", (long long) week, name);
+		else
+			length += snprintf(buffer + length, size - length, "%s%s", length ? "," : "", name);
+	}
+}
+
+static osync_bool set_key(OSyncXMLField *field, const char *key, const char *value, OSyncError **error)
+{
+	if (!value || !*value)
+		return TRUE;
+	return osync_xmlfield_set_key_value(field, key, value, error);
+}
+
+/* keys in the order of the xmlformat-event schema */
+static osync_bool add_rule_field(OSyncXMLFormat *xmlformat, plist_t rule, osync_bool all_day, OSyncError **error)
+{
+	static const struct { const char *key; const char *name; } lists[] = {
+		{ "bymonthday", "ByMonthDay" },
+		{ "byyearday", "ByYearDay" },
+		{ "byweekno", "ByWeekNo" },
+		{ "bymonth", "ByMonth" },
+		{ "bysetpos", "BySetPos" },
+		{ NULL, NULL }
+	};
+	OSyncXMLField *field = NULL;
+	plist_t node = NULL;
+	char *frequency = rule_frequency(rule);
+	char *until = NULL;
+	char buffer[256];
+	osync_bool result = FALSE;
+	int i = 0;
+
+	if (!(field = osync_xmlfield_new(xmlformat, "RecurrenceRule", error)))
+		goto exit;
+	if (!set_key(field, "Frequency", frequency, error))
+		goto exit;
+
+	if ((node = dict_get_value(rule, "until")) && PLIST_DATE == plist_get_node_type(node) && !(until = format_date(node, all_day))) {
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Invalid recurrence end");
+		goto exit;
+	}
+	if (!set_key(field, "Until", until, error))
+		goto exit;
+
+	format_numbers(dict_get_value(rule, "count"), buffer, sizeof(buffer));
+	if (!set_key(field, "Count", buffer, error))
+		goto exit;
+	format_numbers(dict_get_value(rule, "interval"), buffer, sizeof(buffer));
+	if (!set_key(field, "Interval", buffer, error))
+		goto exit;
+	format_byday(rule, buffer, sizeof(buffer));
+	if (!set_key(field, "ByDay", buffer, error))
+		goto exit;
+
+	for (i = 0; lists[i].key; i++) {
+		format_numbers(dict_get_value(rule, lists[i].key), buffer, sizeof(buffer));
+		if (!set_key(field, lists[i].name, buffer, error))
+			goto exit;
+	}
+
+	if (!set_key(field, "WeekStart", format_weekday(dict_get_value(rule, "weekstart")), error))
+		goto exit;
+	result = TRUE;
+
+exit:
+	free(frequency);
+	if (until)
+		osync_free(until);
+	return result;
+}
+
+/* every rule has to map, an event repeating in a way iCalendar can not name is left out */
+static osync_bool rules_convertible(plist_t rules)
+{
+	plist_t rule = NULL;
+
+	for (rule = rules ? plist_get_first_child(rules) : NULL; rule; rule = plist_get_next_sibling(rule)) {
+		char *frequency = rule_frequency(rule);
+		if (!frequency)
+			return FALSE;
+		free(frequency);
+	}
+	return TRUE;
+}
+
+static OSyncXMLFormat *convert_event(const char *id, plist_t record, plist_t rules, OSyncError **error)
+{
+	OSyncXMLField *field = NULL;
+	OSyncXMLFormat *xmlformat = NULL;
+	osync_bool all_day = get_bool(record, "all day");
+	plist_t node = NULL;
+
+	if (!(xmlformat = osync_xmlformat_new("event", error)))
+		return NULL;
+
+	if (!(field = osync_xmlfield_new(xmlformat, "Uid", error)))
+		goto error;
+	if (!osync_xmlfield_set_key_value(field, "Content", id, error))
+		goto error;
+
+	if (!add_content_field(xmlformat, "Summary", record, "summary", error))
+		goto error;
+	if (!add_content_field(xmlformat, "Description", record, "description", error))
+		goto error;
+	if (!add_content_field(xmlformat, "Location", record, "location", error))
+		goto error;
+	if (!add_date_field(xmlformat, "DateStarted", record, "start date", all_day, error))
+		goto error;
+	if (!add_date_field(xmlformat, "DateEnd", record, "end date", all_day, error))
+		goto error;
+
+	//an occurrence detached from its series names the one it replaces
+	if (!add_date_field(xmlformat, "RecurrenceId", record, "original date", all_day, error))
+		goto error;
+
+	for (node = rules ? plist_get_first_child(rules) : NULL; node; node = plist_get_next_sibling(node))
+		if (!add_rule_field(xmlformat, node, all_day, error))
+			goto error;
+
+	for (node = first_item(record, "exception dates"); node; node = plist_get_next_sibling(node))
+		if (PLIST_DATE == plist_get_node_type(node) && !add_date_node(xmlformat, "ExceptionDateTime", node, all_day, error))
+			goto error;
+
+	return xmlformat;
+
+error:
+	osync_xmlformat_unref(xmlformat);
+	return NULL;
+}
+
+static osync_bool report_event(const char *id, plist_t record, plist_t rules, pcal_conv_report_func report_func, pcal_conv_skip_func skip_func, void *userdata, OSyncError **error)
+{
+	OSyncXMLFormat *xmlformat = NULL;
+
+	if (!rules_convertible(rules)) {
+		osync_trace(TRACE_INTERNAL, "skipping event %s with an unknown recurrence\n", id);
+		skip_func(id, userdata);
+		return TRUE;
+	}
+
+	if (!(xmlformat = convert_event(id, record, rules, error)))
+		return FALSE;
+	return report_func(id, xmlformat, userdata, error);
+}
+
+/* a single event is reported right away, a recurring one once all its rules are there */
+static osync_bool feed_event(pcal_conv *conv, const char *id, plist_t record, pcal_conv_report_func report_func, pcal_conv_skip_func skip_func, void *userdata, OSyncError **error)
+{
+	plist_t recurrences = first_item(record, "recurrences");
+	pending_event *event = NULL;
+	plist_t node = NULL;
+
+	if (!recurrences)
+		return report_event(id, record, NULL, report_func, skip_func, userdata, error);
+
+	if (xmlHashLookup(conv->events, BAD_CAST id)) {
+		osync_trace(TRACE_INTERNAL, "event %s received twice\n", id);
+		return TRUE;
+	}
+	if (!(event = osync_try_malloc0(sizeof(pending_event), error)))
+		return FALSE;
+	event->record = plist_copy_container(record);
+	event->rules = plist_new_array();
+
+	for (node = recurrences; node; node = plist_get_next_sibling(node)) {
+		char *rule_id = NULL;
+		plist_t rule = NULL;
+
+		if (PLIST_STRING == plist_get_node_type(node))
+			plist_get_string_val(node, &rule_id);
+		if (rule_id && (rule = xmlHashLookup(conv->rules, BAD_CAST rule_id))) {
+			plist_add_sub_node(event->rules, rule);
+			xmlHashRemoveEntry(conv->rules, BAD_CAST rule_id, NULL);
+		}
+		else if (rule_id)
+			event->missing++;
+		free(rule_id);
+	}
+
+	if (!event->missing) {
+		osync_bool result = report_event(id, event->record, event->rules, report_func, skip_func, userdata, error);
+		pending_event_free(event);
+		return result;
+	}
+
+	if (xmlHashAddEntry(conv->events, BAD_CAST id, event)) {
+		pending_event_free(event);
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to keep event %s", id);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* a rule completes its event, or waits for it when it came first */
+static osync_bool feed_rule(pcal_conv *conv, const char *id, plist_t record, pcal_conv_report_func report_func, pcal_conv_skip_func skip_func, void *userdata, OSyncError **error)
+{
+	plist_t owner = dict_get_value(record, "owner");
+	pending_event *event = NULL;
+	char *event_id = NULL;
+	osync_bool result = TRUE;
+
+	if (owner && PLIST_ARRAY == plist_get_node_type(owner))
+		owner = plist_get_first_child(owner);
+	if (owner && PLIST_STRING == plist_get_node_type(owner))
+		plist_get_string_val(owner, &event_id);
+
+	if (!event_id || !(event = xmlHashLookup(conv->events, BAD_CAST event_id))) {
+		plist_t rule = plist_copy_container(record);
+		if (xmlHashAddEntry(conv->rules, BAD_CAST id, rule)) {
+			osync_trace(TRACE_INTERNAL, "recurrence %s received twice\n", id);
+			plist_free(rule);
+		}
+		goto exit;
+	}
+
+	plist_add_sub_node(event->rules, plist_copy_container(record));
+	if (--event->missing > 0)
+		goto exit;
+
+	result = report_event(event_id, event->record, event->rules, report_func, skip_func, userdata, error);
+	xmlHashRemoveEntry(conv->events, BAD_CAST event_id, (xmlHashDeallocator) pending_event_free);
+
+exit:
+	free(event_id);
+	return result;
+}
+
+osync_bool pcal_conv_feed(pcal_conv *conv, plist_t batch, pcal_conv_report_func report_func, pcal_conv_skip_func skip_func, void *userdata, OSyncError **error)
+{
+	plist_t records = NULL;
+	plist_t key = NULL;
+	plist_t value = NULL;
+
+	//calendars, alarms and attendees come in batches of their own
+	if (!plist_find_node_by_string(batch, EVENT_ENTITY) && !plist_find_node_by_string(batch, RECURRENCE_ENTITY))
+		return TRUE;
+	if (!(records = message_get_records(batch)))
+		return TRUE;
+
+	for (key = plist_get_first_child(records); key; key = plist_get_next_sibling(value)) {
+		char *id = NULL;
+		char *entity = NULL;
+		osync_bool result = TRUE;
+
+		if (!(value = plist_get_next_sibling(key)))
+			break;
+		if (PLIST_KEY != plist_get_node_type(key) || PLIST_DICT != plist_get_node_type(value))
+			continue;
+
+		plist_get_key_val(key, &id);
+		entity = dict_get_string(value, ENTITY_KEY);
+		if (id && entity && !strcmp(entity, EVENT_ENTITY))
+			result = feed_event(conv, id, value, report_func, skip_func, userdata, error);
+		else if (id && entity && !strcmp(entity, RECURRENCE_ENTITY))
+			result = feed_rule(conv, id, value, report_func, skip_func, userdata, error);
+		free(entity);
+		free(id);
+
+		if (!result)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+typedef struct skip_state {
+	pcal_conv_skip_func skip_func;
+	void *userdata;
+} skip_state;
+
+static void skip_pending_event(void *payload, void *data, xmlChar *name)
+{
+	skip_state *state = (skip_state *) data;
+
+	osync_trace(TRACE_INTERNAL, "skipping event %s, its recurrence never came\n", (char *) name);
+	state->skip_func((const char *) name, state->userdata);
+}
+
+void pcal_conv_finish(pcal_conv *conv, pcal_conv_skip_func skip_func, void *userdata)
+{
+	skip_state state = { skip_func, userdata };
+
+	xmlHashScan(conv->events, (xmlHashScanner) skip_pending_event, &state);
+}
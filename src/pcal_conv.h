@@ -0,0 +1,68 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/**
+ * @file   pcal_conv.h
+ *
+ * @brief  MobileSync calendar plist to xmlformat-event converter.
+ *
+ * A single event record carries everything its fields are built from,
+ * it is converted and reported from the batch it arrives in.
+ *
+ * The rules of a recurring event are records of their own, listed by id
+ * in its "recurrences" and pointing back at it with "owner". Such an
+ * event, or a rule received ahead of it, is kept until the other side
+ * arrives, then the event is reported with a RecurrenceRule per rule
+ * and an ExceptionDateTime per exception date. An occurrence detached
+ * from its series gets the RecurrenceId of the one it replaces.
+ *
+ * Alarms and attendees are not converted. An event whose rule does not
+ * map to iCalendar, or whose rules never came (a fast session only
+ * sends the records that changed), goes to the skip function instead.
+ */
+
+#ifndef __PCAL_CONV__
+#define __PCAL_CONV__
+
+#include <opensync/opensync.h>
+#include <opensync/opensync-xmlformat.h>
+
+#include <plist/plist.h>
+
+/* called once per converted event, takes ownership of xmlformat */
+typedef osync_bool (*pcal_conv_report_func)(const char *uid, OSyncXMLFormat *xmlformat, void *userdata, OSyncError **error);
+
+/* called once per event that is not converted */
+typedef void (*pcal_conv_skip_func)(const char *uid, void *userdata);
+
+typedef struct pcal_conv pcal_conv;
+
+pcal_conv *pcal_conv_new(OSyncError **error);
+void pcal_conv_free(pcal_conv *conv);
+
+/* converts the events of one batch as received from the device, batch stays owned by caller */
+osync_bool pcal_conv_feed(pcal_conv *conv, plist_t batch, pcal_conv_report_func report_func, pcal_conv_skip_func skip_func, void *userdata, OSyncError **error);
+
+/* once the device is done sending, skips the events still waiting for a rule */
+void pcal_conv_finish(pcal_conv *conv, pcal_conv_skip_func skip_func, void *userdata);
+
+#endif
@@ -0,0 +1,138 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+#include "pcont_commit.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define ENTITY_KEY "com.apple.syncservices.RecordEntityName"
+
+/* the stylesheet writes an empty string for a missing value */
+static void add_string(plist_t dict, const char *key, const char *value)
+{
+	plist_add_sub_key_el(dict, key);
+	plist_add_sub_string_el(dict, value ? value : "");
+}
+
+static plist_t new_record(const char *entity)
+{
+	plist_t record = plist_new_dict();
+	add_string(record, ENTITY_KEY, entity);
+	return record;
+}
+
+static void add_contact_ref(plist_t record, const char *contact_id)
+{
+	plist_t contact = plist_new_array();
+	plist_add_sub_string_el(contact, contact_id);
+	plist_add_sub_key_el(record, "contact");
+	plist_add_sub_node(record, contact);
+}
+
+static const char *phone_type(OSyncXMLField *field)
+{
+	const char *location = osync_xmlfield_get_attr(field, "Location");
+	const char *type = osync_xmlfield_get_attr(field, "Type");
+
+	if (location && !strcmp(location, "Work"))
+		return "work";
+	if (location && !strcmp(location, "Home"))
+		return "home";
+	if (type && !strcmp(type, "Cellular"))
+		return "mobile";
+	return "other";
+}
+
+static plist_t convert_phone(OSyncXMLField *field, const char *contact_id)
+{
+	plist_t record = new_record("com.apple.contacts.Phone Number");
+	add_contact_ref(record, contact_id);
+	add_string(record, "type", phone_type(field));
+	add_string(record, "value", osync_xmlfield_get_key_value(field, "Content"));
+	return record;
+}
+
+static plist_t convert_email(OSyncXMLField *field, const char *contact_id)
+{
+	plist_t record = new_record("com.apple.contacts.Email Address");
+	add_contact_ref(record, contact_id);
+	add_string(record, "value", osync_xmlfield_get_key_value(field, "Content"));
+	return record;
+}
+
+static plist_t convert_address(OSyncXMLField *field, const char *contact_id)
+{
+	plist_t record = new_record("com.apple.contacts.Street Address");
+	add_contact_ref(record, contact_id);
+	add_string(record, "street", osync_xmlfield_get_key_value(field, "Street"));
+	add_string(record, "postal code", osync_xmlfield_get_key_value(field, "PostalCode"));
+	return record;
+}
+
+/*
+ * Attribute records are keyed "<kind>/<contact>/<n>", n counting the
+ * fields of that kind from 0, in the order the stylesheet emits them:
+ * phones, then emails, then addresses.
+ */
+static osync_bool append_attributes(plist_t records, const char *contact_id, OSyncXMLFormat *xmlformat,
+				    const char *name, char kind, plist_t (*convert)(OSyncXMLField *, const char *), OSyncError **error)
+{
+	OSyncXMLField *field = NULL;
+	char key[256];
+	int n = 0;
+
+	for (field = osync_xmlformat_get_first_field(xmlformat); field; field = osync_xmlfield_get_next(field)) {
+		if (strcmp(osync_xmlfield_get_name(field), name))
+			continue;
+
+		if (snprintf(key, sizeof(key), "%c/%s/%d", kind, contact_id, n++) >= (int) sizeof(key)) {
+			osync_error_set(error, OSYNC_ERROR_CONVERT, "Contact id %s too long", contact_id);
+			return FALSE;
+		}
+		plist_add_sub_key_el(records, key);
+		plist_add_sub_node(records, convert(field, contact_id));
+	}
+	return TRUE;
+}
+
+osync_bool pcont_commit_append(plist_t records, const char *contact_id, OSyncXMLFormat *xmlformat, OSyncError **error)
+{
+	OSyncXMLField *field = NULL;
+	plist_t contact = new_record("com.apple.contacts.Contact");
+
+	//only the first Name counts, like value-of in the stylesheet
+	for (field = osync_xmlformat_get_first_field(xmlformat); field; field = osync_xmlfield_get_next(field))
+		if (!strcmp(osync_xmlfield_get_name(field), "Name"))
+			break;
+	add_string(contact, "first name", field ? osync_xmlfield_get_key_value(field, "FirstName") : NULL);
+	add_string(contact, "last name", field ? osync_xmlfield_get_key_value(field, "LastName") : NULL);
+
+	plist_add_sub_key_el(records, contact_id);
+	plist_add_sub_node(records, contact);
+
+	if (!append_attributes(records, contact_id, xmlformat, "Telephone", '3', convert_phone, error))
+		return FALSE;
+	if (!append_attributes(records, contact_id, xmlformat, "EMail", '4', convert_email, error))
+		return FALSE;
+	return append_attributes(records, contact_id, xmlformat, "Address", '5', convert_address, error);
+}
@@ -0,0 +1,44 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/**
+ * @file   pcont_commit.h
+ *
+ * @brief  Native xmlformat-contact to MobileSync contact records serializer.
+ *
+ * Walks the fields of a contact and emits the plist_t records the device
+ * expects, doing the same mapping as osync2pcont.xslt without any
+ * intermediate XML text.
+ */
+
+#ifndef __PCONT_COMMIT__
+#define __PCONT_COMMIT__
+
+#include <opensync/opensync.h>
+#include <opensync/opensync-xmlformat.h>
+
+#include <plist/plist.h>
+
+/* appends the contact record and its "3/", "4/" and "5/" records, keyed after contact_id, to records */
+osync_bool pcont_commit_append(plist_t records, const char *contact_id, OSyncXMLFormat *xmlformat, OSyncError **error);
+
+#endif
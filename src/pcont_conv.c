@@ -0,0 +1,308 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+#include "pcont_conv.h"
+#include "plist_aux.h"
+#include "arena.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <libxml/hash.h>
+
+typedef struct pcont_entry {
+	char *uid;
+	OSyncXMLFormat *xmlformat;
+	/* attribute records may show up before (or without) their contact */
+	osync_bool has_contact;
+	struct pcont_entry *next;
+} pcont_entry;
+
+struct pcont_conv {
+	/* entries and their uids, all freed with the converter */
+	arena *arena;
+	xmlHashTablePtr entries;
+	pcont_entry *first;
+	pcont_entry *last;
+};
+
+static osync_bool set_key_value(OSyncXMLField *field, const char *key, const char *value, OSyncError **error)
+{
+	//the stylesheet always emits the element, even when empty
+	return osync_xmlfield_set_key_value(field, key, value ? value : "", error);
+}
+
+static osync_bool set_key_from_dict(OSyncXMLField *field, const char *key, plist_t dict, const char *dict_key, OSyncError **error)
+{
+	char *value = dict_get_string(dict, dict_key);
+	osync_bool result = set_key_value(field, key, value, error);
+	free(value);
+	return result;
+}
+
+static pcont_entry *get_entry(pcont_conv *conv, const char *uid, OSyncError **error)
+{
+	pcont_entry *entry = xmlHashLookup(conv->entries, BAD_CAST uid);
+	if (entry)
+		return entry;
+
+	if (!(entry = arena_alloc(conv->arena, sizeof(pcont_entry)))) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to store contact %s", uid);
+		return NULL;
+	}
+
+	if (!(entry->uid = arena_strdup(conv->arena, uid)))
+		goto error;
+	if (!(entry->xmlformat = osync_xmlformat_new("contact", error)))
+		goto error;
+	if (xmlHashAddEntry(conv->entries, BAD_CAST uid, entry))
+		goto error;
+
+	if (conv->last)
+		conv->last->next = entry;
+	else
+		conv->first = entry;
+	conv->last = entry;
+
+	return entry;
+
+error:
+	if (!osync_error_is_set(error))
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to store contact %s", uid);
+	if (entry->xmlformat)
+		osync_xmlformat_unref(entry->xmlformat);
+	return NULL;
+}
+
+static osync_bool convert_contact(pcont_conv *conv, const char *id, plist_t record, OSyncError **error)
+{
+	OSyncXMLField *field = NULL;
+	pcont_entry *entry = get_entry(conv, id, error);
+	if (!entry)
+		return FALSE;
+
+	if (entry->has_contact) {
+		osync_trace(TRACE_INTERNAL, "contact %s received twice\n", id);
+		return TRUE;
+	}
+	entry->has_contact = TRUE;
+
+	if (!(field = osync_xmlfield_new(entry->xmlformat, "Uid", error)))
+		return FALSE;
+	if (!set_key_value(field, "content", id, error))
+		return FALSE;
+
+	if (!(field = osync_xmlfield_new(entry->xmlformat, "Name", error)))
+		return FALSE;
+	if (!set_key_from_dict(field, "LastName", record, "last name", error))
+		return FALSE;
+	if (!set_key_from_dict(field, "FirstName", record, "first name", error))
+		return FALSE;
+
+	return TRUE;
+}
+
+static osync_bool convert_phone(OSyncXMLFormat *xmlformat, plist_t record, OSyncError **error)
+{
+	OSyncXMLField *field = osync_xmlfield_new(xmlformat, "Telephone", error);
+	if (!field)
+		return FALSE;
+
+	char *type = dict_get_string(record, "type");
+	if (type) {
+		if (!strcmp(type, "work"))
+			osync_xmlfield_set_attr(field, "Location", "Work");
+		else if (!strcmp(type, "home"))
+			osync_xmlfield_set_attr(field, "Location", "Home");
+		else if (!strcmp(type, "mobile"))
+			osync_xmlfield_set_attr(field, "Type", "Cellular");
+		free(type);
+	}
+
+	return set_key_from_dict(field, "Content", record, "value", error);
+}
+
+static osync_bool convert_email(OSyncXMLFormat *xmlformat, plist_t record, OSyncError **error)
+{
+	OSyncXMLField *field = osync_xmlfield_new(xmlformat, "EMail", error);
+	if (!field)
+		return FALSE;
+
+	return set_key_from_dict(field, "Content", record, "value", error);
+}
+
+static osync_bool convert_address(OSyncXMLFormat *xmlformat, plist_t record, OSyncError **error)
+{
+	OSyncXMLField *field = osync_xmlfield_new(xmlformat, "Address", error);
+	if (!field)
+		return FALSE;
+
+	if (!set_key_from_dict(field, "Street", record, "street", error))
+		return FALSE;
+	return set_key_from_dict(field, "PostalCode", record, "postal code", error);
+}
+
+/*
+ * Attribute records are keyed "<kind>/<contact>/<n>" and carry the id of
+ * their contact in a 'contact' array: 3 is a phone, 4 an email and 5 an
+ * address. Anything else is ignored like the stylesheet does.
+ */
+char *pcont_attribute_contact(const char *id, plist_t record)
+{
+	char *contact_id = NULL;
+
+	plist_t contact = dict_get_value(record, "contact");
+	if (!contact || PLIST_ARRAY != plist_get_node_type(contact))
+		return NULL;
+
+	plist_t contact_str = plist_get_first_child(contact);
+	if (!contact_str || PLIST_STRING != plist_get_node_type(contact_str))
+		return NULL;
+
+	const char *slash = strchr(id, '/');
+	if (!slash || 1 != slash - id || !strchr("345", id[0]))
+		return NULL;
+
+	plist_get_string_val(contact_str, &contact_id);
+	return contact_id;
+}
+
+static osync_bool convert_attribute(pcont_conv *conv, const char *id, plist_t record, OSyncError **error)
+{
+	char *contact_id = NULL;
+	pcont_entry *entry = NULL;
+	osync_bool result = FALSE;
+
+	if (!(contact_id = pcont_attribute_contact(id, record)))
+		return TRUE;
+
+	if (!(entry = get_entry(conv, contact_id, error)))
+		goto exit;
+
+	switch (id[0]) {
+	case '3':
+		result = convert_phone(entry->xmlformat, record, error);
+		break;
+	case '4':
+		result = convert_email(entry->xmlformat, record, error);
+		break;
+	case '5':
+		result = convert_address(entry->xmlformat, record, error);
+		break;
+	}
+
+exit:
+	free(contact_id);
+	return result;
+}
+
+pcont_conv *pcont_conv_new(OSyncError **error)
+{
+	pcont_conv *conv = osync_try_malloc0(sizeof(pcont_conv), error);
+	if (!conv)
+		return NULL;
+
+	if (!(conv->arena = arena_new(0, error)))
+		goto error;
+	if (!(conv->entries = xmlHashCreate(0))) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate contact table");
+		goto error;
+	}
+	return conv;
+
+error:
+	arena_free(conv->arena);
+	osync_free(conv);
+	return NULL;
+}
+
+void pcont_conv_free(pcont_conv *conv)
+{
+	pcont_entry *entry = NULL;
+	pcont_entry *next = NULL;
+
+	if (!conv)
+		return;
+
+	xmlHashFree(conv->entries, NULL);
+	for (entry = conv->first; entry; entry = next) {
+		next = entry->next;
+		if (entry->xmlformat)
+			osync_xmlformat_unref(entry->xmlformat);
+	}
+	arena_free(conv->arena);
+	osync_free(conv);
+}
+
+osync_bool pcont_conv_feed(pcont_conv *conv, plist_t batch, OSyncError **error)
+{
+	plist_t records = NULL;
+	plist_t key = NULL;
+	plist_t value = NULL;
+
+	osync_bool is_contact = (NULL != plist_find_node_by_string(batch, "com.apple.contacts.Contact"));
+
+	if (!(records = message_get_records(batch)))
+		return TRUE;
+
+	for (key = plist_get_first_child(records); key; key = plist_get_next_sibling(value)) {
+		char *id = NULL;
+		osync_bool result = TRUE;
+
+		if (!(value = plist_get_next_sibling(key)))
+			break;
+		if (PLIST_KEY != plist_get_node_type(key) || PLIST_DICT != plist_get_node_type(value))
+			continue;
+
+		plist_get_key_val(key, &id);
+		if (!id)
+			continue;
+
+		if (is_contact)
+			result = convert_contact(conv, id, value, error);
+		else
+			result = convert_attribute(conv, id, value, error);
+		free(id);
+
+		if (!result)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+osync_bool pcont_conv_finish(pcont_conv *conv, pcont_conv_report_func report_func, void *userdata, OSyncError **error)
+{
+	pcont_entry *entry = NULL;
+
+	for (entry = conv->first; entry; entry = entry->next) {
+		OSyncXMLFormat *xmlformat = entry->xmlformat;
+
+		if (!entry->has_contact) {
+			osync_trace(TRACE_INTERNAL, "dropping attributes of unknown contact %s\n", entry->uid);
+			continue;
+		}
+
+		entry->xmlformat = NULL;
+		if (!report_func(entry->uid, xmlformat, userdata, error))
+			return FALSE;
+	}
+	return TRUE;
+}
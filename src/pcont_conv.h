@@ -0,0 +1,57 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+/**
+ * @file   pcont_conv.h
+ *
+ * @brief  Native MobileSync contact plist to xmlformat-contact converter.
+ *
+ * Walks the received plist_t batches directly and fills OSyncXMLFormat
+ * fields, doing the same mapping as pcont2osync.xslt without any
+ * intermediate XML text.
+ */
+
+#ifndef __PCONT_CONV__
+#define __PCONT_CONV__
+
+#include <opensync/opensync.h>
+#include <opensync/opensync-xmlformat.h>
+
+#include <plist/plist.h>
+
+typedef struct pcont_conv pcont_conv;
+
+/* called once per converted contact, takes ownership of xmlformat */
+typedef osync_bool (*pcont_conv_report_func)(const char *uid, OSyncXMLFormat *xmlformat, void *userdata, OSyncError **error);
+
+/* contact an attribute record belongs to, to be freed, NULL for records the converter ignores */
+char *pcont_attribute_contact(const char *id, plist_t record);
+
+pcont_conv *pcont_conv_new(OSyncError **error);
+void pcont_conv_free(pcont_conv *conv);
+
+/* converts one batch as received from the device, batch stays owned by caller */
+osync_bool pcont_conv_feed(pcont_conv *conv, plist_t batch, OSyncError **error);
+
+/* hands every complete contact to report_func, in the order they were received */
+osync_bool pcont_conv_finish(pcont_conv *conv, pcont_conv_report_func report_func, void *userdata, OSyncError **error);
+
+#endif
@@ -0,0 +1,367 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+#include "pcont_raw.h"
+#include "pcont_conv.h"
+#include "plist_aux.h"
+#include "arena.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <libxml/hash.h>
+
+#define CONTACT_ENTITY "com.apple.contacts.Contact"
+#define ENTITY_KEY "com.apple.syncservices.RecordEntityName"
+
+typedef struct pcont_raw_entry {
+	char *uid;
+	/* copies of the records, owned until they are assembled */
+	plist_t contact;
+	plist_t attributes;
+	struct pcont_raw_entry *next;
+} pcont_raw_entry;
+
+struct pcont_raw {
+	/* entries and their uids, all freed with the collector */
+	arena *arena;
+	xmlHashTablePtr entries;
+	pcont_raw_entry *first;
+	pcont_raw_entry *last;
+};
+
+static pcont_raw_entry *get_entry(pcont_raw *raw, const char *uid, OSyncError **error)
+{
+	pcont_raw_entry *entry = xmlHashLookup(raw->entries, BAD_CAST uid);
+	if (entry)
+		return entry;
+
+	if (!(entry = arena_alloc(raw->arena, sizeof(pcont_raw_entry)))
+	    || !(entry->uid = arena_strdup(raw->arena, uid))
+	    || xmlHashAddEntry(raw->entries, BAD_CAST uid, entry)) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to store contact %s", uid);
+		return NULL;
+	}
+
+	if (raw->last)
+		raw->last->next = entry;
+	else
+		raw->first = entry;
+	raw->last = entry;
+
+	return entry;
+}
+
+osync_bool pcont_raw_add(pcont_raw *raw, const char *id, plist_t record, osync_bool is_contact, OSyncError **error)
+{
+	pcont_raw_entry *entry = NULL;
+	char *contact_id = NULL;
+
+	if (is_contact) {
+		if (!(entry = get_entry(raw, id, error)))
+			return FALSE;
+		if (entry->contact) {
+			osync_trace(TRACE_INTERNAL, "contact %s received twice\n", id);
+			return TRUE;
+		}
+		entry->contact = plist_new_dict();
+		plist_add_sub_key_el(entry->contact, id);
+		plist_add_sub_node(entry->contact, plist_copy_container(record));
+		return TRUE;
+	}
+
+	//only what the converter would use, so the hash follows the converted contact
+	if (!(contact_id = pcont_attribute_contact(id, record)))
+		return TRUE;
+	entry = get_entry(raw, contact_id, error);
+	free(contact_id);
+	if (!entry)
+		return FALSE;
+
+	if (!entry->attributes)
+		entry->attributes = plist_new_dict();
+	plist_add_sub_key_el(entry->attributes, id);
+	plist_add_sub_node(entry->attributes, plist_copy_container(record));
+	return TRUE;
+}
+
+pcont_raw *pcont_raw_new(OSyncError **error)
+{
+	pcont_raw *raw = osync_try_malloc0(sizeof(pcont_raw), error);
+	if (!raw)
+		return NULL;
+
+	if (!(raw->arena = arena_new(0, error)))
+		goto error;
+	if (!(raw->entries = xmlHashCreate(0))) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate contact table");
+		goto error;
+	}
+	return raw;
+
+error:
+	arena_free(raw->arena);
+	osync_free(raw);
+	return NULL;
+}
+
+void pcont_raw_free(pcont_raw *raw)
+{
+	pcont_raw_entry *entry = NULL;
+
+	if (!raw)
+		return;
+
+	xmlHashFree(raw->entries, NULL);
+	for (entry = raw->first; entry; entry = entry->next) {
+		if (entry->contact)
+			plist_free(entry->contact);
+		if (entry->attributes)
+			plist_free(entry->attributes);
+	}
+	arena_free(raw->arena);
+	osync_free(raw);
+}
+
+osync_bool pcont_raw_feed(pcont_raw *raw, plist_t batch, OSyncError **error)
+{
+	plist_t records = NULL;
+	plist_t key = NULL;
+	plist_t value = NULL;
+
+	osync_bool is_contact = (NULL != plist_find_node_by_string(batch, CONTACT_ENTITY));
+
+	if (!(records = message_get_records(batch)))
+		return TRUE;
+
+	for (key = plist_get_first_child(records); key; key = plist_get_next_sibling(value)) {
+		char *id = NULL;
+		osync_bool result = TRUE;
+
+		if (!(value = plist_get_next_sibling(key)))
+			break;
+		if (PLIST_KEY != plist_get_node_type(key) || PLIST_DICT != plist_get_node_type(value))
+			continue;
+
+		plist_get_key_val(key, &id);
+		if (!id)
+			continue;
+
+		result = pcont_raw_add(raw, id, value, is_contact, error);
+		free(id);
+
+		if (!result)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* serializes the records of an entry, which the plist then owns */
+static char *assemble_entry(pcont_raw_entry *entry, unsigned int *size, OSyncError **error)
+{
+	plist_t root = plist_new_array();
+	plist_t message = plist_new_array();
+	char *bin = NULL;
+	uint32_t length = 0;
+	char *data = NULL;
+
+	plist_add_sub_string_el(message, CONTACT_ENTITY);
+	plist_add_sub_node(message, entry->contact);
+	entry->contact = NULL;
+	plist_add_sub_node(root, message);
+
+	message = plist_new_array();
+	plist_add_sub_node(message, entry->attributes ? entry->attributes : plist_new_dict());
+	entry->attributes = NULL;
+	plist_add_sub_node(root, message);
+
+	plist_to_bin(root, &bin, &length);
+	plist_free(root);
+	if (!bin) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to serialize contact %s", entry->uid);
+		return NULL;
+	}
+
+	//OSyncData releases it with osync_free()
+	if ((data = osync_try_malloc0(length, error))) {
+		memcpy(data, bin, length);
+		*size = length;
+	}
+	free(bin);
+	return data;
+}
+
+osync_bool pcont_raw_finish(pcont_raw *raw, pcont_raw_report_func report_func, void *userdata, OSyncError **error)
+{
+	pcont_raw_entry *entry = NULL;
+
+	for (entry = raw->first; entry; entry = entry->next) {
+		char *data = NULL;
+		unsigned int size = 0;
+
+		if (!entry->contact) {
+			osync_trace(TRACE_INTERNAL, "dropping attributes of unknown contact %s\n", entry->uid);
+			continue;
+		}
+
+		if (!(data = assemble_entry(entry, &size, error)))
+			return FALSE;
+		if (!report_func(entry->uid, data, size, userdata, error))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* the id the device gave a sent record, to be freed */
+static char *remapped_id(plist_t remap, const char *id)
+{
+	plist_t node = remap ? dict_get_value(remap, id) : NULL;
+	char *new_id = NULL;
+
+	if (node && PLIST_STRING == plist_get_node_type(node))
+		plist_get_string_val(node, &new_id);
+	return new_id ? new_id : strdup(id);
+}
+
+/* a copy of an attribute record pointing to the remapped contact */
+static plist_t remap_attribute(plist_t record, plist_t remap)
+{
+	plist_t copy = plist_new_dict();
+	plist_t key = NULL;
+	plist_t value = NULL;
+
+	for (key = plist_get_first_child(record); key; key = plist_get_next_sibling(value)) {
+		char *name = NULL;
+
+		if (!(value = plist_get_next_sibling(key)))
+			break;
+		plist_get_key_val(key, &name);
+		if (!name)
+			continue;
+
+		plist_add_sub_key_el(copy, name);
+		if (!strcmp(name, "contact") && PLIST_ARRAY == plist_get_node_type(value)) {
+			plist_t contacts = plist_new_array();
+			plist_t node = NULL;
+
+			for (node = plist_get_first_child(value); node; node = plist_get_next_sibling(node)) {
+				char *id = NULL;
+				char *new_id = NULL;
+
+				plist_get_string_val(node, &id);
+				if (id && (new_id = remapped_id(remap, id)))
+					plist_add_sub_string_el(contacts, new_id);
+				free(id);
+				free(new_id);
+			}
+			plist_add_sub_node(copy, contacts);
+		}
+		else
+			plist_add_sub_node(copy, plist_copy_container(value));
+		free(name);
+	}
+	return copy;
+}
+
+osync_bool pcont_raw_feed_sent(pcont_raw *raw, plist_t records, plist_t remap, OSyncError **error)
+{
+	plist_t key = NULL;
+	plist_t value = NULL;
+
+	for (key = plist_get_first_child(records); key; key = plist_get_next_sibling(value)) {
+		plist_t entity = NULL;
+		char *name = NULL;
+		char *id = NULL;
+		char *new_id = NULL;
+		osync_bool is_contact = FALSE;
+		osync_bool result = TRUE;
+
+		if (!(value = plist_get_next_sibling(key)))
+			break;
+		//deletions are sent as a plain string
+		if (PLIST_KEY != plist_get_node_type(key) || PLIST_DICT != plist_get_node_type(value))
+			continue;
+
+		if ((entity = dict_get_value(value, ENTITY_KEY)) && PLIST_STRING == plist_get_node_type(entity))
+			plist_get_string_val(entity, &name);
+		is_contact = name && !strcmp(name, CONTACT_ENTITY);
+		free(name);
+
+		plist_get_key_val(key, &id);
+		if (id && (new_id = remapped_id(remap, id))) {
+			if (is_contact)
+				result = pcont_raw_add(raw, new_id, value, TRUE, error);
+			else {
+				plist_t record = remap_attribute(value, remap);
+				result = pcont_raw_add(raw, new_id, record, FALSE, error);
+				plist_free(record);
+			}
+		}
+		free(id);
+		free(new_id);
+
+		if (!result)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static osync_bool keep_xmlformat(const char *uid, OSyncXMLFormat *xmlformat, void *userdata, OSyncError **error)
+{
+	OSyncXMLFormat **result = (OSyncXMLFormat **) userdata;
+
+	if (*result)
+		osync_xmlformat_unref(*result);
+	*result = xmlformat;
+	return TRUE;
+}
+
+OSyncXMLFormat *pcont_raw_convert(const char *data, unsigned int size, OSyncError **error)
+{
+	OSyncXMLFormat *xmlformat = NULL;
+	pcont_conv *conv = NULL;
+	plist_t root = NULL;
+	plist_t message = NULL;
+
+	plist_from_bin(data, size, &root);
+	if (!root || PLIST_ARRAY != plist_get_node_type(root)) {
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Invalid raw contact");
+		goto exit;
+	}
+
+	if (!(conv = pcont_conv_new(error)))
+		goto exit;
+	for (message = plist_get_first_child(root); message; message = plist_get_next_sibling(message))
+		if (!pcont_conv_feed(conv, message, error))
+			goto exit;
+	if (!pcont_conv_finish(conv, keep_xmlformat, &xmlformat, error))
+		goto exit;
+
+	if (!xmlformat)
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Raw contact without a contact record");
+
+exit:
+	pcont_conv_free(conv);
+	if (root)
+		plist_free(root);
+	return xmlformat;
+}
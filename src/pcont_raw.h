@@ -0,0 +1,72 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/**
+ * @file   pcont_raw.h
+ *
+ * @brief  Device contacts kept as received, for the iphone-contact objformat.
+ *
+ * A raw contact is the binary plist of the contact record and its phone,
+ * email and address records, laid out as two MobileSync batches:
+ * [ [ "com.apple.contacts.Contact", { id: contact } ], [ { id: attribute, ... } ] ].
+ * Hashing it needs no conversion, and pcont_raw_convert() hands both
+ * batches to the native converter once a xmlformat-contact is needed.
+ */
+
+#ifndef __PCONT_RAW__
+#define __PCONT_RAW__
+
+#include <opensync/opensync.h>
+#include <opensync/opensync-xmlformat.h>
+
+#include <plist/plist.h>
+
+#define PCONT_RAW_FORMAT "iphone-contact"
+
+typedef struct pcont_raw pcont_raw;
+
+/* called once per contact, takes ownership of data (osync_free) */
+typedef osync_bool (*pcont_raw_report_func)(const char *uid, char *data, unsigned int size, void *userdata, OSyncError **error);
+
+pcont_raw *pcont_raw_new(OSyncError **error);
+void pcont_raw_free(pcont_raw *raw);
+
+/* sorts the records of one batch by contact, batch stays owned by caller */
+osync_bool pcont_raw_feed(pcont_raw *raw, plist_t batch, OSyncError **error);
+
+/* one record of a contact, as stored by a fast session, record stays owned by caller */
+osync_bool pcont_raw_add(pcont_raw *raw, const char *id, plist_t record, osync_bool is_contact, OSyncError **error);
+
+/* hands every complete contact to report_func, in the order they were received */
+osync_bool pcont_raw_finish(pcont_raw *raw, pcont_raw_report_func report_func, void *userdata, OSyncError **error);
+
+/*
+ * Sorts the records of a SDMessageProcessChanges dict sent to the device
+ * by contact, under the ids the device gave them in its remap dict.
+ * Records stay owned by the caller, remap may be NULL.
+ */
+osync_bool pcont_raw_feed_sent(pcont_raw *raw, plist_t records, plist_t remap, OSyncError **error);
+
+/* the xmlformat-contact of a raw contact, unsorted */
+OSyncXMLFormat *pcont_raw_convert(const char *data, unsigned int size, OSyncError **error);
+
+#endif
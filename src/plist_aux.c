@@ -0,0 +1,291 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+#include "plist_aux.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+plist_t message_get_records(plist_t message)
+{
+	plist_t records = NULL;
+
+	for (records = plist_get_first_child(message); records; records = plist_get_next_sibling(records))
+		if (PLIST_DICT == plist_get_node_type(records))
+			break;
+	return records;
+}
+
+plist_t dict_get_value(plist_t dict, const char *key)
+{
+	plist_t node = NULL;
+
+	for (node = plist_get_first_child(dict); node; node = plist_get_next_sibling(node)) {
+		char *name = NULL;
+		int found = 0;
+
+		if (PLIST_KEY == plist_get_node_type(node)) {
+			plist_get_key_val(node, &name);
+			found = name && !strcmp(name, key);
+			free(name);
+		}
+
+		//skip the value
+		node = plist_get_next_sibling(node);
+		if (found || !node)
+			return node;
+	}
+	return NULL;
+}
+
+char *dict_get_string(plist_t dict, const char *key)
+{
+	char *value = NULL;
+	plist_t node = dict_get_value(dict, key);
+
+	if (node && PLIST_STRING == plist_get_node_type(node))
+		plist_get_string_val(node, &value);
+	return value;
+}
+
+static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static char *base64_encode(const unsigned char *data, uint64_t size)
+{
+	char *out = malloc((size + 2) / 3 * 4 + 1);
+	char *p = out;
+	uint64_t i = 0;
+
+	if (!out)
+		return NULL;
+
+	for (i = 0; i + 2 < size; i += 3) {
+		*p++ = base64_chars[data[i] >> 2];
+		*p++ = base64_chars[((data[i] & 0x03) << 4) | (data[i + 1] >> 4)];
+		*p++ = base64_chars[((data[i + 1] & 0x0f) << 2) | (data[i + 2] >> 6)];
+		*p++ = base64_chars[data[i + 2] & 0x3f];
+	}
+	if (i < size) {
+		*p++ = base64_chars[data[i] >> 2];
+		if (i + 1 < size) {
+			*p++ = base64_chars[((data[i] & 0x03) << 4) | (data[i + 1] >> 4)];
+			*p++ = base64_chars[(data[i + 1] & 0x0f) << 2];
+		}
+		else {
+			*p++ = base64_chars[(data[i] & 0x03) << 4];
+			*p++ = '=';
+		}
+		*p++ = '=';
+	}
+	*p = '\0';
+	return out;
+}
+
+/* value of a leaf node as plist_to_xml() writes it, to be freed */
+static char *leaf_content(plist_t node)
+{
+	char buffer[64];
+	char *value = NULL;
+
+	switch (plist_get_node_type(node)) {
+	case PLIST_UINT: {
+		uint64_t uint_val = 0;
+		plist_get_uint_val(node, &uint_val);
+		snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long) uint_val);
+		return strdup(buffer);
+	}
+	case PLIST_REAL: {
+		double real_val = 0;
+		plist_get_real_val(node, &real_val);
+		snprintf(buffer, sizeof(buffer), "%f", real_val);
+		return strdup(buffer);
+	}
+	case PLIST_DATE: {
+		int32_t sec = 0;
+		int32_t usec = 0;
+		time_t t = 0;
+		struct tm tm;
+
+		plist_get_date_val(node, &sec, &usec);
+		t = sec;
+		if (!gmtime_r(&t, &tm))
+			return NULL;
+		strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%SZ", &tm);
+		return strdup(buffer);
+	}
+	case PLIST_DATA: {
+		uint64_t size = 0;
+		plist_get_data_val(node, &value, &size);
+		if (value) {
+			char *encoded = base64_encode((const unsigned char *) value, size);
+			free(value);
+			return encoded;
+		}
+		return NULL;
+	}
+	case PLIST_KEY:
+		plist_get_key_val(node, &value);
+		return value;
+	default:
+		plist_get_string_val(node, &value);
+		return value;
+	}
+}
+
+static const char *node_name(plist_t node)
+{
+	uint8_t bool_val = 0;
+
+	switch (plist_get_node_type(node)) {
+	case PLIST_BOOLEAN:
+		plist_get_bool_val(node, &bool_val);
+		return bool_val ? "true" : "false";
+	case PLIST_UINT:
+		return "integer";
+	case PLIST_REAL:
+		return "real";
+	case PLIST_ARRAY:
+		return "array";
+	case PLIST_DICT:
+		return "dict";
+	case PLIST_DATE:
+		return "date";
+	case PLIST_DATA:
+		return "data";
+	case PLIST_KEY:
+		return "key";
+	default:
+		return "string";
+	}
+}
+
+static int add_plist_node(xmlNodePtr parent, plist_t node)
+{
+	plist_type type = plist_get_node_type(node);
+	xmlNodePtr element = NULL;
+	plist_t child = NULL;
+
+	if (PLIST_ARRAY == type || PLIST_DICT == type) {
+		if (!(element = xmlNewChild(parent, NULL, BAD_CAST node_name(node), NULL)))
+			return 0;
+		for (child = plist_get_first_child(node); child; child = plist_get_next_sibling(child))
+			if (!add_plist_node(element, child))
+				return 0;
+	}
+	else if (PLIST_BOOLEAN == type)
+		element = xmlNewChild(parent, NULL, BAD_CAST node_name(node), NULL);
+	else {
+		char *content = leaf_content(node);
+		//xmlNewTextChild() escapes the content, unlike xmlNewChild()
+		element = xmlNewTextChild(parent, NULL, BAD_CAST node_name(node), BAD_CAST (content ? content : ""));
+		free(content);
+	}
+	return NULL != element;
+}
+
+xmlDocPtr plist_to_xml_doc(plist_t plist)
+{
+	xmlDocPtr doc = xmlNewDoc(BAD_CAST "1.0");
+	xmlNodePtr root = NULL;
+
+	if (!doc)
+		return NULL;
+	if (!(root = xmlNewNode(NULL, BAD_CAST "plist")))
+		goto error;
+	xmlDocSetRootElement(doc, root);
+	xmlNewProp(root, BAD_CAST "version", BAD_CAST "1.0");
+
+	if (!add_plist_node(root, plist))
+		goto error;
+	return doc;
+
+error:
+	xmlFreeDoc(doc);
+	return NULL;
+}
+
+/* appends a copy of node to parent, containers recursively */
+static void append_plist_copy(plist_t parent, plist_t node)
+{
+	char *value = NULL;
+	uint64_t size = 0;
+
+	switch (plist_get_node_type(node)) {
+	case PLIST_ARRAY:
+	case PLIST_DICT:
+		plist_add_sub_node(parent, plist_copy_container(node));
+		break;
+	case PLIST_BOOLEAN: {
+		uint8_t bool_val = 0;
+		plist_get_bool_val(node, &bool_val);
+		plist_add_sub_bool_el(parent, bool_val);
+		break;
+	}
+	case PLIST_UINT: {
+		uint64_t uint_val = 0;
+		plist_get_uint_val(node, &uint_val);
+		plist_add_sub_uint_el(parent, uint_val);
+		break;
+	}
+	case PLIST_REAL: {
+		double real_val = 0;
+		plist_get_real_val(node, &real_val);
+		plist_add_sub_real_el(parent, real_val);
+		break;
+	}
+	case PLIST_DATE: {
+		int32_t sec = 0;
+		int32_t usec = 0;
+		plist_get_date_val(node, &sec, &usec);
+		plist_add_sub_date_el(parent, sec, usec);
+		break;
+	}
+	case PLIST_DATA:
+		plist_get_data_val(node, &value, &size);
+		plist_add_sub_data_el(parent, value ? value : "", size);
+		free(value);
+		break;
+	case PLIST_KEY:
+		plist_get_key_val(node, &value);
+		plist_add_sub_key_el(parent, value ? value : "");
+		free(value);
+		break;
+	default:
+		plist_get_string_val(node, &value);
+		plist_add_sub_string_el(parent, value ? value : "");
+		free(value);
+		break;
+	}
+}
+
+plist_t plist_copy_container(plist_t container)
+{
+	plist_t copy = PLIST_DICT == plist_get_node_type(container) ? plist_new_dict() : plist_new_array();
+	plist_t child = NULL;
+
+	for (child = plist_get_first_child(container); child; child = plist_get_next_sibling(child))
+		append_plist_copy(copy, child);
+	return copy;
+}
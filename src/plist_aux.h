@@ -0,0 +1,53 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/**
+ * @file   plist_aux.h
+ *
+ * @brief  Helpers to walk MobileSync messages as plist_t trees.
+ */
+
+#ifndef __PLIST_AUX__
+#define __PLIST_AUX__
+
+#include <plist/plist.h>
+#include <libxml/tree.h>
+
+/* the records dict of a message, the first dict it holds */
+plist_t message_get_records(plist_t message);
+
+/* returns the value node following key in a plist dict */
+plist_t dict_get_value(plist_t dict, const char *key);
+
+/* string value of key, to be freed, NULL when missing or not a string */
+char *dict_get_string(plist_t dict, const char *key);
+
+/* The tree xmlReadMemory() would build from plist_to_xml() output, built
+ * straight from the plist nodes. Whitespace between elements is left out.
+ * NULL on allocation failure, the caller frees the document.
+ */
+xmlDocPtr plist_to_xml_doc(plist_t plist);
+
+/* deep copy of a dict or array, libplist has no way to move a node */
+plist_t plist_copy_container(plist_t container);
+
+#endif
@@ -0,0 +1,257 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+#include "record_store.h"
+#include "pcont_conv.h"
+#include "plist_aux.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <libxml/hash.h>
+
+struct record_changes {
+	xmlHashTablePtr touched;
+	xmlHashTablePtr deleted;
+};
+
+record_changes *record_changes_new(OSyncError **error)
+{
+	record_changes *changes = osync_try_malloc0(sizeof(record_changes), error);
+	if (!changes)
+		return NULL;
+
+	changes->touched = xmlHashCreate(0);
+	changes->deleted = xmlHashCreate(0);
+	if (!changes->touched || !changes->deleted) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate changed contact tables");
+		record_changes_free(changes);
+		return NULL;
+	}
+	return changes;
+}
+
+void record_changes_free(record_changes *changes)
+{
+	if (!changes)
+		return;
+	if (changes->touched)
+		xmlHashFree(changes->touched, NULL);
+	if (changes->deleted)
+		xmlHashFree(changes->deleted, NULL);
+	osync_free(changes);
+}
+
+static void mark_contact(xmlHashTablePtr table, const char *id)
+{
+	if (id && *id)
+		xmlHashAddEntry(table, BAD_CAST id, table);
+}
+
+static osync_bool store_record(contact_cache *store, const char *id, plist_t record, const char *owner, OSyncError **error)
+{
+	char *bin = NULL;
+	uint32_t length = 0;
+	osync_bool result = FALSE;
+
+	plist_to_bin(record, &bin, &length);
+	if (!bin)
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to serialize record %s", id);
+	else
+		result = contact_cache_store(store, id, 0, owner ? owner : "", bin, length, error);
+	free(bin);
+	return result;
+}
+
+/* a removed attribute record leaves its contact changed */
+static void remove_record(contact_cache *store, const char *id, record_changes *changes)
+{
+	const char *owner = NULL;
+	const char *blob = NULL;
+	unsigned int size = 0;
+
+	if (!contact_cache_lookup(store, id, 0, &owner, &blob, &size))
+		return;
+	if (changes)
+		mark_contact(changes->touched, owner);
+	contact_cache_remove(store, id);
+}
+
+osync_bool record_store_batch(contact_cache *store, plist_t batch, record_changes *changes, OSyncError **error)
+{
+	osync_bool is_contact = (NULL != plist_find_node_by_string(batch, "com.apple.contacts.Contact"));
+	plist_t list = message_get_records(batch);
+	plist_t key = NULL;
+	plist_t value = NULL;
+	osync_bool result = TRUE;
+
+	for (key = list ? plist_get_first_child(list) : NULL; result && key; key = plist_get_next_sibling(value)) {
+		char *id = NULL;
+		char *owner = NULL;
+
+		if (!(value = plist_get_next_sibling(key)))
+			break;
+		if (PLIST_KEY != plist_get_node_type(key))
+			continue;
+		plist_get_key_val(key, &id);
+		if (!id)
+			continue;
+
+		//removed records come without a dict
+		if (PLIST_DICT != plist_get_node_type(value)) {
+			if (is_contact && !strchr(id, '/')) {
+				contact_cache_remove(store, id);
+				if (changes)
+					mark_contact(changes->deleted, id);
+			}
+			else if (strchr(id, '/'))
+				remove_record(store, id, changes);
+		}
+		//only what the converter would use, as pcont_raw does
+		else if (is_contact || (owner = pcont_attribute_contact(id, value))) {
+			result = store_record(store, id, value, owner, error);
+			if (changes)
+				mark_contact(changes->touched, is_contact ? id : owner);
+		}
+		free(owner);
+		free(id);
+	}
+
+	return result && contact_cache_flush(store, error);
+}
+
+typedef struct rebuild_scan {
+	contact_cache *store;
+	record_changes *changes;
+	pcont_raw *raw;
+	/* attribute records left by a removed contact */
+	plist_t orphans;
+	OSyncError **error;
+} rebuild_scan;
+
+static void check_touched_contact(void *payload, void *data, xmlChar *name)
+{
+	rebuild_scan *scan = (rebuild_scan *) data;
+	const char *owner = NULL;
+	const char *blob = NULL;
+	unsigned int size = 0;
+
+	if (!osync_error_is_set(scan->error) && !xmlHashLookup(scan->changes->deleted, name)
+	    && !contact_cache_lookup(scan->store, (const char *) name, 0, &owner, &blob, &size))
+		osync_error_set(scan->error, OSYNC_ERROR_CONVERT, "Contact %s changed without its record", (char *) name);
+}
+
+static void collect_touched_record(const char *id, const char *owner, const char *blob, unsigned int size, void *userdata)
+{
+	rebuild_scan *scan = (rebuild_scan *) userdata;
+	const char *contact_id = *owner ? owner : id;
+	const char *contact_owner = NULL;
+	const char *contact_blob = NULL;
+	unsigned int contact_size = 0;
+	plist_t record = NULL;
+
+	if (osync_error_is_set(scan->error))
+		return;
+
+	if (*owner && !contact_cache_lookup(scan->store, owner, 0, &contact_owner, &contact_blob, &contact_size)) {
+		plist_add_sub_string_el(scan->orphans, id);
+		return;
+	}
+	if (!xmlHashLookup(scan->changes->touched, BAD_CAST contact_id) || xmlHashLookup(scan->changes->deleted, BAD_CAST contact_id))
+		return;
+
+	plist_from_bin(blob, size, &record);
+	if (!record)
+		osync_error_set(scan->error, OSYNC_ERROR_CONVERT, "Stored record %s is damaged", id);
+	else {
+		pcont_raw_add(scan->raw, id, record, !*owner, scan->error);
+		plist_free(record);
+	}
+}
+
+osync_bool record_store_rebuild(contact_cache *store, record_changes *changes, pcont_raw_report_func report_func, void *userdata, OSyncError **error)
+{
+	rebuild_scan scan = { store, changes, NULL, NULL, error };
+	plist_t node = NULL;
+	osync_bool result = FALSE;
+
+	xmlHashScan(changes->touched, (xmlHashScanner) check_touched_contact, &scan);
+	if (!osync_error_is_set(error) && (scan.raw = pcont_raw_new(error))) {
+		scan.orphans = plist_new_array();
+		contact_cache_scan(store, collect_touched_record, &scan);
+	}
+	if (osync_error_is_set(error))
+		goto exit;
+
+	for (node = plist_get_first_child(scan.orphans); node; node = plist_get_next_sibling(node)) {
+		char *id = NULL;
+		plist_get_string_val(node, &id);
+		if (id)
+			contact_cache_remove(store, id);
+		free(id);
+	}
+	if (!contact_cache_flush(store, error))
+		goto exit;
+
+	result = pcont_raw_finish(scan.raw, report_func, userdata, error);
+
+exit:
+	pcont_raw_free(scan.raw);
+	if (scan.orphans)
+		plist_free(scan.orphans);
+	return result;
+}
+
+osync_bool record_store_contact(contact_cache *store, const char *uid, const char *data, unsigned int size, OSyncError **error)
+{
+	plist_t root = NULL;
+	plist_t message = NULL;
+	plist_t key = NULL;
+	plist_t value = NULL;
+	osync_bool result = TRUE;
+
+	plist_from_bin(data, size, &root);
+	if (!root || PLIST_ARRAY != plist_get_node_type(root)) {
+		osync_error_set(error, OSYNC_ERROR_CONVERT, "Invalid raw contact %s", uid);
+		result = FALSE;
+	}
+
+	//the contact record first, then its attributes
+	for (message = result ? plist_get_first_child(root) : NULL; result && message; message = plist_get_next_sibling(message)) {
+		plist_t list = message_get_records(message);
+
+		for (key = list ? plist_get_first_child(list) : NULL; result && key; key = plist_get_next_sibling(value)) {
+			char *id = NULL;
+
+			if (!(value = plist_get_next_sibling(key)))
+				break;
+			plist_get_key_val(key, &id);
+			if (id)
+				result = store_record(store, id, value, strcmp(id, uid) ? uid : NULL, error);
+			free(id);
+		}
+	}
+
+	if (root)
+		plist_free(root);
+	return result;
+}
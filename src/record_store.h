@@ -0,0 +1,66 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/**
+ * @file   record_store.h
+ *
+ * @brief  Every record of the device, kept for fast sessions.
+ *
+ * A fast session only sends the records that changed: a contact may come
+ * without its phones, or a phone without its contact. The store keeps
+ * every record in a contact_cache under its id, with the contact an
+ * attribute record belongs to as its hash ("" for a contact record) and
+ * the binary plist of the record as its blob. It is written batch by
+ * batch and flushed after each one, a fast session then rebuilds only the
+ * contacts its changes touched.
+ */
+
+#ifndef __RECORD_STORE__
+#define __RECORD_STORE__
+
+#include <opensync/opensync.h>
+
+#include <plist/plist.h>
+
+#include "contact_cache.h"
+#include "pcont_raw.h"
+
+/* the contacts a fast session changed and those it removed */
+typedef struct record_changes record_changes;
+
+record_changes *record_changes_new(OSyncError **error);
+void record_changes_free(record_changes *changes);
+
+/* writes the records of one batch and flushes, changes is NULL in a slow session, batch stays owned by caller */
+osync_bool record_store_batch(contact_cache *store, plist_t batch, record_changes *changes, OSyncError **error);
+
+/*
+ * Hands every contact the changes touched and that is still on the device
+ * to report_func as a raw contact, rebuilt from the store in one pass.
+ * The attribute records of removed contacts go from the store.
+ */
+osync_bool record_store_rebuild(contact_cache *store, record_changes *changes, pcont_raw_report_func report_func, void *userdata, OSyncError **error);
+
+/* writes the records of a raw contact under uid, as the device will send them */
+osync_bool record_store_contact(contact_cache *store, const char *uid, const char *data, unsigned int size, OSyncError **error);
+
+#endif
@@ -0,0 +1,230 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+#include "sync_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* bucket n counts the records that took less than 2^n microseconds */
+#define LATENCY_BUCKETS 32
+
+static const char *counter_names[STATS_COUNTERS] = {
+	"messages_sent",
+	"messages_received",
+	"bytes_received",
+	"batches",
+	"batches_resumed",
+	"records_converted",
+	"records_failed",
+	"records_quarantined",
+	"records_skipped",
+	"records_cached",
+	"changes_reported",
+	"changes_committed",
+};
+
+static const char *timer_names[STATS_TIMERS] = {
+	"connect",
+	"get_changes",
+	"receive",
+	"device_wait",
+	"plist_xml",
+	"xslt",
+	"convert",
+	"parse",
+	"report",
+	"commit",
+};
+
+struct sync_stats {
+	pthread_mutex_t lock;
+	time_t started;
+	uint64_t counters[STATS_COUNTERS];
+	uint64_t timers[STATS_TIMERS];
+	uint64_t latency[LATENCY_BUCKETS];
+	uint64_t latency_sum;
+	uint64_t latency_max;
+};
+
+sync_stats *sync_stats_new(OSyncError **error)
+{
+	sync_stats *stats = osync_try_malloc0(sizeof(sync_stats), error);
+	if (!stats)
+		return NULL;
+
+	pthread_mutex_init(&stats->lock, NULL);
+	stats->started = time(NULL);
+	return stats;
+}
+
+void sync_stats_free(sync_stats *stats)
+{
+	if (!stats)
+		return;
+	pthread_mutex_destroy(&stats->lock);
+	osync_free(stats);
+}
+
+void sync_stats_reset(sync_stats *stats)
+{
+	if (!stats)
+		return;
+
+	pthread_mutex_lock(&stats->lock);
+	memset(stats->counters, 0, sizeof(stats->counters));
+	memset(stats->timers, 0, sizeof(stats->timers));
+	memset(stats->latency, 0, sizeof(stats->latency));
+	stats->latency_sum = 0;
+	stats->latency_max = 0;
+	stats->started = time(NULL);
+	pthread_mutex_unlock(&stats->lock);
+}
+
+uint64_t sync_stats_now(sync_stats *stats)
+{
+	struct timespec ts;
+
+	if (!stats)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void sync_stats_count(sync_stats *stats, sync_stats_counter counter, uint64_t n)
+{
+	if (!stats)
+		return;
+
+	pthread_mutex_lock(&stats->lock);
+	stats->counters[counter] += n;
+	pthread_mutex_unlock(&stats->lock);
+}
+
+void sync_stats_time(sync_stats *stats, sync_stats_timer timer, uint64_t start)
+{
+	uint64_t elapsed = 0;
+
+	if (!stats)
+		return;
+	elapsed = sync_stats_now(stats) - start;
+
+	pthread_mutex_lock(&stats->lock);
+	stats->timers[timer] += elapsed;
+	pthread_mutex_unlock(&stats->lock);
+}
+
+void sync_stats_record(sync_stats *stats, uint64_t start)
+{
+	uint64_t us = 0;
+	int bucket = 0;
+
+	if (!stats)
+		return;
+	us = (sync_stats_now(stats) - start) / 1000;
+
+	while (bucket < LATENCY_BUCKETS - 1 && us >= (1ULL << bucket))
+		bucket++;
+
+	pthread_mutex_lock(&stats->lock);
+	stats->latency[bucket]++;
+	stats->latency_sum += us;
+	if (us > stats->latency_max)
+		stats->latency_max = us;
+	pthread_mutex_unlock(&stats->lock);
+}
+
+static void write_json(sync_stats *stats, FILE *file, const char *result)
+{
+	uint64_t records = 0;
+	int i = 0;
+
+	fprintf(file, "{\n\t\"started\": %ld,\n\t\"finished\": %ld,\n\t\"result\": \"%s\",\n",
+		(long) stats->started, (long) time(NULL), result);
+
+	fprintf(file, "\t\"counters\": {");
+	for (i = 0; i < STATS_COUNTERS; i++)
+		fprintf(file, "%s\n\t\t\"%s\": %llu", i ? "," : "", counter_names[i],
+			(unsigned long long) stats->counters[i]);
+	fprintf(file, "\n\t},\n");
+
+	fprintf(file, "\t\"timers_ms\": {");
+	for (i = 0; i < STATS_TIMERS; i++)
+		fprintf(file, "%s\n\t\t\"%s\": %.3f", i ? "," : "", timer_names[i],
+			stats->timers[i] / 1e6);
+	fprintf(file, "\n\t},\n");
+
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+		records += stats->latency[i];
+
+	//only non empty buckets, keyed by their upper bound
+	fprintf(file, "\t\"record_latency_us\": {\n\t\t\"count\": %llu,\n\t\t\"sum\": %llu,\n\t\t\"max\": %llu,\n\t\t\"buckets\": {",
+		(unsigned long long) records, (unsigned long long) stats->latency_sum,
+		(unsigned long long) stats->latency_max);
+	for (i = 0, records = 0; i < LATENCY_BUCKETS; i++) {
+		if (!stats->latency[i])
+			continue;
+		fprintf(file, "%s\n\t\t\t\"%llu\": %llu", records++ ? "," : "",
+			1ULL << i, (unsigned long long) stats->latency[i]);
+	}
+	fprintf(file, "\n\t\t}\n\t}\n}\n");
+}
+
+osync_bool sync_stats_write(sync_stats *stats, const char *path, const char *result, OSyncError **error)
+{
+	char *tmp_path = NULL;
+	FILE *file = NULL;
+	osync_bool ok = FALSE;
+
+	if (!stats)
+		return TRUE;
+
+	if (!(tmp_path = osync_strdup_printf("%s.tmp", path))) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to allocate stats path");
+		return FALSE;
+	}
+
+	if (!(file = fopen(tmp_path, "w"))) {
+		osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to write %s: %s", tmp_path, strerror(errno));
+		goto exit;
+	}
+
+	pthread_mutex_lock(&stats->lock);
+	write_json(stats, file, result);
+	pthread_mutex_unlock(&stats->lock);
+
+	if (fclose(file) || rename(tmp_path, path)) {
+		osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to write %s: %s", path, strerror(errno));
+		unlink(tmp_path);
+		goto exit;
+	}
+	ok = TRUE;
+
+exit:
+	osync_free(tmp_path);
+	return ok;
+}
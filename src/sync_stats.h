@@ -0,0 +1,92 @@
+/** iPhone plugin
+ *
+ * Copyright (c) 2009 Jonathan Beck <jonabeck@gmail.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Lesser Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301  USA
+ *
+ */
+
+
+/**
+ * @file   sync_stats.h
+ *
+ * @brief  Counters and timings of a sync, written as JSON once it is done.
+ *
+ * Every function takes a NULL stats as "disabled" and does nothing, so
+ * call sites do not need to check. All of them may be called from the
+ * receive thread and the conversion workers.
+ */
+
+#ifndef __SYNC_STATS__
+#define __SYNC_STATS__
+
+#include <opensync/opensync.h>
+
+#include <stdint.h>
+
+typedef enum {
+	STATS_MESSAGES_SENT,
+	STATS_MESSAGES_RECEIVED,
+	STATS_BYTES_RECEIVED,
+	STATS_BATCHES,
+	STATS_BATCHES_RESUMED,
+	STATS_RECORDS_CONVERTED,
+	STATS_RECORDS_FAILED,
+	STATS_RECORDS_QUARANTINED,
+	STATS_RECORDS_SKIPPED,
+	STATS_RECORDS_CACHED,
+	STATS_CHANGES_REPORTED,
+	STATS_CHANGES_COMMITTED,
+	STATS_COUNTERS
+} sync_stats_counter;
+
+typedef enum {
+	STATS_CONNECT,
+	STATS_GET_CHANGES,
+	STATS_RECEIVE,
+	STATS_DEVICE_WAIT,
+	STATS_PLIST_XML,
+	STATS_XSLT,
+	STATS_CONVERT,
+	STATS_PARSE,
+	STATS_REPORT,
+	STATS_COMMIT,
+	STATS_TIMERS
+} sync_stats_timer;
+
+typedef struct sync_stats sync_stats;
+
+sync_stats *sync_stats_new(OSyncError **error);
+void sync_stats_free(sync_stats *stats);
+
+/* forgets everything, at the start of a sync */
+void sync_stats_reset(sync_stats *stats);
+
+/* monotonic nanoseconds to pass to the functions below, 0 when disabled */
+uint64_t sync_stats_now(sync_stats *stats);
+
+void sync_stats_count(sync_stats *stats, sync_stats_counter counter, uint64_t n);
+
+/* adds the time since start to timer */
+void sync_stats_time(sync_stats *stats, sync_stats_timer timer, uint64_t start);
+
+/* one record took the time since start to convert, kept as a log2 histogram */
+void sync_stats_record(sync_stats *stats, uint64_t start);
+
+/* replaces the file at path, result tells how the sync ended */
+osync_bool sync_stats_write(sync_stats *stats, const char *path, const char *result, OSyncError **error);
+
+#endif
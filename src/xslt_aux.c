@@ -0,0 +1,341 @@
+/*
+  Copyright (c) 2008 Instituto Nokia de Tecnologia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  * Redistributions of source code must retain the above copyright notice,
+  this list of conditions and the following disclaimer.
+  * Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+  * Neither the name of the INdT nor the names of its contributors
+  may be used to endorse or promote products derived from this software
+  without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+  POSSIBILITY OF SUCH DAMAGE.
+*/
+/**
+ * @file   xslt_aux.c
+ * @author Adenilson Cavalcanti da Silva <adenilson.silva@indt.org.br>
+ * @date   Mon Aug 25 15:50:20 2008
+ *
+ * @brief  A XSLT helper module, converts a XML doc to another format
+ * using a xslt file.
+ *
+ */
+
+#include "xslt_aux.h"
+
+#include <libxml/parser.h>
+#include <libxml/xmlmemory.h>
+#include <libxslt/transform.h>
+#include <libxslt/variables.h>
+#include <libxslt/xslt.h>
+#include <libxslt/xsltInternals.h>
+#include <libxslt/xsltutils.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* A compiled stylesheet, never modified once parsed. Entries replaced by
+ * a newer file stay alive until their last user lets go of them.
+ */
+struct xslt_sheet {
+	char *path;
+	time_t mtime;
+	xsltStylesheetPtr cur;
+	int refcount;
+	char stale;
+	struct xslt_sheet *next;
+};
+
+static pthread_once_t xslt_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t xslt_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xslt_sheet *xslt_cache = NULL;
+
+static void xslt_global_init(void)
+{
+	//libxml defaults are process wide, set them only once
+	xmlInitParser();
+	xmlSubstituteEntitiesDefault(1);
+	xmlLoadExtDtdDefaultValue = 1;
+}
+
+static void xslt_sheet_free(struct xslt_sheet *sheet)
+{
+	if (sheet->cur)
+		xsltFreeStylesheet(sheet->cur);
+	free(sheet->path);
+	free(sheet);
+}
+
+/* must be called with xslt_cache_lock held */
+static void xslt_sheet_unlink(struct xslt_sheet *sheet)
+{
+	struct xslt_sheet **prev = &xslt_cache;
+
+	while (*prev && *prev != sheet)
+		prev = &(*prev)->next;
+	if (*prev)
+		*prev = sheet->next;
+	sheet->next = NULL;
+}
+
+static struct xslt_sheet *xslt_sheet_get(const char *path)
+{
+	struct xslt_sheet *sheet = NULL;
+	struct xslt_sheet *old = NULL;
+	struct stat st;
+
+	if (stat(path, &st)) {
+		fprintf(stderr, "Cannot stat stylesheet %s!\n", path);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&xslt_cache_lock);
+
+	for (sheet = xslt_cache; sheet; sheet = sheet->next)
+		if (!strcmp(sheet->path, path))
+			break;
+
+	if (sheet && sheet->mtime == st.st_mtime) {
+		sheet->refcount++;
+		goto exit;
+	}
+
+	//changed on disk, drop it from the cache once nobody uses it
+	if ((old = sheet)) {
+		xslt_sheet_unlink(old);
+		old->stale = 1;
+		if (!old->refcount)
+			xslt_sheet_free(old);
+	}
+
+	sheet = (struct xslt_sheet *)malloc(sizeof(struct xslt_sheet));
+	if (!sheet)
+		goto exit;
+	memset(sheet, 0, sizeof(struct xslt_sheet));
+
+	sheet->path = strdup(path);
+	sheet->mtime = st.st_mtime;
+	sheet->cur = xsltParseStylesheetFile((const xmlChar *)path);
+	if (!sheet->path || !sheet->cur) {
+		fprintf(stderr, "Cannot create XSLT context!\n");
+		xslt_sheet_free(sheet);
+		sheet = NULL;
+		goto exit;
+	}
+
+	sheet->refcount = 1;
+	sheet->next = xslt_cache;
+	xslt_cache = sheet;
+
+exit:
+	pthread_mutex_unlock(&xslt_cache_lock);
+	return sheet;
+}
+
+/* The cache keeps current stylesheets compiled between connections, only
+ * the ones superseded by a newer file are released here.
+ */
+static void xslt_sheet_put(struct xslt_sheet *sheet)
+{
+	if (!sheet)
+		return;
+
+	pthread_mutex_lock(&xslt_cache_lock);
+	if (!--sheet->refcount && sheet->stale)
+		xslt_sheet_free(sheet);
+	pthread_mutex_unlock(&xslt_cache_lock);
+}
+
+struct xslt_resources *xslt_new(void)
+{
+	struct xslt_resources *result;
+	result = (struct xslt_resources *)malloc(sizeof(struct xslt_resources));
+	if (result)
+		memset(result, 0, sizeof(struct xslt_resources));
+
+	return result;
+}
+
+int xslt_initialize(struct xslt_resources *ctx, const char *stylesheet_path)
+{
+	int result = -1;
+	struct xslt_sheet *sheet = NULL;
+	if (!stylesheet_path || !ctx)
+		goto exit;
+
+	pthread_once(&xslt_once, xslt_global_init);
+
+	//take the new reference first, a reconnect keeps the same sheet
+	if (!(sheet = xslt_sheet_get(stylesheet_path)))
+		goto exit;
+
+	xslt_sheet_put(ctx->sheet);
+	ctx->sheet = sheet;
+
+	result = 0;
+exit:
+	return result;
+}
+
+int xslt_transform(struct xslt_resources *ctx, const char *document)
+{
+	int result = -1;
+	if (!ctx || !ctx->sheet || !document)
+		goto exit;
+
+	if (ctx->doc)
+		xmlFreeDoc(ctx->doc);
+	if (ctx->output)
+		xmlFreeDoc(ctx->output);
+	ctx->output = NULL;
+
+	ctx->doc = xmlReadMemory(document, strlen(document), "noname.xml",
+				 NULL, 0);
+	if (!ctx->doc) {
+		fprintf(stderr, "Cannot create document with "
+			"entry!\n");
+		goto cleanup;
+	}
+
+	ctx->output = xsltApplyStylesheet(ctx->sheet->cur, ctx->doc, NULL);
+	if (!ctx->output) {
+		fprintf(stderr, "Cannot create document with "
+			"output!\n");
+		goto cleanup;
+	}
+
+	if (ctx->xml_str) {
+		xmlFree(ctx->xml_str);
+		ctx->xml_str = NULL;
+	}
+	xmlDocDumpMemory(ctx->output, &(ctx->xml_str), &(ctx->length));
+
+	result = 0;
+
+cleanup:
+	if (ctx->doc)
+		xmlFreeDoc(ctx->doc);
+	ctx->doc = NULL;
+
+	if (ctx->output)
+		xmlFreeDoc(ctx->output);
+	ctx->output = NULL;
+exit:
+
+	return result;
+}
+
+xmlDocPtr xslt_transform_doc(struct xslt_resources *ctx, const char *document)
+{
+	return xslt_transform_doc_params(ctx, document, NULL);
+}
+
+xmlDocPtr xslt_transform_doc_params(struct xslt_resources *ctx, const char *document, const char **params)
+{
+	xmlDocPtr doc = NULL;
+	xmlDocPtr output = NULL;
+	xsltTransformContextPtr transform = NULL;
+	if (!ctx || !ctx->sheet || !document)
+		goto exit;
+
+	doc = xmlReadMemory(document, strlen(document), "noname.xml",
+			    NULL, 0);
+	if (!doc) {
+		fprintf(stderr, "Cannot create document with "
+			"entry!\n");
+		goto exit;
+	}
+
+	if (params) {
+		//values are plain strings, not XPath expressions
+		transform = xsltNewTransformContext(ctx->sheet->cur, doc);
+		if (!transform || xsltQuoteUserParams(transform, params)) {
+			fprintf(stderr, "Cannot set stylesheet parameters!\n");
+			goto cleanup;
+		}
+	}
+
+	output = xsltApplyStylesheetUser(ctx->sheet->cur, doc, NULL, NULL,
+					 NULL, transform);
+	if (!output)
+		fprintf(stderr, "Cannot create document with "
+			"output!\n");
+
+cleanup:
+	if (transform)
+		xsltFreeTransformContext(transform);
+	xmlFreeDoc(doc);
+exit:
+	return output;
+}
+
+xmlDocPtr xslt_transform_tree(struct xslt_resources *ctx, xmlDocPtr doc)
+{
+	xmlDocPtr output = NULL;
+	if (!ctx || !ctx->sheet || !doc)
+		return NULL;
+
+	output = xsltApplyStylesheet(ctx->sheet->cur, doc, NULL);
+	if (!output)
+		fprintf(stderr, "Cannot create document with "
+			"output!\n");
+	return output;
+}
+
+static xmlNodePtr next_element(xmlNodePtr node)
+{
+	while (node && XML_ELEMENT_NODE != node->type)
+		node = node->next;
+	return node;
+}
+
+xmlNodePtr xslt_result_next(xmlDocPtr doc, xmlNodePtr node)
+{
+	xmlNodePtr root = NULL;
+	xmlNodePtr next = NULL;
+
+	if (!doc)
+		return NULL;
+	if (node && (next = next_element(node->next)))
+		return next;
+
+	for (root = node ? node->parent->next : doc->children; root; root = root->next)
+		if (XML_ELEMENT_NODE == root->type && (next = next_element(root->children)))
+			return next;
+	return NULL;
+}
+
+void xslt_delete(struct xslt_resources *ctx)
+{
+	if (!ctx)
+		return;
+
+	if (ctx->doc)
+		xmlFreeDoc(ctx->doc);
+	if (ctx->output)
+		xmlFreeDoc(ctx->output);
+	if (ctx->xml_str)
+		xmlFree(ctx->xml_str);
+	//other libxml users share the parser, never clean it up from here
+	xslt_sheet_put(ctx->sheet);
+
+	free(ctx);
+}
@@ -36,152 +36,65 @@
  *
  * Depends on libxml and libxslt.
  *
+ * Compiled stylesheets are kept in a process wide cache keyed by path
+ * and modification time, so every 'xslt_resources' loading the same
+ * file shares one read-only xsltStylesheet. A 'xslt_resources' holds
+ * the per transform state and must not be used by two threads at once;
+ * give each thread its own.
+ *
  * \todo:
  * - doxygen comments about use
- * - move code to a '.c' file or make functions static
- * - make 'xslt_resources' an abstract type
  *
  */
 
 #ifndef __XSLT_AUX__
 #define __XSLT_AUX__
 
-#include <libxml/HTMLtree.h>
-#include <libxml/catalog.h>
-#include <libxml/debugXML.h>
-#include <libxml/xinclude.h>
-#include <libxml/xmlIO.h>
-#include <libxml/xmlmemory.h>
-#include <libxslt/transform.h>
-#include <libxslt/xslt.h>
-#include <libxslt/xsltInternals.h>
-#include <libxslt/xsltutils.h>
-#include <string.h>
+#include <libxml/tree.h>
+
+struct xslt_sheet;
 
 struct xslt_resources {
 	xmlDocPtr output;
 	xmlDocPtr doc;
-	xsltStylesheetPtr cur;
+	struct xslt_sheet *sheet;
 	xmlChar *xml_str;
 	int length;
-	char init_flag;
 };
 
-struct xslt_resources *xslt_new(void)
-{
-	struct xslt_resources *result;
-	result = (struct xslt_resources *)malloc(sizeof(struct xslt_resources));
-	if (result)
-		memset(result, 0, sizeof(struct xslt_resources));
-
-	return result;
-}
-
-int xslt_initialize(struct xslt_resources *ctx, const char *stylesheet_path)
-{
-	int result = -1;
-	if (!stylesheet_path || !ctx)
-		goto exit;
-
-	xmlSubstituteEntitiesDefault(1);
-	xmlLoadExtDtdDefaultValue = 1;
-
-	if (ctx->cur)
-		xsltFreeStylesheet(ctx->cur);
-
-	ctx->cur = xsltParseStylesheetFile((const xmlChar *)stylesheet_path);
-	if (!ctx->cur) {
-		fprintf(stderr, "Cannot create XSLT context!\n");
-		goto exit;
-	}
-
-	result = 0;
-	ctx->init_flag = 1;
-exit:
-	return result;
-}
-
-int xslt_transform(struct xslt_resources *ctx, const char *document)
-{
-	int result = -1;
-	if (!ctx || !document)
-		goto exit;
-
-	if (ctx->doc)
-		xmlFreeDoc(ctx->doc);
-	if (ctx->output)
-		xmlFreeDoc(ctx->output);
-	ctx->output = NULL;
-
-	ctx->doc = xmlReadMemory(document, strlen(document), "noname.xml",
-				 NULL, 0);
-	if (!ctx->doc) {
-		fprintf(stderr, "Cannot create document with "
-			"entry!\n");
-		goto cleanup;
-	}
-
-	ctx->output = xsltApplyStylesheet(ctx->cur, ctx->doc, NULL);
-	if (!ctx->output) {
-		fprintf(stderr, "Cannot create document with "
-			"output!\n");
-		goto cleanup;
-	}
-
-	if (ctx->xml_str) {
-		xmlFree(ctx->xml_str);
-		ctx->xml_str = NULL;
-	}
-	xmlDocDumpMemory(ctx->output, &(ctx->xml_str), &(ctx->length));
-
-	result = 0;
-
-cleanup:
-	if (ctx->doc)
-		xmlFreeDoc(ctx->doc);
-	ctx->doc = NULL;
-
-	if (ctx->output)
-		xmlFreeDoc(ctx->output);
-	ctx->output = NULL;
-exit:
-
-	return result;
-}
-
-void xslt_delete(struct xslt_resources *ctx)
-{
-	if (!ctx)
-		return;
-
-	/* TODO: 'output' is pointing to a non null value (probably an
-	 * overflow in some other place) even when not initialized.
-	 * It happens just after all clients are disconnected.
-	 * I must investigate it further, for while the flag is a work
-	 * around to stop msync to crash.
-	 */
-/* 	fprintf(stderr, "\ndoc: %x\tout: %x\txml: %x\tcur: %x\n\n", */
-/* 		ctx->doc, ctx->output, ctx->xml_str, ctx->cur); */
-
-	if (!ctx->init_flag)
-		goto exit;
-
-
-	if (ctx->doc)
-		xmlFreeDoc(ctx->doc);
-	if (ctx->output)
-		xmlFreeDoc(ctx->output);
-	if (ctx->xml_str)
-		xmlFree(ctx->xml_str);
-	if (ctx->cur) {
-		xsltFreeStylesheet(ctx->cur);
-		xsltCleanupGlobals();
-		xmlCleanupParser();
-	}
-
-exit:
-
-	free(ctx);
-}
+struct xslt_resources *xslt_new(void);
+
+/* (re)binds ctx to the cached stylesheet, compiling it on first use or
+ * when the file changed on disk
+ */
+int xslt_initialize(struct xslt_resources *ctx, const char *stylesheet_path);
+
+/* transforms document, the result is dumped to 'xml_str' */
+int xslt_transform(struct xslt_resources *ctx, const char *document);
+
+/* Same as xslt_transform(), but hands back the result tree instead of
+ * dumping it to 'xml_str'. The caller owns the returned document.
+ */
+xmlDocPtr xslt_transform_doc(struct xslt_resources *ctx, const char *document);
+
+/* Same as xslt_transform_doc(), passing the NULL terminated name/value
+ * pairs in params to the stylesheet as string parameters.
+ */
+xmlDocPtr xslt_transform_doc_params(struct xslt_resources *ctx, const char *document, const char **params);
+
+/* Same as xslt_transform_doc(), for a document that is already parsed.
+ * doc stays owned by the caller.
+ */
+xmlDocPtr xslt_transform_tree(struct xslt_resources *ctx, xmlDocPtr doc);
+
+/* Walks the records of a stylesheet result. A result can have several
+ * top level elements, pcont2osync.xslt makes one per contact batch, so
+ * this steps over the children of each of them in turn: node NULL gives
+ * the first one, NULL is returned after the last.
+ */
+xmlNodePtr xslt_result_next(xmlDocPtr doc, xmlNodePtr node);
+
+/* drops the stylesheet reference, libxml global state is left alone */
+void xslt_delete(struct xslt_resources *ctx);
 
 #endif